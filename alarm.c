@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "flowmaster_private.h"
+
+/*
+ * Alarms, checked against every sample as it is published.
+ *
+ * Each alarm raises as soon as a single sample crosses its threshold
+ * and only clears once the value has come back past the threshold by
+ * the hysteresis margin, so a value sitting on the line doesn't make
+ * the callback chatter.
+ * */
+
+struct fm_alarms_s {
+	fm_mutex lock;
+	fm_alarm_config config;
+	fm_alarm_callback cb;
+	void *userdata;
+	int active[FM_ALARM_COUNT];
+
+	/* Smooths coolant temperature for the rise rate alarm */
+	fm_filter *rise;
+};
+
+void
+fm_alarm_defaults(fm_alarm_config *config)
+{
+	memset(config, 0, sizeof(*config));
+
+	config->enabled = (1 << FM_ALARM_PUMP_STALL) | (1 << FM_ALARM_COOLANT_RISE) | (1 << FM_ALARM_COOLANT_DELTA);
+
+	config->stall_rpm = 300;
+	config->stall_duty = 0.05f;
+	config->stall_hysteresis = 150;
+
+	config->rise_rate = 0.5f;
+	config->rise_seconds = 2.0f;
+	config->rise_hysteresis = 0.1f;
+
+	config->delta_min = -5.0f;
+	config->delta_max = 15.0f;
+	config->delta_hysteresis = 1.0f;
+}
+
+fm_rc
+fm_set_alarms(flowmaster *fm, const fm_alarm_config *config, fm_alarm_callback cb, void *userdata)
+{
+	fm_alarms *alarms = fm->alarms;
+
+	if(alarms == NULL){
+		alarms = (fm_alarms*) calloc(1, sizeof(fm_alarms));
+		if(alarms == NULL){
+			return FM_NO_MEMORY;
+		}
+
+		alarms->rise = fm_filter_create();
+		if(alarms->rise == NULL){
+			free(alarms);
+			return FM_NO_MEMORY;
+		}
+
+		fm_mutex_init(&alarms->lock);
+	}
+
+	fm_mutex_lock(&alarms->lock);
+
+	if(config != NULL){
+		alarms->config = *config;
+	}
+	else {
+		fm_alarm_defaults(&alarms->config);
+	}
+
+	alarms->cb = cb;
+	alarms->userdata = userdata;
+	memset(alarms->active, 0, sizeof(alarms->active));
+	fm_filter_configure(alarms->rise, FM_FIELD_COOLANT_TEMP, 1, 0.0, alarms->config.rise_seconds);
+
+	fm_mutex_unlock(&alarms->lock);
+
+	fm->alarms = alarms;
+
+	return FM_OK;
+}
+
+int
+fm_alarm_active(flowmaster *fm, fm_alarm alarm)
+{
+	int active;
+
+	if(fm->alarms == NULL || (int) alarm < 0 || alarm >= FM_ALARM_COUNT){
+		return 0;
+	}
+
+	fm_mutex_lock(&fm->alarms->lock);
+	active = fm->alarms->active[alarm];
+	fm_mutex_unlock(&fm->alarms->lock);
+
+	return active;
+}
+
+void
+fm_alarms_destroy(fm_alarms *alarms)
+{
+	if(alarms == NULL){
+		return;
+	}
+
+	fm_filter_destroy(alarms->rise);
+	fm_mutex_destroy(&alarms->lock);
+	free(alarms);
+}
+
+/*
+ * Raise when raise_when holds, clear when clear_when holds,
+ * otherwise stay as we are.  Returns 1 if the state changed.
+ * */
+static int
+fm_alarm_update(fm_alarms *alarms, fm_alarm alarm, int raise_when, int clear_when)
+{
+	int *active = &alarms->active[alarm];
+
+	if(!(alarms->config.enabled & (1 << alarm))){
+		raise_when = 0;
+		clear_when = 1;
+	}
+
+	if(!*active && raise_when){
+		*active = 1;
+		return 1;
+	}
+
+	if(*active && clear_when){
+		*active = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+fm_alarms_check(flowmaster *fm, const fm_sample *sample)
+{
+	fm_alarms *alarms = fm->alarms;
+	const fm_alarm_config *config = &alarms->config;
+	const fm_data *data = &sample->data;
+	int changed[FM_ALARM_COUNT];
+	int active[FM_ALARM_COUNT];
+	fm_alarm_callback cb;
+	void *userdata;
+	double coolant;
+	double rise;
+	double delta;
+	int i;
+
+	fm_mutex_lock(&alarms->lock);
+
+	fm_filter_add(alarms->rise, sample);
+	fm_filter_get(alarms->rise, FM_FIELD_COOLANT_TEMP, &coolant, &rise);
+
+	delta = data->coolant_temp - data->ambient_temp;
+
+	/* A stall only counts while the pump is being driven */
+	changed[FM_ALARM_PUMP_STALL] = fm_alarm_update(alarms, FM_ALARM_PUMP_STALL,
+		data->pump_rpm < config->stall_rpm && data->pump_duty_cycle >= config->stall_duty,
+		data->pump_rpm >= config->stall_rpm + config->stall_hysteresis || data->pump_duty_cycle < config->stall_duty);
+
+	changed[FM_ALARM_COOLANT_RISE] = fm_alarm_update(alarms, FM_ALARM_COOLANT_RISE,
+		rise > config->rise_rate,
+		rise <= config->rise_rate - config->rise_hysteresis);
+
+	changed[FM_ALARM_COOLANT_DELTA] = fm_alarm_update(alarms, FM_ALARM_COOLANT_DELTA,
+		delta > config->delta_max || delta < config->delta_min,
+		delta <= config->delta_max - config->delta_hysteresis && delta >= config->delta_min + config->delta_hysteresis);
+
+	memcpy(active, alarms->active, sizeof(active));
+	cb = alarms->cb;
+	userdata = alarms->userdata;
+
+	fm_mutex_unlock(&alarms->lock);
+
+	/* Something went wrong, poll fast until it settles */
+	for(i = 0; i < FM_ALARM_COUNT; i++){
+		if(changed[i] && active[i]){
+			fm_governor_kick(fm);
+		}
+	}
+
+	/* Outside the lock, so the callback may look at the alarm state */
+	if(cb == NULL){
+		return;
+	}
+
+	for(i = 0; i < FM_ALARM_COUNT; i++){
+		if(changed[i]){
+			cb(fm, (fm_alarm) i, active[i], sample, userdata);
+		}
+	}
+}
@@ -13,6 +13,20 @@
 #define BL_PROGRAM 'C'
 #define BL_RESET 'R'
 
+/*
+ * Page writes.  BL_PAGE_SIZE is answered with BL_ACK and the flash page
+ * size in bytes, high byte first, bootloaders without page writes don't
+ * answer it.  BL_WRITE_PAGE is followed by the page address and the
+ * length (both high byte first), that many bytes in flash order, then a
+ * CRC-16 over everything after the command byte (avr-libc's
+ * _crc16_update() from 0xFFFF), and answered with a single BL_ACK once
+ * the page is written, or BL_NAK.  To get back in step after an error
+ * the host sends zeros, so a zero length must be NAKed and a zero byte
+ * outside a command ignored.
+ * */
+#define BL_PAGE_SIZE 'P'
+#define BL_WRITE_PAGE 'W'
+
 /* Show Programming message */
 #define BL_PROGRAM_MESSAGE 'm'
 
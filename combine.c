@@ -0,0 +1,287 @@
+#include <stdlib.h>
+
+#include "protocol.h"
+#include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
+
+/*
+ * Write combining for fan and pump speeds.
+ *
+ * Each setpoint the controller takes has a slot holding the latest value
+ * asked for.  Setting a speed just fills in the slot and, if nothing is
+ * waiting to go out, arms the flusher's timer for one interval after the
+ * last flush.  However many times a slot is written before then, only
+ * the last value is sent.
+ * */
+
+#define FM_MS 1000000ull
+
+enum fm_slot_e {
+	FM_SLOT_FAN,
+	FM_SLOT_PUMP,
+	FM_SLOT_COUNT
+};
+
+static const int fm_slot_packet[FM_SLOT_COUNT] = {
+	PACKET_TYPE_SET_FAN,
+	PACKET_TYPE_SET_PUMP
+};
+
+struct fm_combine_s {
+	flowmaster *fm;
+	fm_mutex lock;
+	int dirty[FM_SLOT_COUNT];
+	float duty[FM_SLOT_COUNT];
+	int armed;
+	uint64_t last_flush;
+	uint64_t interval;
+	fm_rc error;	/* first failure since the last fm_combine_flush() */
+
+	/* Only one flush on the wire at a time, so an older value can't overtake a newer one */
+	fm_mutex flush_lock;
+
+	fm_thread thread;
+	fm_timer timer;
+	volatile unsigned int running;
+};
+
+static void fm_combine_thread(void *arg);
+static fm_rc fm_combine_send(flowmaster *fm, fm_combine *combine);
+
+static void
+fm_combine_free(fm_combine *combine)
+{
+	fm_timer_destroy(combine->timer);
+	fm_mutex_destroy(&combine->flush_lock);
+	fm_mutex_destroy(&combine->lock);
+	free(combine);
+}
+
+/* Stop the flusher thread, anything it hadn't sent yet stays in the slots */
+static void
+fm_combine_halt(fm_combine *combine)
+{
+	/* Fire the timer now rather than waiting out the interval */
+	fm_store_release(&combine->running, 0);
+	fm_timer_set(combine->timer, fm_monotonic_ns(), 0);
+	fm_thread_join(combine->thread);
+}
+
+/* Set the flusher going if it isn't already, combine->lock held */
+static void
+fm_combine_arm(fm_combine *combine)
+{
+	const uint64_t now = fm_monotonic_ns();
+	uint64_t deadline = combine->last_flush + combine->interval;
+
+	if(combine->armed){
+		return;
+	}
+
+	/* A deadline of 0 would disarm the timer */
+	if(deadline < now){
+		deadline = now;
+	}
+
+	combine->armed = 1;
+	fm_timer_set(combine->timer, deadline, 0);
+}
+
+fm_rc
+fm_combine_start(flowmaster *fm, unsigned int interval_ms)
+{
+	fm_combine *combine;
+
+	fm_mutex_lock(&fm->worker_lock);
+	combine = fm->combine;
+	fm_mutex_unlock(&fm->worker_lock);
+
+	if(combine != NULL){
+		return FM_BUSY;
+	}
+
+	combine = (fm_combine*) calloc(1, sizeof(fm_combine));
+	if(combine == NULL){
+		return FM_NO_MEMORY;
+	}
+
+	combine->fm = fm;
+	combine->interval = interval_ms * FM_MS;
+
+	if(fm_timer_create(&combine->timer) != 0){
+		free(combine);
+		return FM_THREAD_ERROR;
+	}
+
+	fm_mutex_init(&combine->lock);
+	fm_mutex_init(&combine->flush_lock);
+	combine->running = 1;
+
+	if(fm_thread_start(&combine->thread, fm_combine_thread, combine) != 0){
+		fm_combine_free(combine);
+		return FM_THREAD_ERROR;
+	}
+
+	fm_mutex_lock(&fm->worker_lock);
+	if(fm->combine == NULL){
+		fm->combine = combine;
+		combine = NULL;
+	}
+	fm_mutex_unlock(&fm->worker_lock);
+
+	/* Somebody else started combining meanwhile */
+	if(combine != NULL){
+		fm_combine_halt(combine);
+		fm_combine_free(combine);
+		return FM_BUSY;
+	}
+
+	return FM_OK;
+}
+
+fm_rc
+fm_combine_stop(flowmaster *fm)
+{
+	fm_combine *combine;
+	fm_rc rc;
+
+	/*
+	 * Unpublish first so no more speeds land in the slots, then send
+	 * what's there.  Setters going straight to the controller now wait
+	 * on worker_lock until that's out, so they can't be overtaken.
+	 * */
+	fm_mutex_lock(&fm->worker_lock);
+
+	combine = fm->combine;
+	if(combine == NULL){
+		fm_mutex_unlock(&fm->worker_lock);
+		return FM_OK;
+	}
+	fm->combine = NULL;
+
+	fm_combine_halt(combine);
+
+	rc = fm_combine_send(fm, combine);
+	if(rc == FM_OK){
+		rc = combine->error;
+	}
+
+	fm_mutex_unlock(&fm->worker_lock);
+
+	fm_combine_free(combine);
+
+	return rc;
+}
+
+/* worker_lock held, so combine can't be unpublished and freed meanwhile */
+int
+fm_combine_set(fm_combine *combine, float duty_cycle, int fan_or_pump)
+{
+	const int slot = fan_or_pump == PACKET_TYPE_SET_PUMP ? FM_SLOT_PUMP : FM_SLOT_FAN;
+
+	fm_mutex_lock(&combine->lock);
+	combine->duty[slot] = duty_cycle;
+	combine->dirty[slot] = 1;
+	fm_combine_arm(combine);
+	fm_mutex_unlock(&combine->lock);
+
+	return FM_OK;
+}
+
+/* Send whatever is waiting, returns the first failure */
+static fm_rc
+fm_combine_send(flowmaster *fm, fm_combine *combine)
+{
+	int dirty[FM_SLOT_COUNT];
+	float duty[FM_SLOT_COUNT];
+	fm_rc result = FM_OK;
+	int i;
+
+	fm_mutex_lock(&combine->flush_lock);
+
+	fm_mutex_lock(&combine->lock);
+	for(i = 0; i < FM_SLOT_COUNT; i++){
+		dirty[i] = combine->dirty[i];
+		duty[i] = combine->duty[i];
+		combine->dirty[i] = 0;
+	}
+	combine->armed = 0;
+	combine->last_flush = fm_monotonic_ns();
+	fm_mutex_unlock(&combine->lock);
+
+	for(i = 0; i < FM_SLOT_COUNT; i++){
+		fm_rc rc;
+
+		if(!dirty[i]){
+			continue;
+		}
+
+		rc = fm_send_speed(fm, duty[i], fm_slot_packet[i]);
+
+		if(rc == FM_OK){
+			continue;
+		}
+
+		/* Try again next interval, unless a newer value has come in meanwhile */
+		fm_mutex_lock(&combine->lock);
+		if(!combine->dirty[i]){
+			combine->duty[i] = duty[i];
+			combine->dirty[i] = 1;
+		}
+		if(combine->error == FM_OK){
+			combine->error = rc;
+		}
+		if(fm_load_acquire(&combine->running)){
+			fm_combine_arm(combine);
+		}
+		fm_mutex_unlock(&combine->lock);
+
+		if(result == FM_OK){
+			result = rc;
+		}
+	}
+
+	fm_mutex_unlock(&combine->flush_lock);
+
+	return result;
+}
+
+fm_rc
+fm_combine_flush(flowmaster *fm)
+{
+	fm_combine *combine;
+	fm_rc rc;
+
+	/* Held across the flush so combining can't be stopped under our feet */
+	fm_mutex_lock(&fm->worker_lock);
+
+	combine = fm->combine;
+	if(combine == NULL){
+		fm_mutex_unlock(&fm->worker_lock);
+		return FM_OK;
+	}
+
+	rc = fm_combine_send(fm, combine);
+
+	/* Report anything the flusher ran into since last time too */
+	fm_mutex_lock(&combine->lock);
+	if(rc == FM_OK){
+		rc = combine->error;
+	}
+	combine->error = FM_OK;
+	fm_mutex_unlock(&combine->lock);
+
+	fm_mutex_unlock(&fm->worker_lock);
+
+	return rc;
+}
+
+static void
+fm_combine_thread(void *arg)
+{
+	fm_combine *combine = (fm_combine*) arg;
+
+	while(fm_timer_wait(combine->timer) > 0 && fm_load_acquire(&combine->running)){
+		fm_combine_send(combine->fm, combine);
+	}
+}
@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
+
+/*
+ * Host side PID control of coolant temperature.
+ *
+ * The loop thread wakes on a periodic timer, polls, and works out a new
+ * fan duty from the fresh sample before waiting for the next deadline.
+ * All the loop state belongs to that thread, only the stats are shared.
+ * */
+
+#define FM_MS 1000000ull
+
+/* CPU packages whose energy counters are summed for the feed-forward */
+#define FM_HOST_PACKAGES 8
+
+struct fm_control_s {
+	flowmaster *fm;
+	fm_control_config config;
+	fm_thread thread;
+	fm_timer timer;
+	uint64_t first_deadline;
+	volatile unsigned int running;
+
+	/* Coolant temperature and its rate of change for the derivative */
+	fm_filter *coolant;
+
+	double integral;
+	double output;
+	int ticks_written;	/* fan duty last sent, in timer ticks, -1 for none */
+	uint64_t last_sample;
+
+	/* Previous host readings, the load is worked out from the difference */
+	uint64_t cpu_busy;
+	uint64_t cpu_total;
+	uint64_t energy[FM_HOST_PACKAGES];
+	int packages;
+	uint64_t energy_time;
+
+	fm_mutex lock;
+	fm_control_stats stats;
+	uint64_t jitter_sum;
+};
+
+static void fm_control_thread(void *arg);
+
+void
+fm_control_defaults(fm_control_config *config)
+{
+	config->period_ms = 1000;
+	config->setpoint = 35.0f;
+	config->kp = 0.08f;
+	config->ki = 0.004f;
+	config->kd = 0.0f;
+	config->fan_min = 0.2f;
+	config->fan_max = 1.0f;
+	config->pump_min = 0.0f;
+	config->pump_max = 0.0f;
+	config->slew_rate = 0.05f;
+	config->feedforward = 0.0f;
+	config->full_load_watts = 0.0f;
+	config->priority = 0;
+	config->cpu = -1;
+}
+
+static void
+fm_control_free(fm_control *control)
+{
+	fm_filter_destroy(control->coolant);
+	fm_mutex_destroy(&control->lock);
+	free(control);
+}
+
+/* Stop the loop thread, it leaves the fans wherever it last put them */
+static void
+fm_control_halt(fm_control *control)
+{
+	/* Fire the timer now rather than waiting out the period */
+	fm_store_release(&control->running, 0);
+	fm_timer_set(control->timer, fm_monotonic_ns(), 0);
+
+	fm_thread_join(control->thread);
+	fm_timer_destroy(control->timer);
+}
+
+fm_rc
+fm_control_start(flowmaster *fm, const fm_control_config *config)
+{
+	fm_control *control;
+	int rc;
+
+	fm_mutex_lock(&fm->worker_lock);
+	control = fm->control;
+	fm_mutex_unlock(&fm->worker_lock);
+
+	if(control != NULL){
+		return FM_BUSY;
+	}
+
+	control = (fm_control*) calloc(1, sizeof(fm_control));
+	if(control == NULL){
+		return FM_NO_MEMORY;
+	}
+
+	if(config != NULL){
+		control->config = *config;
+	}
+	else {
+		fm_control_defaults(&control->config);
+	}
+	config = &control->config;
+
+	if(config->period_ms < 500 || config->fan_min < 0.0f || config->fan_max > 1.0f
+		|| config->fan_min > config->fan_max || config->pump_min > config->pump_max
+		|| (config->pump_max > 0.0f && config->pump_min <= 0.0f) || config->slew_rate < 0.0f
+		|| config->feedforward < 0.0f || config->feedforward > 1.0f || config->full_load_watts < 0.0f){
+		free(control);
+		return FM_BAD_ARGUMENT;
+	}
+
+	control->coolant = fm_filter_create();
+	if(control->coolant == NULL){
+		free(control);
+		return FM_NO_MEMORY;
+	}
+
+	/* Median of 3 throws out single bad ADC reads, the slope covers a few periods */
+	fm_filter_configure(control->coolant, FM_FIELD_COOLANT_TEMP, 3, 0.0, 3.0 * config->period_ms / 1000.0);
+
+	control->fm = fm;
+	control->ticks_written = -1;
+	control->stats.load = -1.0f;
+	fm_mutex_init(&control->lock);
+
+	rc = fm_autoregulate(fm, 0);
+	if(rc != FM_OK){
+		fm_control_free(control);
+		return (fm_rc) rc;
+	}
+
+	if(fm_timer_create(&control->timer) != 0){
+		fm_control_free(control);
+		return FM_THREAD_ERROR;
+	}
+
+	control->running = 1;
+	control->first_deadline = fm_monotonic_ns();
+
+	if(fm_timer_set(control->timer, control->first_deadline, config->period_ms * FM_MS) != 0
+		|| fm_thread_start(&control->thread, fm_control_thread, control) != 0){
+		fm_timer_destroy(control->timer);
+		fm_control_free(control);
+		return FM_THREAD_ERROR;
+	}
+
+	fm_mutex_lock(&fm->worker_lock);
+	if(fm->control == NULL){
+		fm->control = control;
+		control = NULL;
+	}
+	fm_mutex_unlock(&fm->worker_lock);
+
+	/* Somebody else started a loop meanwhile, theirs has the fans */
+	if(control != NULL){
+		fm_control_halt(control);
+		fm_control_free(control);
+		return FM_BUSY;
+	}
+
+	return FM_OK;
+}
+
+fm_rc
+fm_control_stop(flowmaster *fm)
+{
+	fm_control *control;
+
+	/* Unpublished first, so fm_control_get_stats() can't find it once it's freed */
+	fm_mutex_lock(&fm->worker_lock);
+	control = fm->control;
+	fm->control = NULL;
+	fm_mutex_unlock(&fm->worker_lock);
+
+	if(control == NULL){
+		return FM_OK;
+	}
+
+	/* Not under worker_lock, the loop takes it to set the fan speed */
+	fm_control_halt(control);
+	fm_control_free(control);
+
+	return (fm_rc) fm_autoregulate(fm, 1);
+}
+
+void
+fm_control_get_stats(flowmaster *fm, fm_control_stats *stats)
+{
+	fm_control *control;
+
+	fm_mutex_lock(&fm->worker_lock);
+
+	control = fm->control;
+	if(control == NULL){
+		memset(stats, 0, sizeof(*stats));
+	}
+	else {
+		fm_mutex_lock(&control->lock);
+		*stats = control->stats;
+		fm_mutex_unlock(&control->lock);
+	}
+
+	fm_mutex_unlock(&fm->worker_lock);
+}
+
+static double
+fm_clamp(double value, double min, double max)
+{
+	return value < min ? min : (value > max ? max : value);
+}
+
+/*
+ * Host load since the last call, 0 to 1, from whichever of CPU time and
+ * package power says it's busier.  -1 the first time round or if
+ * neither can be read.
+ * */
+static double
+fm_control_load(fm_control *control)
+{
+	const fm_control_config *config = &control->config;
+	const uint64_t now = fm_monotonic_ns();
+	double load = -1.0;
+	uint64_t busy;
+	uint64_t total;
+	uint64_t joules = 0;
+	int packages;
+
+	if(fm_host_cpu_times(&busy, &total) == 0){
+		if(control->cpu_total != 0 && total > control->cpu_total){
+			load = (double)(busy - control->cpu_busy) / (double)(total - control->cpu_total);
+		}
+		control->cpu_busy = busy;
+		control->cpu_total = total;
+	}
+
+	if(config->full_load_watts <= 0.0f){
+		return load;
+	}
+
+	for(packages = 0; packages < FM_HOST_PACKAGES; packages++){
+		uint64_t energy;
+		uint64_t range;
+
+		if(fm_host_energy(packages, &energy, &range) != 0){
+			break;
+		}
+
+		/* The counters wrap every few minutes under load */
+		if(energy >= control->energy[packages]){
+			joules += energy - control->energy[packages];
+		}
+		else {
+			joules += range - control->energy[packages] + energy;
+		}
+		control->energy[packages] = energy;
+	}
+
+	/* Only trust the difference if the same packages were read last time */
+	if(packages > 0 && packages == control->packages && control->energy_time != 0){
+		const double watts = (joules / 1e6) / ((now - control->energy_time) / 1e9);
+
+		if(watts / config->full_load_watts > load){
+			load = watts / config->full_load_watts;
+		}
+	}
+	control->packages = packages;
+	control->energy_time = now;
+
+	return load > 1.0 ? 1.0 : load;
+}
+
+/* Work out the next fan duty from a fresh sample */
+static void
+fm_control_update(fm_control *control, const fm_sample *sample, double load)
+{
+	const fm_control_config *config = &control->config;
+	const double feedforward = load > 0.0 ? config->feedforward * load : 0.0;
+	double temp;
+	double slope;
+	double error;
+	double dt;
+	double wanted;
+	double step;
+
+	fm_filter_add(control->coolant, sample);
+	fm_filter_get(control->coolant, FM_FIELD_COOLANT_TEMP, &temp, &slope);
+
+	/* Positive when too hot, which wants more fan */
+	error = temp - config->setpoint;
+
+	if(control->last_sample == 0){
+		/* Pick up from wherever the controller left the fan */
+		dt = config->period_ms / 1000.0;
+		control->output = fm_clamp(sample->data.fan_duty_cycle, config->fan_min, config->fan_max);
+		control->integral = control->output - (config->kp * error) - feedforward;
+	}
+	else {
+		dt = (sample->timestamp - control->last_sample) / 1e9;
+	}
+	control->last_sample = sample->timestamp;
+
+	wanted = (config->kp * error) + control->integral + (config->kd * slope) + feedforward;
+
+	/* Stop integrating while the output is pinned and the error would push it further */
+	if(!(wanted >= config->fan_max && error > 0.0) && !(wanted <= config->fan_min && error < 0.0)){
+		control->integral += config->ki * error * dt;
+		control->integral = fm_clamp(control->integral, config->fan_min - config->feedforward, config->fan_max);
+	}
+
+	wanted = fm_clamp(wanted, config->fan_min, config->fan_max);
+
+	if(config->slew_rate > 0.0f){
+		step = config->slew_rate * dt;
+		wanted = fm_clamp(wanted, control->output - step, control->output + step);
+	}
+
+	control->output = wanted;
+
+	fm_mutex_lock(&control->lock);
+	control->stats.error = (float) error;
+	control->stats.output = (float) wanted;
+	control->stats.load = (float) load;
+	fm_mutex_unlock(&control->lock);
+}
+
+/* Send the outputs, skipping the fan if it wouldn't change by a whole timer tick */
+static int
+fm_control_write(fm_control *control)
+{
+	const fm_control_config *config = &control->config;
+	flowmaster *fm = control->fm;
+	const int ticks = (int)(control->output * fm->timer_top);
+	double range;
+	double pump;
+
+	if(ticks == control->ticks_written){
+		return 0;
+	}
+
+	if(fm_set_fan_speed(fm, (float) control->output) != 0){
+		control->ticks_written = -1;
+		return -1;
+	}
+	control->ticks_written = ticks;
+
+	if(config->pump_max > 0.0f){
+		range = config->fan_max - config->fan_min;
+		pump = config->pump_min;
+		if(range > 0.0){
+			pump += (config->pump_max - config->pump_min) * (control->output - config->fan_min) / range;
+		}
+
+		if(fm_set_pump_speed(fm, (float) pump) != 0){
+			control->ticks_written = -1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+fm_control_thread(void *arg)
+{
+	fm_control *control = (fm_control*) arg;
+	const fm_control_config *config = &control->config;
+	flowmaster *fm = control->fm;
+	const uint64_t period = config->period_ms * FM_MS;
+	uint64_t deadline = control->first_deadline;
+	int realtime;
+	int expired;
+
+	realtime = fm_thread_realtime(config->priority, config->cpu) == 0;
+
+	fm_mutex_lock(&control->lock);
+	control->stats.realtime = realtime;
+	fm_mutex_unlock(&control->lock);
+
+	while((expired = fm_timer_wait(control->timer)) > 0 && fm_load_acquire(&control->running)){
+		const uint64_t woke = fm_monotonic_ns();
+		fm_frame frame;
+		fm_sample sample;
+		uint64_t jitter;
+		uint64_t took;
+		double load;
+		int failed;
+		fm_rc rc;
+
+		/* Which deadline this wake up belongs to, Windows timers can fire a little early */
+		deadline += period * (expired - 1);
+		if(woke < deadline){
+			deadline = woke;
+		}
+		jitter = woke - deadline;
+
+		/* Host load over the period just gone */
+		load = config->feedforward > 0.0f ? fm_control_load(control) : -1.0;
+
+		rc = fm_fetch_frame(fm, &frame);
+
+		failed = rc != FM_OK;
+		if(!failed){
+			fm_publish_frame(fm, &frame);
+
+			sample.timestamp = frame.timestamp;
+			sample.request_time = frame.request_time;
+			fm_decode_frame(fm, &frame, &sample.data);
+
+			fm_control_update(control, &sample, load);
+			failed = fm_control_write(control) != 0;
+		}
+
+		took = fm_monotonic_ns() - deadline;
+
+		fm_mutex_lock(&control->lock);
+		control->stats.cycles++;
+		control->stats.overruns += expired - 1;
+		control->stats.errors += failed;
+		control->stats.jitter_last = jitter;
+		if(jitter > control->stats.jitter_max){
+			control->stats.jitter_max = jitter;
+		}
+		control->jitter_sum += jitter;
+		control->stats.jitter_mean = control->jitter_sum / control->stats.cycles;
+		if(took > control->stats.cycle_max){
+			control->stats.cycle_max = took;
+		}
+		fm_mutex_unlock(&control->lock);
+
+		deadline += period;
+	}
+}
@@ -0,0 +1,282 @@
+#include <string.h>
+
+#include "protocol.h"
+#include "flowmaster_private.h"
+
+/*
+ * The LCD.
+ *
+ * fm_print_message() only draws into display_frame.  display_shown is
+ * what the LCD was last sent, and is only trusted while the SCREEN
+ * shadow register is valid: anything that lets the controller draw its
+ * own pages, a failed write or a reconnect clears it and the next commit
+ * sends the whole frame.
+ *
+ * A commit sends each run of changed characters as a cursor move and a
+ * message.  Runs closer together than a cursor packet costs are merged,
+ * resending the unchanged characters between them being cheaper than
+ * another round trip, and the cursor move is left out when the previous
+ * message already left the cursor where the next run starts.
+ * */
+
+/* Unchanged characters worth resending to save a cursor move and a message */
+#define FM_DISPLAY_MERGE_GAP 12
+
+/* HD44780 address of the first column of each row */
+static const unsigned char fm_row_address[FM_DISPLAY_ROWS] = { 0x00, 0x40, 0x14, 0x54 };
+
+struct fm_message_s {
+	const char *text;
+	int length;
+	int address;	/* where the text starts */
+};
+
+void
+fm_display_init(flowmaster *fm)
+{
+	fm_mutex_init(&fm->display_lock);
+	memset(fm->display_frame, ' ', sizeof(fm->display_frame));
+	memset(fm->display_shown, ' ', sizeof(fm->display_shown));
+}
+
+void
+fm_display_destroy(flowmaster *fm)
+{
+	fm_mutex_destroy(&fm->display_lock);
+}
+
+/* Start or stop the display rotating through its pages */
+static fm_rc
+fm_rotate_display_locked(flowmaster *fm, void *arg)
+{
+	const int rotate = *(int*) arg;
+	int rc;
+
+	if(fm_shadow_matches(fm, FM_SHADOW_ROTATE, rotate)){
+		return FM_OK;
+	}
+
+	/* Whichever way it goes, the controller may have drawn over our frame */
+	fm_shadow_invalidate(fm, (1u << FM_SHADOW_CURSOR) | (1u << FM_SHADOW_SCREEN));
+
+	fm_start_write_buffer(fm, rotate ? PACKET_TYPE_ROTATE : PACKET_TYPE_NO_ROTATE, 0);
+	fm_end_write_buffer(fm);
+	rc = fm_do_write(fm, PACKET_TYPE_ACK);
+
+	if(rc == FM_OK){
+		fm_shadow_store(fm, FM_SHADOW_ROTATE, rotate);
+	}
+	else {
+		fm_shadow_invalidate(fm, 1u << FM_SHADOW_ROTATE);
+	}
+
+	return (fm_rc) rc;
+}
+
+static fm_rc
+fm_rotate_display(flowmaster *fm, int rotate)
+{
+	fm_rc rc;
+
+	fm_mutex_lock(&fm->display_lock);
+	rc = fm_io_run(fm, FM_PRIORITY_NORMAL, fm_rotate_display_locked, &rotate);
+	fm_mutex_unlock(&fm->display_lock);
+
+	return rc;
+}
+
+int
+fm_halt_update_display(flowmaster *fm)
+{
+	return fm_rotate_display(fm, 0);
+}
+
+int
+fm_resume_update_display(flowmaster *fm)
+{
+	return fm_rotate_display(fm, 1);
+}
+
+static fm_rc
+fm_cursor_locked(flowmaster *fm, void *arg)
+{
+	const int address = *(int*) arg;
+	int rc;
+
+	fm_start_write_buffer(fm, PACKET_TYPE_CURSOR, 1);
+	fm_add_byte(fm, (unsigned char) address);
+	fm_end_write_buffer(fm);
+	rc = fm_do_write(fm, PACKET_TYPE_ACK);
+
+	if(rc == FM_OK){
+		fm_shadow_store(fm, FM_SHADOW_CURSOR, address);
+	}
+	else {
+		fm_shadow_invalidate(fm, (1u << FM_SHADOW_CURSOR) | (1u << FM_SHADOW_SCREEN));
+	}
+
+	return (fm_rc) rc;
+}
+
+static fm_rc
+fm_message_locked(flowmaster *fm, void *arg)
+{
+	const struct fm_message_s *message = (const struct fm_message_s*) arg;
+	int rc;
+	int i;
+
+	fm_start_write_buffer(fm, PACKET_TYPE_MESSAGE, message->length);
+	for(i = 0; i < message->length; i++){
+		fm_add_byte(fm, (unsigned char) message->text[i]);
+	}
+	fm_end_write_buffer(fm);
+	rc = fm_do_write(fm, PACKET_TYPE_ACK);
+
+	/* The LCD moves the cursor along after each character */
+	if(rc == FM_OK){
+		fm_shadow_store(fm, FM_SHADOW_CURSOR, message->address + message->length);
+	}
+	else {
+		fm_shadow_invalidate(fm, (1u << FM_SHADOW_CURSOR) | (1u << FM_SHADOW_SCREEN));
+	}
+
+	return (fm_rc) rc;
+}
+
+int
+fm_set_cursor(flowmaster *fm, int row, int col)
+{
+	if(row < 0 || row >= FM_DISPLAY_ROWS || col < 0 || col >= FM_DISPLAY_COLS){
+		return FM_BAD_ARGUMENT;
+	}
+
+	fm_mutex_lock(&fm->display_lock);
+	fm->display_row = row;
+	fm->display_col = col;
+	fm_mutex_unlock(&fm->display_lock);
+
+	return FM_OK;
+}
+
+int
+fm_print_message(flowmaster *fm, const char *message, int message_len)
+{
+	char *row;
+	int i;
+
+	if(message == NULL || message_len < 0){
+		return FM_BAD_ARGUMENT;
+	}
+
+	fm_mutex_lock(&fm->display_lock);
+
+	row = fm->display_frame[fm->display_row];
+	for(i = 0; i < message_len && message[i] != '\0' && fm->display_col < FM_DISPLAY_COLS; i++){
+		/* Control characters would be taken for the custom glyphs */
+		row[fm->display_col++] = (unsigned char) message[i] < ' ' ? ' ' : message[i];
+	}
+
+	fm_mutex_unlock(&fm->display_lock);
+
+	return FM_OK;
+}
+
+/* Send columns col to col + length - 1 of a row, display_lock held */
+static fm_rc
+fm_display_send(flowmaster *fm, int row, int col, int length)
+{
+	struct fm_message_s message;
+	int address = fm_row_address[row] + col;
+	fm_rc rc;
+
+	if(!fm_shadow_matches(fm, FM_SHADOW_CURSOR, address)){
+		rc = fm_io_run(fm, FM_PRIORITY_NORMAL, fm_cursor_locked, &address);
+		if(rc != FM_OK){
+			return rc;
+		}
+	}
+
+	message.text = &fm->display_frame[row][col];
+	message.length = length;
+	message.address = address;
+
+	rc = fm_io_run(fm, FM_PRIORITY_NORMAL, fm_message_locked, &message);
+	if(rc == FM_OK){
+		memcpy(&fm->display_shown[row][col], message.text, length);
+	}
+
+	return rc;
+}
+
+fm_rc
+fm_display_commit(flowmaster *fm)
+{
+	int rotate = 0;
+	int whole;
+	int row;
+	fm_rc rc;
+
+	fm_mutex_lock(&fm->display_lock);
+
+	/* The frame only stays up while the controller isn't drawing its own pages */
+	rc = fm_io_run(fm, FM_PRIORITY_NORMAL, fm_rotate_display_locked, &rotate);
+	if(rc != FM_OK){
+		fm_mutex_unlock(&fm->display_lock);
+		return rc;
+	}
+
+	whole = !fm_shadow_matches(fm, FM_SHADOW_SCREEN, 1);
+
+	for(row = 0; row < FM_DISPLAY_ROWS && rc == FM_OK; row++){
+		const char *frame = fm->display_frame[row];
+		const char *shown = fm->display_shown[row];
+		int start = 0;
+
+		for(;;){
+			int end;
+			int col;
+
+			while(start < FM_DISPLAY_COLS && !whole && frame[start] == shown[start]){
+				start++;
+			}
+			if(start == FM_DISPLAY_COLS){
+				break;
+			}
+
+			/* Take in any further changes that are close enough */
+			end = start + 1;
+			for(col = end; col < FM_DISPLAY_COLS && col - end <= FM_DISPLAY_MERGE_GAP; col++){
+				if(whole || frame[col] != shown[col]){
+					end = col + 1;
+				}
+			}
+
+			rc = fm_display_send(fm, row, start, end - start);
+			if(rc != FM_OK){
+				break;
+			}
+			start = end;
+		}
+	}
+
+	if(rc == FM_OK){
+		fm_shadow_store(fm, FM_SHADOW_SCREEN, 1);
+	}
+
+	fm_mutex_unlock(&fm->display_lock);
+
+	return rc;
+}
+
+int
+fm_set_display(flowmaster *fm, int display)
+{
+	switch(display){
+		case FM_DISPLAY_CONTROLLER:
+			return fm_resume_update_display(fm);
+		case FM_DISPLAY_HOST:
+			return fm_display_commit(fm);
+	}
+
+	return FM_BAD_ARGUMENT;
+}
@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "flowmaster_private.h"
+
+/*
+ * Per field signal conditioning.
+ *
+ * Each field runs through median -> EWMA -> slope, any stage of which
+ * may be switched off.  Everything is updated in place from the previous
+ * state, so a sample costs the same however long the filter has run.
+ *
+ * The EWMA and slope stages are specified as time constants rather than
+ * per sample weights, so the smoothing stays the same whether samples
+ * arrive every 100ms from the stream or every 500ms from polling.
+ * */
+
+#define FM_SECOND 1e9
+
+struct fm_filter_field_s {
+	/* Configuration */
+	int median_window;
+	double ewma_seconds;
+	double slope_seconds;
+
+	/* Median stage, ring of the last median_window inputs plus the same sorted */
+	float ring[FM_FILTER_MAX_MEDIAN];
+	float sorted[FM_FILTER_MAX_MEDIAN];
+	int ring_pos;
+	int ring_fill;
+
+	/* EWMA and slope stages */
+	double value;
+	double slope;
+	int primed;
+};
+
+struct fm_filter_s {
+	fm_mutex lock;
+	uint64_t timestamp;
+	struct fm_filter_field_s field[FM_FIELD_COUNT];
+};
+
+fm_filter*
+fm_filter_create(void)
+{
+	fm_filter *filter = (fm_filter*) calloc(1, sizeof(fm_filter));
+	int i;
+
+	if(filter == NULL){
+		return NULL;
+	}
+
+	fm_mutex_init(&filter->lock);
+
+	for(i = 0; i < FM_FIELD_COUNT; i++){
+		filter->field[i].median_window = 1;
+	}
+
+	return filter;
+}
+
+void
+fm_filter_destroy(fm_filter *filter)
+{
+	if(filter == NULL){
+		return;
+	}
+
+	fm_mutex_destroy(&filter->lock);
+	free(filter);
+}
+
+fm_rc
+fm_filter_configure(fm_filter *filter, fm_field field, int median_window,
+		double ewma_seconds, double slope_seconds)
+{
+	struct fm_filter_field_s *f;
+
+	if((int) field < 0 || field >= FM_FIELD_COUNT){
+		return FM_BAD_ARGUMENT;
+	}
+
+	if(median_window < 1 || median_window > FM_FILTER_MAX_MEDIAN || (median_window & 1) == 0){
+		return FM_BAD_ARGUMENT;
+	}
+
+	fm_mutex_lock(&filter->lock);
+
+	f = &filter->field[field];
+	memset(f, 0, sizeof(*f));
+	f->median_window = median_window;
+	f->ewma_seconds = ewma_seconds > 0.0 ? ewma_seconds : 0.0;
+	f->slope_seconds = slope_seconds > 0.0 ? slope_seconds : 0.0;
+
+	fm_mutex_unlock(&filter->lock);
+
+	return FM_OK;
+}
+
+/* Swap the oldest input for the newest, keeping sorted in order */
+static float
+fm_filter_median(struct fm_filter_field_s *f, float input)
+{
+	int n = f->ring_fill;
+	int i;
+
+	if(n == f->median_window){
+		const float oldest = f->ring[f->ring_pos];
+
+		/* Take the oldest out */
+		for(i = 0; i < n - 1 && f->sorted[i] != oldest; i++){
+		}
+		for(; i < n - 1; i++){
+			f->sorted[i] = f->sorted[i + 1];
+		}
+		n--;
+	}
+	else {
+		f->ring_fill++;
+	}
+
+	/* And slot the new one in */
+	for(i = n; i > 0 && f->sorted[i - 1] > input; i--){
+		f->sorted[i] = f->sorted[i - 1];
+	}
+	f->sorted[i] = input;
+
+	f->ring[f->ring_pos] = input;
+	f->ring_pos = (f->ring_pos + 1) % f->median_window;
+
+	/* Until the window fills, the middle of what we have */
+	return f->sorted[f->ring_fill / 2];
+}
+
+/* Weight given to a new sample dt seconds after the last, for time constant tau */
+static double
+fm_filter_alpha(double dt, double tau)
+{
+	if(tau <= 0.0){
+		return 1.0;
+	}
+	return 1.0 - exp(-dt / tau);
+}
+
+void
+fm_filter_add(fm_filter *filter, const fm_sample *sample)
+{
+	double dt;
+	int i;
+
+	fm_mutex_lock(&filter->lock);
+
+	dt = (double)(sample->timestamp - filter->timestamp) / FM_SECOND;
+
+	for(i = 0; i < FM_FIELD_COUNT; i++){
+		struct fm_filter_field_s *f = &filter->field[i];
+		double value = fm_data_field(&sample->data, (fm_field) i);
+		double previous;
+
+		if(f->median_window > 1){
+			value = fm_filter_median(f, (float) value);
+		}
+
+		if(!f->primed){
+			f->value = value;
+			f->slope = 0.0;
+			f->primed = 1;
+			continue;
+		}
+
+		/* Out of order or duplicate, nothing sensible to do with it */
+		if(sample->timestamp <= filter->timestamp){
+			continue;
+		}
+
+		previous = f->value;
+		f->value += fm_filter_alpha(dt, f->ewma_seconds) * (value - f->value);
+		f->slope += fm_filter_alpha(dt, f->slope_seconds) * (((f->value - previous) / dt) - f->slope);
+	}
+
+	if(sample->timestamp > filter->timestamp){
+		filter->timestamp = sample->timestamp;
+	}
+
+	fm_mutex_unlock(&filter->lock);
+}
+
+void
+fm_filter_get(fm_filter *filter, fm_field field, double *value, double *slope)
+{
+	if((int) field < 0 || field >= FM_FIELD_COUNT){
+		*value = 0.0;
+		*slope = 0.0;
+		return;
+	}
+
+	fm_mutex_lock(&filter->lock);
+	*value = filter->field[field].value;
+	*slope = filter->field[field].slope;
+	fm_mutex_unlock(&filter->lock);
+}
+
+void
+fm_filter_sample(fm_filter *filter, fm_sample *sample)
+{
+	fm_mutex_lock(&filter->lock);
+
+	sample->timestamp = filter->timestamp;
+	sample->request_time = 0;
+	sample->data.fan_duty_cycle = (float) filter->field[FM_FIELD_FAN_DUTY_CYCLE].value;
+	sample->data.pump_duty_cycle = (float) filter->field[FM_FIELD_PUMP_DUTY_CYCLE].value;
+	sample->data.ambient_temp = (float) filter->field[FM_FIELD_AMBIENT_TEMP].value;
+	sample->data.coolant_temp = (float) filter->field[FM_FIELD_COOLANT_TEMP].value;
+	sample->data.flow_rate = (float) filter->field[FM_FIELD_FLOW_RATE].value;
+	sample->data.fan_rpm = (int) floor(filter->field[FM_FIELD_FAN_RPM].value + 0.5);
+	sample->data.pump_rpm = (int) floor(filter->field[FM_FIELD_PUMP_RPM].value + 0.5);
+
+	fm_mutex_unlock(&filter->lock);
+}
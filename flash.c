@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "flowmaster_private.h"
@@ -25,10 +26,27 @@ static uint8_t flash_calc_checksum(uint8_t size, uint16_t address, uint8_t type,
 static void flash_show_program_message(flowmaster *fm);
 static void flash_show_program_marker(flowmaster *fm);
 
+/* Biggest flash page we'll gather records into */
+#define FLASH_MAX_PAGE 256
+
+/* HEX records gathered up into a flash page, for bootloaders with BL_WRITE_PAGE */
+struct flash_page_s {
+	int size;		/* bytes per page, 0 to program word by word */
+	int used;		/* data[] holds something not yet written */
+	int ordered;		/* no record starts before the end of the one before */
+	uint16_t address;	/* of the first byte of the page */
+	uint8_t data[FLASH_MAX_PAGE];
+};
+
 static int flash_erase_chip(flowmaster *fm);
-static int flash_program_data(flowmaster *fm, uint16_t address, uint8_t *data, int data_len);
+static int flash_page_size(flowmaster *fm);
+static int flash_program_data(flowmaster *fm, struct flash_page_s *page, uint16_t address, uint8_t *data, int data_len);
+static int flash_program_words(flowmaster *fm, uint16_t address, uint8_t *data, int data_len);
+static int flash_write_page(flowmaster *fm, struct flash_page_s *page);
+static int flash_resync(flowmaster *fm, int page_size);
 static int flash_program_address(flowmaster *fm, uint16_t address);
-static int flash_program_word(flowmaster *fm, uint8_t high, uint8_t low);
+static void flash_send_word(flowmaster *fm, uint8_t high, uint8_t low);
+static int flash_read_reply(flowmaster *fm, unsigned char *reply);
 
 /* Tell flowmaster to enter programming mode */
 static int flash_start_programming(flowmaster *fm);
@@ -39,6 +57,25 @@ static void flash_end_programming(flowmaster *fm);
 #define RECORD_TYPE_DATA 0x00
 #define RECORD_TYPE_EOF 0x01
 
+/*
+ * Words sent ahead of their ACKs.  Each BL_PROGRAM is 3 bytes, so 8 puts
+ * 24 bytes in flight.  That assumes the bootloader can take that much
+ * while it's busy writing, which nothing here checks.  If words go
+ * missing, build with a smaller -DFLASH_WINDOW, 1 waits for every ACK.
+ * */
+#ifndef FLASH_WINDOW
+#define FLASH_WINDOW 8
+#endif
+
+/* Times a record is rewound after a NAK before giving up on it */
+#define FLASH_RETRIES 3
+
+/* Reads that time out before a reply is taken as lost */
+#define FLASH_REPLY_TIMEOUTS 10
+
+/* How long the bootloader has to be silent before it's taken to have finished talking */
+#define FLASH_QUIET_MS 100
+
 #define FLASH_PROGRAM_CHIP 10
 #define FLASH_VALIDATE_ONLY 20
 
@@ -49,6 +86,7 @@ real_flash_validate_and_program(
 	flowmaster *fm,
 	FILE *fp,
 	int do_program,
+	struct flash_page_s *page,
 	fm_flash_callback cb,
 	void *userdata
 	)
@@ -62,6 +100,7 @@ real_flash_validate_and_program(
 	uint8_t data[32]; /* The flash data in binary format */
 	uint8_t file_checksum;
 	uint8_t our_checksum;
+	uint32_t end = 0;
 
 	char *hex_buffer = NULL;
 
@@ -91,6 +130,12 @@ real_flash_validate_and_program(
 				if(do_program == FLASH_VALIDATE_ONLY){
 					FM_CALLBACK(FLASH_BLOCK_COUNT, &block_count);
 				}
+				/* The last page is still waiting to go */
+				else if(page->used && flash_write_page(fm, page) != 0){
+					FM_CALLBACK(FLASH_WRITE_BLOCK_ERROR, &block_count);
+					free(hex_buffer);
+					return -1;
+				}
 				free(hex_buffer);
 				return 0;
 			default:
@@ -108,8 +153,16 @@ real_flash_validate_and_program(
 			return -1;
 		}
 
+		/* A record going back over earlier ones could land in a page already written */
+		if(do_program == FLASH_VALIDATE_ONLY){
+			if(address < end){
+				page->ordered = 0;
+			}
+			end = (uint32_t) address + byte_count;
+		}
+
 		if(do_program == FLASH_PROGRAM_CHIP){
-			rc = flash_program_data(fm, address, data, byte_count);
+			rc = flash_program_data(fm, page, address, data, byte_count);
 			if(rc == 0){
 				FM_CALLBACK(FLASH_WRITE_BLOCK_OK, &block_count);
 			}
@@ -142,6 +195,7 @@ flash_validate_and_program(
 	FILE *fp;
 	int rc;
 	fm_baud_rate oldrate;
+	struct flash_page_s page;
 
 	fp = fopen(filename, "r");
 	if(fp == NULL){
@@ -151,7 +205,8 @@ flash_validate_and_program(
 	FM_CALLBACK(FLASH_OPEN_FILE_OK, NULL);
 
 	/* Do a validation run */
-	rc = real_flash_validate_and_program(fm,fp, FLASH_VALIDATE_ONLY , cb, userdata);
+	page.ordered = 1;
+	rc = real_flash_validate_and_program(fm,fp, FLASH_VALIDATE_ONLY, &page, cb, userdata);
 
 	/* Abort if validation fails */
 	if(rc != 0){
@@ -163,15 +218,19 @@ flash_validate_and_program(
 	/* Finished validation run, indicate success */
 	FM_CALLBACK(FLASH_VALIDATE_OK, NULL);
 
+	/* The bootloader doesn't send heartbeats, and nothing else may read its replies */
+	fm_stream_stop(fm);
+
+	/* Take the port off the I/O thread, anything else asked for meanwhile gets FM_PORT_ERROR */
+	fm_io_stop(fm);
+
 	/* Save the current baud rate, it will be changed by flash_start_programming */
 	fm_get_baudrate(fm, &oldrate);
 
 	/* Start programming mode. */
 	rc = flash_start_programming(fm);
 	if(rc != 0){
-		fm_set_baudrate(fm, oldrate);
-		fclose(fp);
-		return -1;
+		goto restore;
 	}
 
 	FM_CALLBACK(FLASH_ERASE_CHIP_BEGIN,NULL);
@@ -179,25 +238,39 @@ flash_validate_and_program(
 	if(rc != 0) {
 		/* Whups, BIG PROBLEM */
 		FM_CALLBACK(FLASH_UPDATE_ERROR, NULL);
-		fclose(fp);
-		return -1;
+		goto reset;
 	}
 	FM_CALLBACK(FLASH_ERASE_CHIP_OK,NULL);
 
-	rc = real_flash_validate_and_program(fm,fp, FLASH_PROGRAM_CHIP, cb, userdata);
+	/*
+	 * A page at a time if the bootloader can, word by word if not.  A page
+	 * is written whole, so a file whose records go back to one already
+	 * written has to be done word by word too.
+	 * */
+	page.size = page.ordered ? flash_page_size(fm) : 0;
+	page.used = 0;
+
+	rc = real_flash_validate_and_program(fm,fp, FLASH_PROGRAM_CHIP, &page, cb, userdata);
 	if(rc != 0){
 		/* Big error, oops.*/
 		FM_CALLBACK(FLASH_UPDATE_ERROR, NULL);
 	}
 
+reset:
 	/* Reset the flowmaster */
 	flash_end_programming(fm);
 
-	/* Restore the baud rate */
+restore:
+	/* Restore the baud rate and give the port back, however far we got */
 	fm_set_baudrate(fm, oldrate);
+	fm_io_start(fm);
 
 	fclose(fp);
 
+	if(rc != 0){
+		return -1;
+	}
+
 	FM_CALLBACK(FLASH_UPDATE_OK, NULL);
 	
 	return rc;
@@ -346,6 +419,9 @@ flash_start_programming(flowmaster *fm)
 	unsigned char byte = 0;
 	int rc;
 
+	/* The controller comes back from the bootloader with its defaults */
+	fm_forget_state(fm);
+
 	fm_flush_buffers(fm);
 
 	fm_start_write_buffer(fm, PACKET_TYPE_BOOTLOADER, 0);
@@ -383,22 +459,223 @@ flash_erase_chip(flowmaster *fm)
 	return 0;
 }
 
+/*
+ * Ask the bootloader for its page size, 0 if it can't write pages.
+ * Only sizes that are a power of two and fit in a flash_page_s are used.
+ * */
+static int
+flash_page_size(flowmaster *fm)
+{
+	unsigned char reply[3];
+	int size;
+	int i;
+
+	fm_flush_buffers(fm);
+	fm_serial_write_byte(fm, BL_PAGE_SIZE);
+
+	/* Older bootloaders ignore it, so don't wait long */
+	for(i = 0; i < 3; i++){
+		if(fm_serial_read_byte(fm, &reply[i]) != 0 || reply[0] != BL_ACK){
+			fm_flush_buffers(fm);
+			return 0;
+		}
+	}
+
+	size = (reply[1] << 8) | reply[2];
+	if(size < 2 || size > FLASH_MAX_PAGE || (size & (size - 1)) != 0){
+		return 0;
+	}
+
+	return size;
+}
+
+/* Gather a HEX record into pages, writing each page out once the records move past it */
+static int
+flash_program_data(flowmaster *fm, struct flash_page_s *page, uint16_t address, uint8_t *data, int data_len)
+{
+	int i;
+
+	if(page->size == 0){
+		return flash_program_words(fm, address, data, data_len);
+	}
+
+	for(i = 0; i < data_len; i++){
+		const uint16_t at = (uint16_t)(address + i);
+		const uint16_t base = (uint16_t)(at & ~(page->size - 1));
+
+		if(page->used && page->address != base){
+			/* Written pages can't be topped up, see the ordered check */
+			if(base < page->address){
+				return -1;
+			}
+
+			if(flash_write_page(fm, page) != 0){
+				return -1;
+			}
+		}
+
+		/* Whatever no record covers stays as the erase left it */
+		if(!page->used){
+			memset(page->data, 0xFF, page->size);
+			page->address = base;
+			page->used = 1;
+		}
+
+		page->data[at - base] = data[i];
+	}
+
+	return 0;
+}
+
+/* As avr-libc's _crc16_update() */
+static uint16_t
+flash_crc16(uint16_t crc, uint8_t byte)
+{
+	int i;
+
+	crc ^= byte;
+	for(i = 0; i < 8; i++){
+		crc = (crc & 1) ? (uint16_t)((crc >> 1) ^ 0xA001) : (uint16_t)(crc >> 1);
+	}
+
+	return crc;
+}
+
+static int
+flash_write_page(flowmaster *fm, struct flash_page_s *page)
+{
+	uint8_t header[4];
+	unsigned char reply;
+	int attempt;
+	int i;
+
+	header[0] = (uint8_t)(page->address >> 8);
+	header[1] = (uint8_t)(page->address & 0x00FF);
+	header[2] = (uint8_t)(page->size >> 8);
+	header[3] = (uint8_t)(page->size & 0x00FF);
+
+	for(attempt = 0; attempt < FLASH_RETRIES; attempt++){
+		uint16_t crc = 0xFFFF;
+
+		/* After a NAK or a lost reply we can't tell where the bootloader is up to */
+		if(attempt > 0 && flash_resync(fm, page->size) != 0){
+			return -1;
+		}
+
+		fm_flush_buffers(fm);
+		fm_serial_write_byte(fm, BL_WRITE_PAGE);
+
+		for(i = 0; i < 4; i++){
+			fm_serial_write_byte(fm, header[i]);
+			crc = flash_crc16(crc, header[i]);
+		}
+
+		for(i = 0; i < page->size; i++){
+			fm_serial_write_byte(fm, page->data[i]);
+			crc = flash_crc16(crc, page->data[i]);
+		}
+
+		fm_serial_write_byte(fm, (unsigned char)(crc >> 8));
+		fm_serial_write_byte(fm, (unsigned char)(crc & 0x00FF));
+
+		if(flash_read_reply(fm, &reply) == 0 && reply == BL_ACK){
+			page->used = 0;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Get back in step with the bootloader after a page went wrong.  If it
+ * lost bytes it's still waiting for the rest of the page, and would take
+ * the next BL_WRITE_PAGE as data.  A page's worth of zeros finishes any
+ * write in progress, as a zero length or a CRC that won't match, and
+ * anything left over isn't a command.  Once it has said its NAK, pings
+ * show when it's listening again.
+ * */
 static int
-flash_program_data(flowmaster *fm, uint16_t address, uint8_t *data, int data_len)
+flash_resync(flowmaster *fm, int page_size)
 {
+	unsigned char reply;
 	int i;
+
+	for(i = 0; i < page_size + 6; i++){
+		fm_serial_write_byte(fm, 0x00);
+	}
+
+	for(i = 0; i < FLASH_RETRIES; i++){
+		while(fm_serial_wait(fm, FLASH_QUIET_MS)){
+			fm_serial_read_byte(fm, &reply);
+		}
+		fm_flush_buffers(fm);
+
+		fm_serial_write_byte(fm, BL_PING);
+
+		/* A clean ACK, with nothing left over behind it */
+		if(flash_read_reply(fm, &reply) == 0 && reply == BL_ACK && !fm_serial_wait(fm, FLASH_QUIET_MS)){
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Program one HEX record word by word.
+ *
+ * Rather than waiting out a round trip per word, up to FLASH_WINDOW
+ * words are kept in flight and their ACKs counted off as they stream
+ * back, in order.  A NAK, or a reply that never comes, means every word
+ * from there on is suspect: the replies still owed are drained and the
+ * bootloader is pointed back at the first unacknowledged word.
+ * */
+static int
+flash_program_words(flowmaster *fm, uint16_t address, uint8_t *data, int data_len)
+{
+	const int words = (data_len + 1) / 2;
+	int acked = 0;
+	int sent = 0;
+	int retries = 0;
+	unsigned char reply;
 	int rc;
-	
+	int i;
+
 	fm_flush_buffers(fm);
 
 	if((rc = flash_program_address(fm, address)) != 0){
 		return -1;
 	}
 
-	for(i = 0; i < data_len; i += 2){
-		if((rc = flash_program_word(fm, data[i], data[i+1])) != 0){
+	while(acked < words){
+		while(sent < words && sent - acked < FLASH_WINDOW){
+			flash_send_word(fm, data[sent * 2], data[(sent * 2) + 1]);
+			sent++;
+		}
+
+		rc = flash_read_reply(fm, &reply);
+		if(rc == 0 && reply == BL_ACK){
+			acked++;
+			continue;
+		}
+
+		if(++retries > FLASH_RETRIES){
 			return -1;
 		}
+
+		/* Let the words behind the bad one finish before starting over */
+		if(rc == 0){
+			for(i = acked + 1; i < sent && flash_read_reply(fm, &reply) == 0; i++){
+			}
+		}
+		fm_flush_buffers(fm);
+
+		/* Back to the first word not acknowledged */
+		if(flash_program_address(fm, (uint16_t)(address + (acked * 2))) != 0){
+			return -1;
+		}
+		sent = acked;
 	}
 
 	return 0;
@@ -425,26 +702,28 @@ flash_program_address(flowmaster *fm, uint16_t address)
 	return 0;
 }
 
-static int
-flash_program_word(flowmaster *fm, uint8_t high, uint8_t low)
+static void
+flash_send_word(flowmaster *fm, uint8_t high, uint8_t low)
 {
-	int rc;
-	unsigned char response;
-
 	fm_serial_write_byte(fm, BL_PROGRAM);
 	/* TODO: this is a bit screwey, i'm getting byte orders fucked up somewhere */
 	fm_serial_write_byte(fm, low);
 	fm_serial_write_byte(fm, high);
-	
-	do {
-		rc = fm_serial_read_byte(fm, &response);
-	} while(rc != 0);
+}
 
-	if(response != BL_ACK){
-		return -1;
+/* Wait for the next reply byte, -1 if it never turns up */
+static int
+flash_read_reply(flowmaster *fm, unsigned char *reply)
+{
+	int i;
+
+	for(i = 0; i < FLASH_REPLY_TIMEOUTS; i++){
+		if(fm_serial_read_byte(fm, reply) == 0){
+			return 0;
+		}
 	}
 
-	return 0;
+	return -1;
 }
 
 static void
@@ -1,10 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 
 #include "protocol.h"
 #include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -15,16 +17,20 @@ static __inline float roundf(float num) { return floorf(num + 0.5f ); }
 #define PACKET_DATA_LEN 1
 #define PACKET_DATA 2
 
+/* How long a reply may take while streaming, the same as four timed out byte reads */
+#define FM_REPLY_TIMEOUT_NS 800000000ull
+
 static int fm_set_speed(flowmaster *fm, float duty_cycle, int fan_or_pump);
 #ifdef FM_DEBUG_LOGGING
 static void fm_dump_buffer(const unsigned char *buffer, int length, uint8_t csum, uint8_t recv_csum);
 #endif
 
 static unsigned char fm_calc_crc8(const unsigned char* data_pointer, int number_of_bytes);
-/* Convert the ADC value into celcius */
-static float convert_temp_c(int adcval);
 
-static fm_rc fm_get_top(flowmaster *fm);
+static fm_rc fm_get_top_locked(flowmaster *fm, void *arg);
+static fm_rc fm_ping_locked(flowmaster *fm, void *arg);
+static fm_rc fm_autoregulate_locked(flowmaster *fm, void *arg);
+static void fm_update_latency(flowmaster *fm, uint64_t rtt);
 
 void
 dump_rx_packet(flowmaster *fm)
@@ -55,15 +61,43 @@ fm_create()
 	fm->port = INVALID_HANDLE_VALUE;
 #endif
 
+	fm_schema_defaults(fm);
+	fm_mutex_init(&fm->publish_lock);
+	fm_mutex_init(&fm->worker_lock);
+	fm_mutex_init(&fm->probe_lock);
+	fm_io_init(fm);
+	fm_mutex_init(&fm->shadow_lock);
+	fm_display_init(fm);
+	fm_stream_init(fm);
+	fm_scheduler_init(fm);
+
 	return fm;
 }
 
 void
 fm_destroy(flowmaster *fm)
 {
+	fm_stream_stop(fm);
+
+	fm_scheduler_stop(fm);
+	fm_control_stop(fm);
+	fm_combine_stop(fm);
+
 	if(fm_isconnected(fm)){
 		fm_disconnect(fm);
 	}
+
+	fm_alarms_destroy(fm->alarms);
+	fm_governor_destroy(fm->governor);
+	fm_free_probes(fm);
+	fm_mutex_destroy(&fm->probe_lock);
+	fm_scheduler_destroy(fm);
+	fm_display_destroy(fm);
+	fm_stream_destroy(fm);
+	fm_mutex_destroy(&fm->shadow_lock);
+	fm_io_destroy(fm);
+	fm_mutex_destroy(&fm->worker_lock);
+	fm_mutex_destroy(&fm->publish_lock);
 	free(fm);
 }
 
@@ -72,42 +106,85 @@ fm_connect(flowmaster *fm, const char *port)
 {
 	fm_rc rc;
 
+	/* Whatever we knew about the controller may no longer be true */
+	fm_forget_state(fm);
+
 	rc = fm_connect_private(fm, port);
 	if(rc != FM_OK){
 	    return rc;
 	}
 
+	/* From here on only the I/O thread talks to the port */
+	rc = fm_io_start(fm);
+	if(rc != FM_OK){
+		return rc;
+	}
+
 	rc = fm_ping(fm);
 	if(rc != FM_OK) {
 	    return rc;
 	}
 
-	rc = fm_get_top(fm);
+	rc = fm_io_run(fm, FM_PRIORITY_NORMAL, fm_get_top_locked, NULL);
 	if(rc != FM_OK){
 		return rc;
 	}
 
+	/* Stock firmware doesn't know GET_SCHEMA, fm_query_schema() asks if the caller knows better */
+	fm_schema_defaults(fm);
+
 	return FM_OK;
 }
 
 fm_rc
 fm_get_data(flowmaster *fm, fm_data *data)
+{
+	fm_frame frame;
+	fm_rc rc;
+
+	rc = fm_fetch_frame(fm, &frame);
+	if(rc != FM_OK){
+		return rc;
+	}
+
+	fm_decode_frame(fm, &frame, data);
+
+	return FM_OK;
+}
+
+static fm_rc
+fm_request_frame_locked(flowmaster *fm, void *frame)
+{
+	return fm_request_frame(fm, (fm_frame*) frame);
+}
+
+fm_rc
+fm_fetch_frame(flowmaster *fm, fm_frame *frame)
+{
+	return fm_io_run(fm, FM_PRIORITY_NORMAL, fm_request_frame_locked, frame);
+}
+
+fm_rc
+fm_request_frame(flowmaster *fm, fm_frame *frame)
 {
 	int rc;
-	int temp;
 	int written;
 
 	fm_start_write_buffer(fm, PACKET_TYPE_REQUEST_STATUS, 0);
 	fm_end_write_buffer(fm);
 
-	fm_flush_buffers(fm);
+	/* While streaming unread input is a heartbeat on its way to the stream */
+	if(!fm->stream_running){
+		fm_flush_buffers(fm);
+	}
 
 	rc = fm_serial_write(fm, &written);
 	if(rc != 0){
 		return FM_WRITE_ERROR;
 	}
 	
-	rc = fm_serial_read(fm);
+	/* Any heartbeat will do, streamed or not it's as fresh as the one asked for */
+	rc = fm_serial_read_packet(fm);
 	if(rc != 0){
 		return FM_READ_ERROR;
 	}
@@ -123,31 +200,66 @@ fm_get_data(flowmaster *fm, fm_data *data)
 		return FM_CHECKSUM_ERROR;
 	}
 
-	/* Convert the duty cycle back into a percentage */
-	temp = ((fm->read_buffer[2] << 8) | fm->read_buffer[3]);
-	data->fan_duty_cycle  = (float)temp / (float)fm->timer_top;
+	fm_capture_frame(fm, frame);
+	frame->timestamp = fm->rx_timestamp;
+	frame->request_time = fm->tx_timestamp;
 
-	temp = (fm->read_buffer[4] << 8) | fm->read_buffer[5];
-	data->pump_duty_cycle = (float)temp / (float)fm->timer_top;
+	/* A streamed heartbeat may have been on its way before we asked, it says nothing about the round trip */
+	if(!fm->stream_running){
+		fm_update_latency(fm, frame->timestamp - frame->request_time);
+	}
 
-	data->fan_rpm  = fm->read_buffer[6] * 30;
-	data->pump_rpm = fm->read_buffer[7] * 30;
+	return FM_OK;
+}
 
-	/* Take raw ADC values and convert into celcius */
-	temp = (fm->read_buffer[8] << 8)  | (fm->read_buffer[9]);
-	data->coolant_temp = convert_temp_c(temp);
+/* Fold another round trip into the running estimates */
+static void
+fm_update_latency(flowmaster *fm, uint64_t rtt)
+{
+	const uint64_t count = fm->rtt_count;
+	const uint64_t min = fm->rtt_min;
+	uint64_t mean = fm->rtt_mean;
 
-	temp = (fm->read_buffer[10] << 8) | (fm->read_buffer[11]);
-	data->ambient_temp = convert_temp_c(temp);
+	if(count == 0){
+		mean = rtt;
+	}
+	else {
+		/* 1/8th of the way towards the new round trip */
+		mean = (uint64_t)((int64_t) mean + (((int64_t) rtt - (int64_t) mean) / 8));
+	}
 
-	/* Flow rate isn't used yet*/
-	//data->flow_rate = fm->read_buffer[12];
-	data->flow_rate = 0.0f;
-	return FM_OK;
+	fm_store64(&fm->rtt_last, rtt);
+	fm_store64(&fm->rtt_mean, mean);
+	if(count == 0 || rtt < min){
+		fm_store64(&fm->rtt_min, rtt);
+	}
+	fm_store64(&fm->rtt_count, count + 1);
+}
+
+void
+fm_get_latency(flowmaster *fm, fm_latency *latency)
+{
+	latency->count = (unsigned long) fm_load64(&fm->rtt_count);
+	latency->last_rtt = fm_load64(&fm->rtt_last);
+	latency->min_rtt = fm_load64(&fm->rtt_min);
+	latency->mean_rtt = fm_load64(&fm->rtt_mean);
+	latency->one_way = latency->min_rtt / 2;
+}
+
+void
+fm_capture_frame(flowmaster *fm, fm_frame *frame)
+{
+	/*
+	 * Skip the packet type and length, the checksum comes along but is
+	 * harmless.  The payload is PACKET_DATA bytes longer than what's left
+	 * of the packet, zero the tail rather than leave it uninitialised.
+	 * */
+	memcpy(frame->payload, &fm->read_buffer[PACKET_DATA], FM_BUFFER_SIZE - PACKET_DATA);
+	memset(&frame->payload[FM_BUFFER_SIZE - PACKET_DATA], 0, FM_PAYLOAD_SIZE - (FM_BUFFER_SIZE - PACKET_DATA));
 }
 
 static fm_rc
-fm_get_top(flowmaster *fm)
+fm_get_top_locked(flowmaster *fm, void *arg)
 {
 	int written;
 	int rc;
@@ -182,6 +294,12 @@ fm_get_top(flowmaster *fm)
 
 fm_rc
 fm_ping(flowmaster *fm)
+{
+	return fm_io_run(fm, FM_PRIORITY_NORMAL, fm_ping_locked, NULL);
+}
+
+static fm_rc
+fm_ping_locked(flowmaster *fm, void *arg)
 {
 	int rc;
 	int written;
@@ -276,6 +394,28 @@ fm_calc_crc8(const unsigned char* data_pointer, int number_of_bytes)
 
 int
 fm_serial_read(flowmaster *fm)
+{
+	for(;;){
+		if(fm_serial_read_packet(fm) != 0){
+			return -1;
+		}
+
+		/* While streaming, heartbeats turn up unasked in the middle of other replies */
+		if(!fm->stream_running || fm->read_buffer_len == 0 || fm->read_buffer[0] != PACKET_TYPE_HEARTBEAT){
+			return 0;
+		}
+
+		fm_stream_receive(fm);
+
+		/* They keep coming whether or not the reply does, so give up on it in the end */
+		if(fm_monotonic_ns() - fm->tx_timestamp > FM_REPLY_TIMEOUT_NS){
+			return -1;
+		}
+	}
+}
+
+int
+fm_serial_read_packet(flowmaster *fm)
 {
 	unsigned char byte;
 	unsigned char prev_byte = 0;
@@ -307,8 +447,11 @@ fm_serial_read(flowmaster *fm)
 					continue;
 				case ETX:
 					/* Transmission complete */
+					fm->rx_timestamp = fm_monotonic_ns();
 					goto done;
 				case DLE:
+					/* Escaped DLE, it can't start another escape */
+					prev_byte = 0;
 					goto dle_unstuff;
 			}
 		}
@@ -368,7 +511,7 @@ fm_prev_rx_byte(flowmaster *fm, unsigned char *byte)
 	return 0;
 }
 
-static int
+int
 fm_do_write(flowmaster *fm, int response)
 {
 	int written;
@@ -394,20 +537,92 @@ fm_do_write(flowmaster *fm, int response)
 int
 fm_autoregulate(flowmaster *fm, int regulate)
 {
+	regulate = regulate ? 1 : 0;
+
+	return fm_io_run(fm, FM_PRIORITY_REALTIME, fm_autoregulate_locked, &regulate);
+}
+
+static fm_rc
+fm_autoregulate_locked(flowmaster *fm, void *arg)
+{
+	const int regulate = *(int*) arg;
 	const int type = regulate ? PACKET_TYPE_AUTOMATIC : PACKET_TYPE_MANUAL;
+	int rc;
+
+	if(fm_shadow_matches(fm, FM_SHADOW_MODE, regulate)){
+		return FM_OK;
+	}
+
 	fm_start_write_buffer(fm, type, 0);
 	fm_end_write_buffer(fm);
-	return fm_do_write(fm, PACKET_TYPE_ACK);
+	rc = fm_do_write(fm, PACKET_TYPE_ACK);
+
+	if(rc == FM_OK){
+		fm_shadow_store(fm, FM_SHADOW_MODE, regulate);
+	}
+	else {
+		fm_shadow_invalidate(fm, 1u << FM_SHADOW_MODE);
+	}
+
+	/* Under automatic control the duty cycles are the controller's business */
+	if(rc != FM_OK || regulate){
+		fm_shadow_invalidate(fm, (1u << FM_SHADOW_FAN) | (1u << FM_SHADOW_PUMP));
+	}
+
+	return (fm_rc) rc;
 }
 
 int
 fm_set_speed(flowmaster *fm, float duty_cycle, int fan_or_pump)
 {
+	int rc;
+
+	/* Held until the speed is in a slot, or if combining is stopping until its last flush is out */
+	fm_mutex_lock(&fm->worker_lock);
+
+	if(fm->combine != NULL){
+		rc = fm_combine_set(fm->combine, duty_cycle, fan_or_pump);
+		fm_mutex_unlock(&fm->worker_lock);
+		return rc;
+	}
+
+	fm_mutex_unlock(&fm->worker_lock);
+
+	return fm_send_speed(fm, duty_cycle, fan_or_pump);
+}
+
+struct fm_speed_s {
+	float duty_cycle;
+	int fan_or_pump;
+};
+
+static fm_rc
+fm_send_speed_locked(flowmaster *fm, void *arg)
+{
+	const struct fm_speed_s *speed = (const struct fm_speed_s*) arg;
+
+	return (fm_rc) fm_set_speed_locked(fm, speed->duty_cycle, speed->fan_or_pump);
+}
+
+fm_rc
+fm_send_speed(flowmaster *fm, float duty_cycle, int fan_or_pump)
+{
+	struct fm_speed_s speed;
+
+	speed.duty_cycle = duty_cycle;
+	speed.fan_or_pump = fan_or_pump;
+
+	return fm_io_run(fm, FM_PRIORITY_REALTIME, fm_send_speed_locked, &speed);
+}
+
+int
+fm_set_speed_locked(flowmaster *fm, float duty_cycle, int fan_or_pump)
+{
+	const fm_shadow_reg reg = fan_or_pump == PACKET_TYPE_SET_PUMP ? FM_SHADOW_PUMP : FM_SHADOW_FAN;
 	uint16_t cycle;
 	int rc;
 	int written;
 
-
 	if(duty_cycle > 1.0){
 		duty_cycle = 1.0;
 	}
@@ -417,6 +632,14 @@ fm_set_speed(flowmaster *fm, float duty_cycle, int fan_or_pump)
 
 	cycle = (uint16_t) (fm->timer_top * duty_cycle);
 
+	/* Already running at that, nothing to say */
+	if(fm_shadow_matches(fm, reg, cycle)){
+		return FM_OK;
+	}
+
+	/* Until the ACK comes back we can't be sure either way */
+	fm_shadow_invalidate(fm, 1u << reg);
+
 	fm_start_write_buffer(fm, fan_or_pump, 2);
 	fm_add_word(fm, cycle);
 	fm_end_write_buffer(fm);
@@ -434,75 +657,172 @@ fm_set_speed(flowmaster *fm, float duty_cycle, int fan_or_pump)
 	if((rc = fm_validate_packet(fm, PACKET_TYPE_ACK)) != 0){
 		return FM_CHECKSUM_ERROR;
 	}
+
+	fm_shadow_store(fm, reg, cycle);
+
+	/* Things are about to move, watch closely */
+	fm_governor_kick(fm);
 	
 	return FM_OK;
 }
 
-static fm_rc
-fm_set_fan_profile_segment(flowmaster *fm, float *data, int offset, int count);
+/* Most points one SET_FAN_PROFILE packet carries */
+#define FM_PROFILE_SEGMENT 5
+#define FM_PROFILE_MAX_SEGMENTS ((FM_FAN_BUFFER_SIZE + FM_PROFILE_SEGMENT - 1) / FM_PROFILE_SEGMENT)
 
-fm_rc
-fm_set_fan_profile(struct flowmaster_s *fm, float *data, int length)
+/* Segments an upload puts on the wire before reading back their ACKs */
+#define FM_PROFILE_WINDOW 4
+
+/* A run of profile segments to upload, for the I/O thread */
+struct fm_upload_s {
+	const uint16_t *ticks;
+	const int *offset;
+	const int *count;
+	int segments;
+};
+
+/* Queue one segment behind any already sent, first discarding stale input if first */
+static fm_rc
+fm_send_profile_segment(flowmaster *fm, const uint16_t *ticks, int offset, int count, int first)
 {
-	int offset = 0;
-	int count = 5;
-	fm_rc rc;
+	int rc;
+	int written;
+	int i;
 
-	if(length != FM_FAN_BUFFER_SIZE){
-		return FM_BAD_BUFFER_LENGTH;
+	fm_start_write_buffer(fm, PACKET_TYPE_SET_FAN_PROFILE, (count * 2) + 2);
+	fm_add_byte(fm, (uint8_t)(count  & 0xFF));
+	fm_add_byte(fm, (uint8_t)(offset & 0xFF));
+
+	for(i = 0; i < count; i++){
+		fm_add_word(fm, ticks[offset + i]);
+	}
+	fm_end_write_buffer(fm);
+
+	rc = first ? fm_serial_write(fm, &written) : fm_serial_write_more(fm, &written);
+	if(rc != 0){
+		return FM_WRITE_ERROR;
 	}
 
-	while(offset < FM_FAN_BUFFER_SIZE) {
+	return FM_OK;
+}
+
+static fm_rc
+fm_set_fan_profile_locked(flowmaster *fm, void *arg)
+{
+	const struct fm_upload_s *upload = (const struct fm_upload_s*) arg;
+	fm_rc result = FM_OK;
+	int sent;
+	int i;
 
-		if((offset + count) > FM_FAN_BUFFER_SIZE){
-			count = FM_FAN_BUFFER_SIZE - offset;
+	/* Everything goes out back to back, the controller handles them in order */
+	for(sent = 0; sent < upload->segments; sent++){
+		result = fm_send_profile_segment(fm, upload->ticks, upload->offset[sent], upload->count[sent], sent == 0);
+		if(result != FM_OK){
+			break;
 		}
+	}
 
-		rc = fm_set_fan_profile_segment(fm, data, offset, count);
+	for(i = 0; i < sent; i++){
+		if(fm_serial_read(fm) != 0){
+			result = FM_READ_ERROR;
+			break;
+		}
 
-		if(rc != FM_OK){
-			return rc;
+		/* Keep reading after a NAK, the ACKs behind it are still coming */
+		if(fm_validate_packet(fm, PACKET_TYPE_ACK) != 0 && result == FM_OK){
+			result = FM_CHECKSUM_ERROR;
 		}
+	}
 
-		offset += count;
+	/* Don't leave late replies lying around for the next transaction */
+	if(result != FM_OK){
+		fm_flush_buffers(fm);
 	}
 
-	return FM_OK;
+	return result;
 }
 
+static void
+fm_profile_ticks(flowmaster *fm, const float *data, uint16_t *ticks);
+
 fm_rc
-fm_set_fan_profile_segment(flowmaster *fm, float *data, int offset, int count)
+fm_set_fan_profile(struct flowmaster_s *fm, float *data, int length)
 {
+	uint16_t ticks[FM_FAN_BUFFER_SIZE];
+	uint16_t known[FM_FAN_BUFFER_SIZE];
+	int offset[FM_PROFILE_MAX_SEGMENTS];
+	int count[FM_PROFILE_MAX_SEGMENTS];
+	struct fm_upload_s upload;
+	int segments = 0;
+	int have_known;
+	int done;
 	int i;
-	fm_rc rc;
-	const int bytes_to_send = (count * 2) + 2;
-	float *ptr = data + offset;
-	int written;
+	fm_rc rc = FM_OK;
 
-	fm_start_write_buffer(fm, PACKET_TYPE_SET_FAN_PROFILE, bytes_to_send);
-	fm_add_byte(fm, (uint8_t)(count  & 0xFF));
-	fm_add_byte(fm, (uint8_t)(offset & 0xFF));
+	if(length != FM_FAN_BUFFER_SIZE){
+		return FM_BAD_BUFFER_LENGTH;
+	}
 
-	for(i = 0; i < count; i++){
-		const int temp = (int) roundf((*ptr * fm->timer_top));
-		fm_add_word(fm, (uint16_t)(temp & 0xFFFF));
-		ptr++;
+	fm_mutex_lock(&fm->bulk_lock);
+
+	fm_profile_ticks(fm, data, ticks);
+	have_known = fm_shadow_load_profile(fm, known);
+
+	/* Only the points that differ from what the controller last acknowledged */
+	i = 0;
+	while(i < FM_FAN_BUFFER_SIZE){
+		int j;
+
+		if(have_known && ticks[i] == known[i]){
+			i++;
+			continue;
+		}
+
+		/* Take in any later changes the packet has room for */
+		offset[segments] = i;
+		count[segments] = 1;
+		for(j = i + 1; j < i + FM_PROFILE_SEGMENT && j < FM_FAN_BUFFER_SIZE; j++){
+			if(!have_known || ticks[j] != known[j]){
+				count[segments] = j - i + 1;
+			}
+		}
+
+		i += count[segments];
+		segments++;
 	}
-	fm_end_write_buffer(fm);
 
-	if((rc = fm_serial_write(fm, &written)) != 0){
-		return FM_WRITE_ERROR;
+	if(segments > 0){
+		/* Half uploaded is neither the old profile nor the new one */
+		fm_shadow_invalidate(fm, 1u << FM_SHADOW_PROFILE);
 	}
 
-	if((rc = fm_serial_read(fm)) != 0){
-		return FM_READ_ERROR;
+	/* A window at a time, so anything urgent can get in between */
+	for(done = 0; done < segments && rc == FM_OK; done += upload.segments){
+		upload.ticks = ticks;
+		upload.offset = &offset[done];
+		upload.count = &count[done];
+		upload.segments = segments - done < FM_PROFILE_WINDOW ? segments - done : FM_PROFILE_WINDOW;
+		rc = fm_io_run(fm, FM_PRIORITY_BULK, fm_set_fan_profile_locked, &upload);
 	}
 
-	if((rc = fm_validate_packet(fm, PACKET_TYPE_ACK)) != 0){
-		return FM_CHECKSUM_ERROR;
+	if(rc == FM_OK){
+		fm_shadow_store_profile(fm, ticks);
 	}
 
-	return FM_OK;
+	fm_mutex_unlock(&fm->bulk_lock);
+
+	return rc;
+}
+
+/* A profile as the controller stores it */
+static void
+fm_profile_ticks(flowmaster *fm, const float *data, uint16_t *ticks)
+{
+	int i;
+
+	for(i = 0; i < FM_FAN_BUFFER_SIZE; i++){
+		ticks[i] = (uint16_t)(((int) roundf(data[i] * fm->timer_top)) & 0xFFFF);
+	}
 }
 
 
@@ -513,77 +833,165 @@ fm_set_fan_profile_segment(flowmaster *fm, float *data, int offset, int count)
  *
  */
 
-static fm_rc
-fm_get_fan_profile_segment(flowmaster *fm, int offset, int *read, float *data);
+/* Times a download segment is asked for again before giving up */
+#define FM_PROFILE_RETRIES 3
 
-fm_rc
-fm_get_fan_profile(flowmaster *fm, float *data, int length)
-{
-	int offset = 0;
-	int ctr = 0;
+/* One segment of a fan profile download, for the I/O thread */
+struct fm_segment_s {
+	uint16_t *ticks;
+	int offset;
+	int received;
+};
 
-	if(length != FM_FAN_BUFFER_SIZE) {
-		return FM_BAD_BUFFER_LENGTH;
-	}
-
-	do {
-		int received;
-		fm_get_fan_profile_segment(fm, offset, &received, data);
-		offset += received;
-		ctr++;
-
-	} while(offset < FM_FAN_BUFFER_SIZE);
-
-	return 0;
-}
-
-fm_rc
-fm_get_fan_profile_segment(flowmaster *fm, int offset, int *read, float *data)
+static fm_rc
+fm_get_fan_profile_locked(flowmaster *fm, void *arg)
 {
-	int received = 0;
-	int count;
-	int i;
+	struct fm_segment_s *segment = (struct fm_segment_s*) arg;
 	int written;
+	int count;
 	int ptr = 3;
-	fm_rc rc;
-	/* bytes 0 and 1 are packet type and length */
+	int i;
 
 	fm_start_write_buffer(fm, PACKET_TYPE_GET_FAN_PROFILE, 1);
-	fm_add_byte(fm, offset);
+	fm_add_byte(fm, segment->offset);
 	fm_end_write_buffer(fm);
 
-	rc = fm_serial_write(fm, &written);
-	if(rc != 0){
+	if(fm_serial_write(fm, &written) != 0){
 		return FM_WRITE_ERROR;
 	}
 
-	rc = fm_serial_read(fm);
-	if(rc != 0){
+	if(fm_serial_read(fm) != 0){
 		return FM_READ_ERROR;
 	}
 
-	if((rc = fm_validate_packet(fm, PACKET_TYPE_GET_FAN_PROFILE)) != 0){
+	if(fm_validate_packet(fm, PACKET_TYPE_GET_FAN_PROFILE) != 0){
 		return FM_CHECKSUM_ERROR;
 	}
 
-	/* Number of items in the packet */
+	/* Number of items in the packet, none or more than the packet holds is garbage */
 	count = fm->read_buffer[2];
+	if(count == 0 || segment->offset + count > FM_FAN_BUFFER_SIZE || ptr + (count * 2) > fm->read_buffer_len){
+		return FM_READ_ERROR;
+	}
+
+	for(i = 0; i < count; i++){
+		segment->ticks[segment->offset + i] = (uint16_t)((fm->read_buffer[ptr] << 8) | fm->read_buffer[ptr + 1]);
+		ptr += 2;
+	}
+	segment->received = count;
 
-	data += offset;
+	return FM_OK;
+}
 
-	for(i = 0; i < count ; i++){
-		int temp = (fm->read_buffer[ptr++] << 8);
-		temp |= fm->read_buffer[ptr++];
-		(*data) = ((float)temp / (float)fm->timer_top) ;
-		data++;
-		received++;
+/* Read the points from offset on into ticks, retrying a few times */
+static fm_rc
+fm_get_fan_profile_segment(flowmaster *fm, uint16_t *ticks, int offset, int *received)
+{
+	struct fm_segment_s segment;
+	fm_rc rc = FM_OK;
+	int attempt;
+
+	segment.ticks = ticks;
+	segment.offset = offset;
+
+	/* One segment at a time, so anything urgent can get in between */
+	for(attempt = 0; attempt < FM_PROFILE_RETRIES; attempt++){
+		segment.received = 0;
+		rc = fm_io_run(fm, FM_PRIORITY_BULK, fm_get_fan_profile_locked, &segment);
+		if(rc == FM_OK){
+			*received = segment.received;
+			break;
+		}
 	}
 
-	*read = received;
+	return rc;
+}
+
+/*
+ * Compare one segment of the cached profile with the controller, moving
+ * on to the next segment each time.  FM_OK if they agree, FM_BUSY if
+ * the controller has something else.
+ * */
+static fm_rc
+fm_check_fan_profile(flowmaster *fm, const uint16_t *cached)
+{
+	uint16_t ticks[FM_FAN_BUFFER_SIZE];
+	const int offset = fm->profile_check;
+	int received;
+	fm_rc rc;
+
+	rc = fm_get_fan_profile_segment(fm, ticks, offset, &received);
+	if(rc != FM_OK){
+		return rc;
+	}
+
+	fm->profile_check = (offset + received) % FM_FAN_BUFFER_SIZE;
+
+	if(memcmp(&ticks[offset], &cached[offset], received * sizeof(uint16_t)) != 0){
+		return FM_BUSY;
+	}
 
 	return FM_OK;
 }
 
+/**
+ * data - the fan speed array, must be 65 elements.
+ * length - the length of the buf, must be 65
+ *
+ * Served from the last profile read or written when there is one,
+ * after checking a segment of it against the controller.  The rest
+ * isn't checked, the protocol has no profile checksum and reading it
+ * all costs as much as not caching it.
+ */
+fm_rc
+fm_get_fan_profile(flowmaster *fm, float *data, int length)
+{
+	uint16_t ticks[FM_FAN_BUFFER_SIZE];
+	int offset = 0;
+	int i;
+	fm_rc rc = FM_OK;
+
+	if(length != FM_FAN_BUFFER_SIZE) {
+		return FM_BAD_BUFFER_LENGTH;
+	}
+
+	fm_mutex_lock(&fm->bulk_lock);
+
+	if(fm_shadow_load_profile(fm, ticks)){
+		rc = fm_check_fan_profile(fm, ticks);
+		if(rc == FM_OK){
+			offset = FM_FAN_BUFFER_SIZE;
+		}
+		else if(rc == FM_BUSY){
+			/* Changed behind our back, the whole thing is suspect */
+			fm_shadow_invalidate(fm, 1u << FM_SHADOW_PROFILE);
+			rc = FM_OK;
+		}
+	}
+
+	while(offset < FM_FAN_BUFFER_SIZE && rc == FM_OK){
+		int received;
+
+		rc = fm_get_fan_profile_segment(fm, ticks, offset, &received);
+		if(rc == FM_OK){
+			offset += received;
+		}
+	}
+
+	if(rc == FM_OK){
+		/* What the controller just told us is as good as an ACK */
+		fm_shadow_store_profile(fm, ticks);
+
+		for(i = 0; i < FM_FAN_BUFFER_SIZE; i++){
+			data[i] = (float) ticks[i] / (float) fm->timer_top;
+		}
+	}
+
+	fm_mutex_unlock(&fm->bulk_lock);
+
+	return rc;
+}
+
 
 #ifdef FM_DEBUG_LOGGING
 static void
@@ -608,24 +1016,6 @@ fm_dump_buffer(const unsigned char *buffer, int length, uint8_t csum, uint8_t re
 }
 #endif
 
-float
-convert_temp_c(int adc_val)
-{
-	double temp;
-	const int ref_resistor = 10000;
-
-	/* This is a dirty hack to prevent a divide by zero */
-	if(adc_val == 0){
-		adc_val = 1;
-	}
-
-	temp = log((double)((1024 * ref_resistor / adc_val) - ref_resistor));
-	temp = 1 / (0.001129148 + (0.000234125 * temp) + (0.0000000876741 * temp * temp * temp));
-	temp -= 273.15;
-
-	return (float) temp;
-}
-
 /*
  * Getter and setter routines for libflowmaster
  *
@@ -646,41 +1036,379 @@ fm_set_pump_speed(flowmaster *fm, float duty_cycle)
 fm_rc
 fm_update_status(flowmaster *fm)
 {
-	return fm_get_data(fm, &(fm->data));
+	fm_frame frame;
+	fm_rc rc;
+
+	rc = fm_fetch_frame(fm, &frame);
+	if(rc != FM_OK){
+		return rc;
+	}
+
+	/* Back on the caller's thread, consumers of the sample may well want to send commands */
+	fm_publish_frame(fm, &frame);
+
+	return FM_OK;
+}
+
+/* True if anything attached to the handle needs every sample decoded */
+static int
+fm_wants_samples(flowmaster *fm)
+{
+#ifndef _WIN32
+	if(fm->log != NULL){
+		return 1;
+	}
+#endif
+	return fm->filter != NULL || fm->alarms != NULL || fm->governor != NULL
+		|| fm->history != NULL || fm->rollup != NULL || fm_has_subscribers(fm);
+}
+
+/*
+ * Every heartbeat, polled or streamed, comes through here, on whichever
+ * thread received it.  Alarm callbacks and subscribers are called after
+ * publish_lock is dropped, so they may send commands and publish in turn.
+ * */
+void
+fm_publish_frame(flowmaster *fm, const fm_frame *frame)
+{
+	fm_sample sample;
+	unsigned int seq;
+	int wanted;
+
+	fm_mutex_lock(&fm->publish_lock);
+
+	fm_shadow_check(fm, frame);
+
+	seq = fm->data_seq;
+
+	/* Odd sequence, readers back off until we are done */
+	fm_store_relaxed(&fm->data_seq, seq + 1);
+	fm_fence_release();
+
+	*(volatile fm_frame*) &fm->frame = *frame;
+
+	/* Even again, and every memoised value is now stale */
+	fm_store_release(&fm->data_seq, seq + 2);
+
+	/* Only pay for a full decode if somebody wants every sample */
+	wanted = fm_wants_samples(fm);
+	if(wanted){
+		sample.timestamp = frame->timestamp;
+		sample.request_time = frame->request_time;
+		fm_decode_frame(fm, frame, &sample.data);
+
+		if(fm->filter != NULL){
+			fm_filter_add(fm->filter, &sample);
+		}
+
+		if(fm->governor != NULL){
+			fm_governor_observe(fm, &sample);
+		}
+
+		if(fm->history != NULL){
+			fm_history_append(fm->history, &sample);
+		}
+
+		if(fm->rollup != NULL){
+			fm_rollup_add(fm->rollup, &sample);
+		}
+#ifndef _WIN32
+		if(fm->log != NULL){
+			fm_log_append(fm->log, &sample);
+		}
+#endif
+	}
+
+	fm_mutex_unlock(&fm->publish_lock);
+
+	if(!wanted){
+		return;
+	}
+
+	if(fm->alarms != NULL){
+		fm_alarms_check(fm, &sample);
+	}
+
+	fm_notify_subscribers(fm, &sample);
+}
+
+void
+fm_attach_history(flowmaster *fm, fm_history *history)
+{
+	/* Once we have the lock no publish is still using the old one */
+	fm_mutex_lock(&fm->publish_lock);
+	fm->history = history;
+	fm_mutex_unlock(&fm->publish_lock);
+}
+
+void
+fm_attach_rollup(flowmaster *fm, fm_rollup *rollup)
+{
+	/* As fm_attach_history() */
+	fm_mutex_lock(&fm->publish_lock);
+	fm->rollup = rollup;
+	fm_mutex_unlock(&fm->publish_lock);
+}
+
+void
+fm_attach_filter(flowmaster *fm, fm_filter *filter)
+{
+	/* As fm_attach_history() */
+	fm_mutex_lock(&fm->publish_lock);
+	fm->filter = filter;
+	fm_mutex_unlock(&fm->publish_lock);
+}
+
+#ifndef _WIN32
+void
+fm_attach_log(flowmaster *fm, fm_log *log)
+{
+	/* As fm_attach_history() */
+	fm_mutex_lock(&fm->publish_lock);
+	fm->log = log;
+	fm_mutex_unlock(&fm->publish_lock);
+}
+#endif
+
+/*
+ * Seqlock read side.  Copy the heartbeat and retry if the updater
+ * touched it while we were copying.  Never blocks the updater.
+ * */
+static void
+fm_current_frame(flowmaster *fm, fm_frame *frame)
+{
+	unsigned int seq;
+
+	do {
+		while((seq = fm_load_acquire(&fm->data_seq)) & 1){
+			/* Update in progress */
+		}
+
+		*frame = *(volatile fm_frame*) &fm->frame;
+
+		fm_fence_acquire();
+	} while(fm->data_seq != seq);
+}
+
+/* Same again for a single raw value, also hands back the sequence it came from */
+static int
+fm_current_raw(flowmaster *fm, int offset, int width, unsigned int *seq_out)
+{
+	const volatile unsigned char *payload = fm->frame.payload;
+	unsigned int seq;
+	int value;
+
+	do {
+		while((seq = fm_load_acquire(&fm->data_seq)) & 1){
+			/* Update in progress */
+		}
+
+		if(width == 2){
+			value = (payload[offset] << 8) | payload[offset + 1];
+		}
+		else {
+			value = payload[offset];
+		}
+
+		fm_fence_acquire();
+	} while(fm->data_seq != seq);
+
+	*seq_out = seq;
+	return value;
+}
+
+/*
+ * Decode a single value on first use and remember it until the next
+ * heartbeat arrives.  The memo is tagged with the sequence number it was
+ * decoded from, so a stale one is never returned, and it is a single 64
+ * bit store so racing readers can't tear it.
+ * */
+static float
+fm_lazy_decode(flowmaster *fm, enum fm_memo_e slot)
+{
+	static const int fields[FM_MEMO_COUNT] = {
+		FM_FIELD_FAN_DUTY_CYCLE, FM_FIELD_PUMP_DUTY_CYCLE, FM_FIELD_COOLANT_TEMP, FM_FIELD_AMBIENT_TEMP
+	};
+	const fm_field_desc *field = fm_find_field(fm, fields[slot]);
+	union { float f; uint32_t u; } value;
+	unsigned int seq;
+	uint64_t memo;
+	int raw;
+
+	if(field == NULL){
+		return 0.0f;
+	}
+
+	raw = fm_field_extend(field, fm_current_raw(fm, field->offset, field->type == FM_TYPE_U8 ? 1 : 2, &seq));
+
+	memo = fm_load64(&fm->memo[slot]);
+	if((unsigned int)(memo >> 32) == seq){
+		value.u = (uint32_t) memo;
+		return value.f;
+	}
+
+	value.f = (float) fm_field_convert(fm, field, raw);
+
+	fm_store64(&fm->memo[slot], ((uint64_t) seq << 32) | value.u);
+
+	return value.f;
+}
+
+void
+fm_snapshot(flowmaster *fm, fm_data *data)
+{
+	fm_frame frame;
+
+	fm_current_frame(fm, &frame);
+	fm_decode_frame(fm, &frame, data);
+}
+
+/* Raw value of any field in the current heartbeat, 0 if there's no such field */
+static int
+fm_current_field(flowmaster *fm, int id, const fm_field_desc **field_out)
+{
+	const fm_field_desc *field = fm_find_field(fm, id);
+	unsigned int seq;
+
+	*field_out = field;
+	if(field == NULL){
+		return 0;
+	}
+
+	return fm_field_extend(field, fm_current_raw(fm, field->offset, field->type == FM_TYPE_U8 ? 1 : 2, &seq));
+}
+
+double
+fm_get_field(flowmaster *fm, int id)
+{
+	const fm_field_desc *field;
+	const int raw = fm_current_field(fm, id, &field);
+
+	if(field == NULL){
+		return 0.0;
+	}
+
+	return fm_field_convert(fm, field, raw);
+}
+
+uint64_t
+fm_raw_heartbeat(flowmaster *fm, unsigned char *payload)
+{
+	fm_frame frame;
+
+	fm_current_frame(fm, &frame);
+	memcpy(payload, frame.payload, FM_PAYLOAD_SIZE);
+
+	return frame.timestamp;
+}
+
+double
+fm_data_field(const fm_data *data, fm_field field)
+{
+	switch(field){
+		case FM_FIELD_FAN_DUTY_CYCLE:
+			return data->fan_duty_cycle;
+		case FM_FIELD_PUMP_DUTY_CYCLE:
+			return data->pump_duty_cycle;
+		case FM_FIELD_AMBIENT_TEMP:
+			return data->ambient_temp;
+		case FM_FIELD_COOLANT_TEMP:
+			return data->coolant_temp;
+		case FM_FIELD_FLOW_RATE:
+			return data->flow_rate;
+		case FM_FIELD_FAN_RPM:
+			return data->fan_rpm;
+		case FM_FIELD_PUMP_RPM:
+			return data->pump_rpm;
+		default:
+			return 0.0;
+	}
 }
 
 float
 fm_fan_duty_cycle(flowmaster *fm)
 {
-	return fm->data.fan_duty_cycle;
+	return fm_lazy_decode(fm, FM_MEMO_FAN_DUTY);
 }
 
 float
 fm_pump_duty_cycle(flowmaster *fm)
 {
-	return fm->data.pump_duty_cycle;
+	return fm_lazy_decode(fm, FM_MEMO_PUMP_DUTY);
 }
 
 float
 fm_ambient_temp(flowmaster *fm)
 {
-	return fm->data.ambient_temp;
+	return fm_lazy_decode(fm, FM_MEMO_AMBIENT);
 }
 
 float
 fm_coolant_temp(flowmaster *fm)
 {
-	return fm->data.coolant_temp;
+	return fm_lazy_decode(fm, FM_MEMO_COOLANT);
 }
 
 int
 fm_fan_rpm(flowmaster *fm)
 {
-	return fm->data.fan_rpm;
+	return (int) floor(fm_get_field(fm, FM_FIELD_FAN_RPM) + 0.5);
 }
 
 int
 fm_pump_rpm(flowmaster *fm)
 {
-	return fm->data.pump_rpm;
+	return (int) floor(fm_get_field(fm, FM_FIELD_PUMP_RPM) + 0.5);
+}
+
+/*
+ * Raw getters, straight out of the heartbeat
+ * */
+
+int
+fm_timer_top(flowmaster *fm)
+{
+	return fm->timer_top;
+}
+
+int
+fm_raw_fan_duty(flowmaster *fm)
+{
+	const fm_field_desc *field;
+	return fm_current_field(fm, FM_FIELD_FAN_DUTY_CYCLE, &field);
+}
+
+int
+fm_raw_pump_duty(flowmaster *fm)
+{
+	const fm_field_desc *field;
+	return fm_current_field(fm, FM_FIELD_PUMP_DUTY_CYCLE, &field);
+}
+
+int
+fm_raw_fan_tach(flowmaster *fm)
+{
+	const fm_field_desc *field;
+	return fm_current_field(fm, FM_FIELD_FAN_RPM, &field);
+}
+
+int
+fm_raw_pump_tach(flowmaster *fm)
+{
+	const fm_field_desc *field;
+	return fm_current_field(fm, FM_FIELD_PUMP_RPM, &field);
+}
+
+int
+fm_raw_coolant_adc(flowmaster *fm)
+{
+	const fm_field_desc *field;
+	return fm_current_field(fm, FM_FIELD_COOLANT_TEMP, &field);
+}
+
+int
+fm_raw_ambient_adc(flowmaster *fm)
+{
+	const fm_field_desc *field;
+	return fm_current_field(fm, FM_FIELD_AMBIENT_TEMP, &field);
 }
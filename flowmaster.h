@@ -5,8 +5,10 @@
 extern "C" {
 #endif
 
-#include "flowmaster_internal.h"
+#include <stddef.h>
+#include <stdint.h>
 
+#include "flowmaster_internal.h"
 
 struct flowmaster_s;
 
@@ -48,10 +50,277 @@ enum fm_rc_e
 	FM_CHECKSUM_ERROR,
 	FM_FILE_ERROR,
 	FM_BAD_HEXFILE,
-	FM_BAD_BUFFER_LENGTH
+	FM_BAD_BUFFER_LENGTH,
+	FM_THREAD_ERROR,
+	FM_BUSY,
+	FM_NO_MEMORY,
+	FM_BAD_ARGUMENT
 };
 typedef enum fm_rc_e fm_rc;
 
+/*
+ *	Data result to return the fan status
+ * */
+struct fm_data_s {
+	/* Duty cycle, a percentage between 0.0 and 1.0 */
+	float fan_duty_cycle;
+	float pump_duty_cycle;
+
+	/* Temp, in degrees celcius */
+	float ambient_temp;
+	float coolant_temp;
+
+	/* litres per hour */
+	float flow_rate;
+
+	/* Fan RPM, as a whole integer */
+	int fan_rpm;
+	int pump_rpm;
+};
+typedef struct fm_data_s fm_data;
+
+/*
+ * A status record along with the time it was received.
+ *
+ * Times are in nanoseconds from CLOCK_MONOTONIC (QueryPerformanceCounter
+ * on Windows), only the difference between two times is meaningful.
+ *
+ * timestamp is when the last byte of the heartbeat arrived.
+ * request_time is when the request for it was written to the port,
+ * or 0 for heartbeats the controller sent by itself while streaming.
+ * Samples read back from a history or log only keep timestamp.
+ * */
+struct fm_sample_s {
+	uint64_t timestamp;
+	uint64_t request_time;
+	fm_data data;
+};
+typedef struct fm_sample_s fm_sample;
+
+/*
+ * Round trip times of status requests, in nanoseconds.
+ *
+ * one_way is half the fastest round trip seen, the best estimate of how
+ * long a heartbeat takes to get from the controller to us.  Subtract it
+ * from a sample's timestamp to estimate when the controller sent it.
+ * */
+struct fm_latency_s {
+	uint64_t last_rtt;
+	uint64_t min_rtt;
+	uint64_t mean_rtt;	/* moving average over the last few requests */
+	uint64_t one_way;
+	unsigned long count;	/* round trips measured */
+};
+typedef struct fm_latency_s fm_latency;
+
+/* Names each value in fm_data, for the APIs that work on any of them */
+enum fm_field_e {
+	FM_FIELD_FAN_DUTY_CYCLE,
+	FM_FIELD_PUMP_DUTY_CYCLE,
+	FM_FIELD_AMBIENT_TEMP,
+	FM_FIELD_COOLANT_TEMP,
+	FM_FIELD_FLOW_RATE,
+	FM_FIELD_FAN_RPM,
+	FM_FIELD_PUMP_RPM,
+	FM_FIELD_COUNT
+};
+typedef enum fm_field_e fm_field;
+
+/* Summary of a field over a time range */
+struct fm_stats_s {
+	double min;
+	double max;
+	double mean;
+	unsigned long count;
+};
+typedef struct fm_stats_s fm_stats;
+
+struct fm_history_s;
+typedef struct fm_history_s fm_history;
+
+/* Rollup resolutions, and how far back each one reaches */
+enum fm_resolution_e {
+	FM_ROLLUP_10S,	/* the last hour */
+	FM_ROLLUP_1MIN,	/* the last day */
+	FM_ROLLUP_1HOUR,	/* the last 30 days */
+	FM_ROLLUP_COUNT
+};
+typedef enum fm_resolution_e fm_resolution;
+
+/* One field aggregated over one rollup interval */
+struct fm_bucket_s {
+	uint64_t start;	/* same clock as fm_sample timestamps */
+	unsigned long count;
+	float min;
+	float max;
+	float last;
+	double sum;
+};
+typedef struct fm_bucket_s fm_bucket;
+
+struct fm_rollup_s;
+typedef struct fm_rollup_s fm_rollup;
+
+struct fm_log_s;
+typedef struct fm_log_s fm_log;
+
+struct fm_filter_s;
+typedef struct fm_filter_s fm_filter;
+
+/*
+ * Heartbeat field descriptors, see fm_schema().
+ *
+ * The standard fields use their fm_field value as id, controllers may
+ * add more fields with ids from FM_FIELD_COUNT up.
+ * */
+enum fm_field_type_e {
+	FM_TYPE_U8,
+	FM_TYPE_U16,
+	FM_TYPE_S16
+};
+
+enum fm_conversion_e {
+	FM_CONV_LINEAR,		/* raw * scale + bias */
+	FM_CONV_DUTY,		/* raw / fm_timer_top() */
+	FM_CONV_THERMISTOR	/* 10 bit ADC count to celcius */
+};
+
+struct fm_field_desc_s {
+	unsigned char id;
+	unsigned char type;		/* enum fm_field_type_e */
+	unsigned char conversion;	/* enum fm_conversion_e */
+	unsigned char offset;		/* bytes into the heartbeat payload */
+	float scale;
+	float bias;
+	char name[16];
+};
+typedef struct fm_field_desc_s fm_field_desc;
+
+struct fm_governor_s;
+typedef struct fm_governor_s fm_governor;
+
+/* See fm_set_governor() */
+struct fm_governor_config_s {
+	unsigned int min_interval_ms;	/* fastest polling, no less than 500 */
+	unsigned int max_interval_ms;	/* slowest polling when nothing is happening */
+	float backoff;			/* interval multiplier after each quiet poll */
+	float temp_rate;		/* C per second that counts as a transient */
+	float rpm_rate;			/* RPM per second that counts as a transient */
+};
+typedef struct fm_governor_config_s fm_governor_config;
+
+/*
+ * Every command to the controller has a priority class.  While the port
+ * is busy, waiting commands are sent highest class first.
+ * */
+enum fm_priority_e {
+	FM_PRIORITY_REALTIME,	/* fan and pump speeds, manual and automatic */
+	FM_PRIORITY_NORMAL,	/* status polls and everything else */
+	FM_PRIORITY_BULK,	/* fan profile transfers, one segment at a time */
+	FM_PRIORITY_COUNT
+};
+typedef enum fm_priority_e fm_priority;
+
+/* See fm_control_start() */
+struct fm_control_config_s {
+	unsigned int period_ms;	/* one poll and update per period, no less than 500 */
+	float setpoint;		/* coolant temperature to hold, C */
+	float kp;		/* duty per C */
+	float ki;		/* duty per C second */
+	float kd;		/* duty per C per second */
+	float fan_min;		/* fan duty range */
+	float fan_max;
+	float pump_min;		/* pump duty follows the fan across this range, both 0 leaves the pump alone */
+	float pump_max;
+	float slew_rate;	/* largest duty change per second, 0 for no limit */
+	float feedforward;	/* fan duty added at full host load, 0 for none */
+	float full_load_watts;	/* CPU package power counted as full load, 0 to go by CPU time alone */
+	int priority;		/* SCHED_FIFO priority, 0 for an ordinary thread */
+	int cpu;		/* CPU to pin the thread to, -1 for any */
+};
+typedef struct fm_control_config_s fm_control_config;
+
+struct fm_control_stats_s {
+	unsigned long cycles;
+	unsigned long overruns;	/* periods skipped because a cycle ran long */
+	unsigned long errors;	/* cycles that couldn't talk to the controller */
+	int realtime;		/* 1 if the priority and CPU asked for were granted */
+	uint64_t jitter_last;	/* how late the thread woke after each deadline, ns */
+	uint64_t jitter_mean;
+	uint64_t jitter_max;
+	uint64_t cycle_max;	/* longest time from deadline to outputs written, ns */
+	float error;		/* last coolant temperature minus setpoint */
+	float output;		/* last fan duty asked for */
+	float load;		/* last host load fed forward, 0 to 1, -1 if not known */
+};
+typedef struct fm_control_stats_s fm_control_stats;
+
+/* Every possible 10 bit thermistor reading */
+#define FM_THERMISTOR_TABLE_SIZE 1024
+
+/*
+ * Thermistor probe parameters.
+ *
+ * Steinhart-Hart coefficients a, b and c, the resistor the probe is
+ * divided against, then a per probe correction applied to the result:
+ * celcius = gain * steinhart_hart + offset.
+ * */
+struct fm_thermistor_s {
+	double a;
+	double b;
+	double c;
+	double series_resistor;
+	double gain;
+	double offset;
+};
+typedef struct fm_thermistor_s fm_thermistor;
+
+/* Size of a raw heartbeat payload, see fm_raw_heartbeat() */
+#define FM_PAYLOAD_SIZE 32
+
+/* LCD size, fm_set_cursor() counts rows and columns from 0 */
+#define FM_DISPLAY_ROWS 4
+#define FM_DISPLAY_COLS 20
+
+/* What fm_set_display() can show */
+enum fm_display_e {
+	FM_DISPLAY_CONTROLLER,	/* the controller's own rotating pages */
+	FM_DISPLAY_HOST		/* the frame drawn with fm_print_message() */
+};
+
+/* Longest median window fm_filter_configure() accepts */
+#define FM_FILTER_MAX_MEDIAN 15
+
+enum fm_alarm_e {
+	FM_ALARM_PUMP_STALL,	/* pump RPM collapsed while the pump is driven */
+	FM_ALARM_COOLANT_RISE,	/* coolant heating up too quickly */
+	FM_ALARM_COOLANT_DELTA,	/* coolant too far above (or below) ambient */
+	FM_ALARM_COUNT
+};
+typedef enum fm_alarm_e fm_alarm;
+
+/* Alarm thresholds, see fm_alarm_defaults() for sensible values */
+struct fm_alarm_config_s {
+	/* Bitmask of (1 << fm_alarm) for the alarms to check */
+	unsigned int enabled;
+
+	/* Stalled when pump_rpm < stall_rpm while pump_duty_cycle >= stall_duty */
+	int stall_rpm;
+	float stall_duty;
+	int stall_hysteresis;	/* RPM */
+
+	/* Coolant rising by more than rise_rate C per second, averaged over about rise_seconds */
+	float rise_rate;
+	float rise_seconds;
+	float rise_hysteresis;	/* C per second */
+
+	/* Coolant minus ambient outside delta_min .. delta_max C */
+	float delta_min;
+	float delta_max;
+	float delta_hysteresis;	/* C */
+};
+typedef struct fm_alarm_config_s fm_alarm_config;
+
 enum flash_state_e
 {
 	FLASH_OPEN_FILE_OK,		/* null, file was opened ok */
@@ -90,11 +359,19 @@ DLLEXPORT int fm_isconnected(struct flowmaster_s *fm);
 /* returns 0 if alive, -1 if error*/
 DLLEXPORT fm_rc fm_ping(struct flowmaster_s *fm);
 
-/* Set the cursor XY position */
+/*
+ * The LCD.
+ *
+ * Drawing goes into a frame kept by the library: fm_set_cursor() picks
+ * where fm_print_message() writes, and text is clipped at the end of the
+ * row.  Nothing reaches the display until fm_display_commit(), which
+ * halts the controller's own pages and sends only the characters that
+ * differ from what the LCD already shows, so changing one digit of a
+ * status line costs one short write.
+ * */
 DLLEXPORT int fm_set_cursor(struct flowmaster_s *fm, int row, int col);
-
-/* Print a message to the flowmaster display. max 20 chars. */
 DLLEXPORT int fm_print_message(struct flowmaster_s *fm, const char *message, int message_len);
+DLLEXPORT fm_rc fm_display_commit(struct flowmaster_s *fm);
 
 /* Enable or disable automatic regulation of fan speed.  true: auto, false manual */
 DLLEXPORT int fm_autoregulate(struct flowmaster_s *fm, int regulate);
@@ -111,10 +388,30 @@ DLLEXPORT int fm_autoregulate(struct flowmaster_s *fm, int regulate);
 DLLEXPORT int fm_set_fan_speed(flowmaster *fm, float duty_cycle);
 DLLEXPORT int fm_set_pump_speed(flowmaster *fm, float duty_cycle);
 
-/* Stop rotating the displays */
+/*
+ * Longest any command of a class has waited for the port, ns.
+ *
+ * The port is handed over between transactions, never in the middle of
+ * one, and bulk transfers give it up after every segment, so a realtime
+ * command waits for at most the one transaction already on the wire.
+ * */
+DLLEXPORT uint64_t fm_command_wait(struct flowmaster_s *fm, fm_priority priority);
+
+/*
+ * The handle remembers every setting the controller has acknowledged,
+ * and setting anything to the value it already has returns FM_OK
+ * without a round trip.  The memory is dropped on reconnect, after any
+ * failed write and whenever a heartbeat shows the fan or pump running
+ * at other than the duty cycle set.  Call this if something else may
+ * have changed the controller's settings behind the library's back.
+ * */
+DLLEXPORT void fm_forget_state(struct flowmaster_s *fm);
+
+/* Stop rotating the displays, or start again */
 DLLEXPORT int fm_halt_update_display(struct flowmaster_s *fm);
+DLLEXPORT int fm_resume_update_display(struct flowmaster_s *fm);
 
-/* Change to a given display */
+/* Show the controller's own pages or the frame drawn with fm_print_message() */
 DLLEXPORT int fm_set_display(struct flowmaster_s *fm, int display);
 
 /* filename is a path to an intel HEX file that you want to upload to the microcontroller */
@@ -135,12 +432,24 @@ DLLEXPORT int flash_validate_and_program(
 DLLEXPORT fm_rc fm_update_status(struct flowmaster_s *fm);
 
 DLLEXPORT fm_rc fm_set_fan_profile(struct flowmaster_s *fm, float *data, int length);
+
+/*
+ * Once a profile has been read or written, fm_get_fan_profile() returns
+ * the library's copy and only checks one segment of 5 points against
+ * the controller per call, a different one each time.  A profile changed
+ * behind the library's back can be returned stale for up to 13 calls,
+ * until the check reaches a changed point.  Call fm_forget_state() first
+ * to read the whole profile from the controller.
+ * */
 DLLEXPORT fm_rc fm_get_fan_profile(struct flowmaster_s *fm, float *data, int length);
 
 
 /*
  * Getter functions for fetching the status of the pump controller.
  * Refreshed by calling fm_update_status();
+ *
+ * Values are only converted from the raw heartbeat the first time they
+ * are asked for after each update.
  * */
 
 DLLEXPORT float fm_fan_duty_cycle(flowmaster *fm);
@@ -151,6 +460,421 @@ DLLEXPORT float fm_coolant_temp(flowmaster *fm);
 DLLEXPORT int fm_fan_rpm(flowmaster *fm);
 DLLEXPORT int fm_pump_rpm(flowmaster *fm);
 
+/*
+ * Raw values from the last heartbeat, in controller units.
+ * Nothing is converted, which makes these very cheap.
+ *
+ * Duty cycles are timer ticks, out of fm_timer_top().
+ * Tach counts are RPM / 30.
+ * Temperatures are 10 bit ADC counts.
+ * */
+DLLEXPORT int fm_timer_top(flowmaster *fm);
+DLLEXPORT int fm_raw_fan_duty(flowmaster *fm);
+DLLEXPORT int fm_raw_pump_duty(flowmaster *fm);
+DLLEXPORT int fm_raw_fan_tach(flowmaster *fm);
+DLLEXPORT int fm_raw_pump_tach(flowmaster *fm);
+DLLEXPORT int fm_raw_coolant_adc(flowmaster *fm);
+DLLEXPORT int fm_raw_ambient_adc(flowmaster *fm);
+
+/*
+ * Copy the whole status record at once.
+ *
+ * The getters above read one field at a time, so a thread calling them
+ * while another thread updates the status can mix values from two
+ * different samples.  fm_snapshot() always returns a single sample and
+ * may be called from any number of threads without locking, while
+ * fm_update_status() or the stream thread keeps running.
+ * */
+DLLEXPORT void fm_snapshot(struct flowmaster_s *fm, fm_data *data);
+
+/*
+ * Heartbeat schema.
+ *
+ * fm_connect() starts out with the standard heartbeat layout.  Firmware
+ * that can describe its own heartbeat with GET_SCHEMA can be asked to
+ * with fm_query_schema(), straight after fm_connect() and before any
+ * other thread is reading samples.  Controllers that NAK it keep the
+ * standard layout.  The table belongs to the handle and stays put until
+ * the next fm_connect() or fm_query_schema().
+ * */
+DLLEXPORT fm_rc fm_query_schema(struct flowmaster_s *fm);
+DLLEXPORT const fm_field_desc* fm_schema(struct flowmaster_s *fm, int *count);
+
+/* The descriptor for field id, NULL if the controller doesn't send it */
+DLLEXPORT const fm_field_desc* fm_find_field(struct flowmaster_s *fm, int id);
+
+/* Current value of any field, 0.0 if the controller doesn't send it */
+DLLEXPORT double fm_get_field(struct flowmaster_s *fm, int id);
+
+/*
+ * Copy the current raw heartbeat payload, FM_PAYLOAD_SIZE bytes.
+ * Returns its timestamp, see fm_sample.
+ * */
+DLLEXPORT uint64_t fm_raw_heartbeat(struct flowmaster_s *fm, unsigned char *payload);
+
+/* Read one field straight out of a raw payload, unconverted or converted */
+DLLEXPORT int fm_field_raw(const fm_field_desc *field, const unsigned char *payload);
+DLLEXPORT double fm_field_value(struct flowmaster_s *fm, const fm_field_desc *field,
+		const unsigned char *payload);
+
+/*
+ * Thermistor calibration.
+ *
+ * Temperatures are converted with a FM_THERMISTOR_TABLE_SIZE entry table
+ * holding the result for every possible ADC reading.  Each temperature
+ * field (by schema id) can be given its own probe parameters, which
+ * builds that field's table.  Pass NULL to go back to the defaults.
+ * Calibrating is safe while other threads are reading samples, they
+ * switch to the new table with the next conversion.
+ * */
+DLLEXPORT void fm_thermistor_defaults(fm_thermistor *params);
+DLLEXPORT fm_rc fm_calibrate_probe(struct flowmaster_s *fm, int id, const fm_thermistor *params);
+
+/*
+ * Copy the table used for field id into table, which holds
+ * FM_THERMISTOR_TABLE_SIZE entries.  A replaced table is freed as soon
+ * as no conversion is using it, so only calibrated tables in use are
+ * kept, however often probes are recalibrated.
+ * */
+DLLEXPORT void fm_probe_table(struct flowmaster_s *fm, int id, float *table);
+
+/* Fill table with FM_THERMISTOR_TABLE_SIZE conversions, for offline use */
+DLLEXPORT void fm_thermistor_table(const fm_thermistor *params, float *table);
+
+/*
+ * Convert a batch of raw ADC readings, for example replayed from a
+ * recording, with table (NULL for the default probe).
+ * */
+DLLEXPORT void fm_convert_temps(const float *table, const uint16_t *adc, float *celcius, size_t count);
+
+/*
+ * Latency of status requests made by fm_update_status().  Requests made
+ * while streaming aren't counted, the reply can't be told apart from a
+ * heartbeat that was already on its way.  May be called from any
+ * thread, but the fields may come from neighbouring requests if one
+ * completes while copying.
+ * */
+DLLEXPORT void fm_get_latency(struct flowmaster_s *fm, fm_latency *latency);
+
+/*
+ * Heartbeat streaming.
+ *
+ * Instead of polling with fm_update_status(), the controller can be told
+ * to push heartbeats by itself.  fm_stream_start() does that and starts a
+ * background thread which decodes each heartbeat into a queue of samples.
+ *
+ * The getters above are kept up to date while streaming.
+ *
+ * Other commands may still be sent while streaming, heartbeats that
+ * arrive in the middle of a reply are picked out and queued.  Flashing
+ * stops the stream.
+ * */
+DLLEXPORT fm_rc fm_stream_start(struct flowmaster_s *fm);
+DLLEXPORT fm_rc fm_stream_stop(struct flowmaster_s *fm);
+
+/*
+ * Copy up to max_samples of the oldest queued samples into samples.
+ * Never blocks and never touches the serial port.
+ * Only one thread may read the queue.
+ *
+ * Returns the number of samples copied.
+ * */
+DLLEXPORT int fm_stream_read(struct flowmaster_s *fm, fm_sample *samples, int max_samples);
+
+/* Number of samples thrown away because the queue was full */
+DLLEXPORT unsigned int fm_stream_dropped(struct flowmaster_s *fm);
+
+/* Read any field out of a status record */
+DLLEXPORT double fm_data_field(const fm_data *data, fm_field field);
+
+/*
+ * Compressed in-memory history of samples.
+ *
+ * Samples are packed into blocks using delta-of-delta timestamps, XOR'd
+ * floats and delta encoded RPMs, so a steady controller costs a few bits
+ * per sample.  Timestamps are kept to millisecond resolution.
+ *
+ * max_bytes caps the memory used, once it is reached the oldest block
+ * of samples is thrown away to make room.
+ *
+ * A history may be appended to and queried from different threads.
+ * */
+DLLEXPORT fm_history* fm_history_create(size_t max_bytes);
+DLLEXPORT void fm_history_destroy(fm_history *history);
+
+/* Samples must be appended in time order */
+DLLEXPORT fm_rc fm_history_append(fm_history *history, const fm_sample *sample);
+
+/*
+ * Call cb for every sample with from <= timestamp <= to, oldest first.
+ * Don't append to the same history from inside the callback.
+ *
+ * Returns the number of samples visited.
+ * */
+typedef void (*fm_history_callback)(const fm_sample *sample, void *userdata);
+DLLEXPORT unsigned long fm_history_scan(fm_history *history, uint64_t from, uint64_t to,
+		fm_history_callback cb, void *userdata);
+
+/* min, max and mean of a field for samples with from <= timestamp <= to */
+DLLEXPORT void fm_history_stats(fm_history *history, fm_field field, uint64_t from, uint64_t to,
+		fm_stats *stats);
+
+/* Number of samples held, and the bytes used to hold them */
+DLLEXPORT unsigned long fm_history_count(fm_history *history);
+DLLEXPORT size_t fm_history_bytes(fm_history *history);
+
+/*
+ * Append every sample the handle receives, polled or streamed, to history.
+ * Pass NULL to stop.  The history must outlive the attachment, and once
+ * this returns no sample still being published holds the old one, so it
+ * may be destroyed.
+ * */
+DLLEXPORT void fm_attach_history(struct flowmaster_s *fm, fm_history *history);
+
+/*
+ * Pre-aggregated rollups of every field at 10s, 1min and 1h resolution.
+ *
+ * Each sample updates one bucket per resolution in constant time, so
+ * queries over long windows read a few hundred buckets rather than
+ * every sample.
+ *
+ * A rollup may be added to and queried from different threads.
+ * */
+DLLEXPORT fm_rollup* fm_rollup_create(void);
+DLLEXPORT void fm_rollup_destroy(fm_rollup *rollup);
+DLLEXPORT void fm_rollup_add(fm_rollup *rollup, const fm_sample *sample);
+
+/*
+ * Copy out the non-empty buckets of field that start between from and to,
+ * oldest first.  Returns the number of buckets copied.
+ * */
+DLLEXPORT int fm_rollup_query(fm_rollup *rollup, fm_resolution resolution, fm_field field,
+		uint64_t from, uint64_t to, fm_bucket *buckets, int max_buckets);
+
+/* As fm_attach_history(), but for a rollup */
+DLLEXPORT void fm_attach_rollup(struct flowmaster_s *fm, fm_rollup *rollup);
+
+/*
+ * Signal conditioning.
+ *
+ * Every field passes through a median of the last median_window samples,
+ * then an exponential moving average with a time constant of
+ * ewma_seconds, then a slope estimate (units per second) smoothed with a
+ * time constant of slope_seconds.  Each sample updates constant sized
+ * state, so reading smoothed values and rates of change costs nothing.
+ *
+ * A new filter passes every field straight through.
+ * A filter may be added to and read from different threads.
+ * */
+DLLEXPORT fm_filter* fm_filter_create(void);
+DLLEXPORT void fm_filter_destroy(fm_filter *filter);
+
+/*
+ * median_window must be odd and no more than FM_FILTER_MAX_MEDIAN, 1 turns
+ * the median off.  A time constant of 0 turns that stage off.
+ * Resets the field's state.
+ * */
+DLLEXPORT fm_rc fm_filter_configure(fm_filter *filter, fm_field field, int median_window,
+		double ewma_seconds, double slope_seconds);
+
+/* Samples are expected in time order, older ones are ignored */
+DLLEXPORT void fm_filter_add(fm_filter *filter, const fm_sample *sample);
+
+/* Smoothed value of a field and its rate of change per second */
+DLLEXPORT void fm_filter_get(fm_filter *filter, fm_field field, double *value, double *slope);
+
+/* Every smoothed value at once, stamped with the latest sample's time */
+DLLEXPORT void fm_filter_sample(fm_filter *filter, fm_sample *sample);
+
+/*
+ * As fm_attach_history(), but for a filter.  The filter sees each sample
+ * before the history, rollup and log do.
+ * */
+DLLEXPORT void fm_attach_filter(struct flowmaster_s *fm, fm_filter *filter);
+
+/*
+ * Alarms.
+ *
+ * Every sample, polled or streamed, is checked as soon as it arrives and
+ * cb is called whenever an alarm is raised (raised = 1) or cleared
+ * (raised = 0), so the reaction time is one sample whatever the caller's
+ * polling interval.
+ *
+ * cb runs on whichever thread received the sample: inside
+ * fm_update_status(), or on the stream thread.
+ * */
+typedef void (*fm_alarm_callback)(struct flowmaster_s *fm, fm_alarm alarm, int raised,
+		const fm_sample *sample, void *userdata);
+
+DLLEXPORT void fm_alarm_defaults(fm_alarm_config *config);
+
+/* Start checking alarms.  config may be NULL for the defaults. Resets all alarms. */
+DLLEXPORT fm_rc fm_set_alarms(struct flowmaster_s *fm, const fm_alarm_config *config,
+		fm_alarm_callback cb, void *userdata);
+
+/* True while alarm is raised */
+DLLEXPORT int fm_alarm_active(struct flowmaster_s *fm, fm_alarm alarm);
+
+/*
+ * Scheduled polling.
+ *
+ * Rather than several parts of a program each calling fm_update_status()
+ * on their own timers, let the library poll once every period_ms on a
+ * thread of its own and subscribe to the results.
+ *
+ * Subscribers are called with every sample the handle receives, polled
+ * or streamed, on the thread that received it.  They may send commands
+ * to the controller.
+ * */
+typedef void (*fm_subscriber)(struct flowmaster_s *fm, const fm_sample *sample, void *userdata);
+
+/* period_ms must be at least 500 */
+DLLEXPORT fm_rc fm_scheduler_start(struct flowmaster_s *fm, unsigned int period_ms);
+DLLEXPORT fm_rc fm_scheduler_stop(struct flowmaster_s *fm);
+
+/* Returns an id for fm_unsubscribe(), or -1 if there's no room for another */
+DLLEXPORT int fm_subscribe(struct flowmaster_s *fm, fm_subscriber cb, void *userdata);
+DLLEXPORT void fm_unsubscribe(struct flowmaster_s *fm, int id);
+
+/*
+ * Make sure the status is no older than one period (500ms if the
+ * scheduler isn't running), polling if need be.  Any number of threads
+ * may call this at once, they share a single request, and those that
+ * find it already under way return without waiting for the answer.
+ * Subscribers may call it too.
+ * */
+DLLEXPORT fm_rc fm_refresh(struct flowmaster_s *fm);
+
+/*
+ * Adaptive polling.
+ *
+ * Rather than polling at a fixed 500ms, let the governor decide when the
+ * next poll is due.  It backs off towards max_interval_ms while
+ * temperatures and RPMs are steady and drops back to min_interval_ms as
+ * soon as they move, a fan or pump speed is set or an alarm is raised.
+ *
+ * Pass NULL to go back to polling at the minimum interval.
+ * */
+DLLEXPORT void fm_governor_defaults(fm_governor_config *config);
+DLLEXPORT fm_rc fm_set_governor(struct flowmaster_s *fm, const fm_governor_config *config);
+
+/* Current poll interval in ms, 500 without a governor */
+DLLEXPORT unsigned int fm_poll_interval(struct flowmaster_s *fm);
+
+/* When the next poll is due on the fm_sample clock, 500ms after the last sample without a governor */
+DLLEXPORT uint64_t fm_poll_deadline(struct flowmaster_s *fm);
+
+/*
+ * Sleep until the next poll is due, then fm_update_status().
+ * A polling loop is just: while(fm_governed_update(fm) == FM_OK){ ... }
+ * */
+DLLEXPORT fm_rc fm_governed_update(struct flowmaster_s *fm);
+
+/*
+ * Write combining for fan and pump speeds.
+ *
+ * Once started, fm_set_fan_speed() and fm_set_pump_speed() return
+ * straight away without talking to the controller.  A background thread
+ * sends the latest fan and pump speeds no more than once every
+ * interval_ms, so a burst of updates costs one transaction per setpoint
+ * however long it is.
+ *
+ * Errors from the background sends are held for fm_combine_flush().
+ * */
+DLLEXPORT fm_rc fm_combine_start(struct flowmaster_s *fm, unsigned int interval_ms);
+
+/* Sends anything still waiting, and goes back to sending every speed as it is set */
+DLLEXPORT fm_rc fm_combine_stop(struct flowmaster_s *fm);
+
+/*
+ * Send anything waiting now, without waiting for the interval.
+ * Returns the first error since the last flush, sent by either thread.
+ * */
+DLLEXPORT fm_rc fm_combine_flush(struct flowmaster_s *fm);
+
+/*
+ * Host side fan control.
+ *
+ * fm_control_start() takes regulation away from the controller and runs
+ * a PID loop on coolant temperature on a thread of its own.  Every
+ * period_ms it polls, then sets the fan duty, and the pump duty if a
+ * pump range is given.  Deadlines come from a periodic timer rather than
+ * sleeps, so the loop doesn't drift, and the thread can be given real
+ * time priority and a CPU of its own to keep wake up jitter down.
+ *
+ * The integral only accumulates while the output isn't pinned at the
+ * end of its range, and the output moves no faster than slew_rate.
+ * The derivative acts on the measured temperature rather than the error,
+ * so changing the setpoint doesn't kick the fans.
+ *
+ * Coolant temperature trails the heat going into it by tens of seconds,
+ * so with feedforward set the loop also samples the host's own load each
+ * period, CPU busy time and where readable the RAPL package power, and
+ * adds feedforward times that load straight onto the fan duty.  The fans
+ * start moving as soon as the work does and the PID only trims what is
+ * left.  The slew limit still applies.
+ * */
+DLLEXPORT void fm_control_defaults(fm_control_config *config);
+
+/* config may be NULL for the defaults */
+DLLEXPORT fm_rc fm_control_start(struct flowmaster_s *fm, const fm_control_config *config);
+
+/* Stop the loop and hand regulation back to the controller */
+DLLEXPORT fm_rc fm_control_stop(struct flowmaster_s *fm);
+
+/* May be called from any thread while the loop runs */
+DLLEXPORT void fm_control_get_stats(struct flowmaster_s *fm, fm_control_stats *stats);
+
+#ifndef _WIN32
+/*
+ * Memory mapped, append-only telemetry log.  Not available on Windows.
+ *
+ * The file holds fixed size segments, each with one column per field
+ * plus a column of wall clock timestamps (nanoseconds since the epoch)
+ * and an index giving the segment's time range and per-field bounds.
+ * Every field is stored as a float.
+ *
+ * Appending a record is a handful of stores into the mapping.  The
+ * record only becomes visible once it is complete, so the file is always
+ * consistent even if the writer dies, and other processes can read it
+ * while it is being written.
+ * */
+
+/* Open a log for appending, creating it if need be.  Only one writer per file. */
+DLLEXPORT fm_log* fm_log_create(const char *path);
+
+/* Open a log read only */
+DLLEXPORT fm_log* fm_log_open(const char *path);
+
+DLLEXPORT void fm_log_close(fm_log *log);
+
+DLLEXPORT fm_rc fm_log_append(fm_log *log, const fm_sample *sample);
+
+/* Force everything appended so far out to disk */
+DLLEXPORT fm_rc fm_log_sync(fm_log *log);
+
+/*
+ * Number of complete records, picking up anything appended since the
+ * last call.  Column pointers fetched before a refresh may be invalidated.
+ * */
+DLLEXPORT uint64_t fm_log_refresh(fm_log *log);
+
+/*
+ * Direct read only access to the columns of a segment, no copying.
+ * Record n lives in segment n / fm_log_segment_records(), slot n % fm_log_segment_records().
+ * */
+DLLEXPORT unsigned int fm_log_segment_records(fm_log *log);
+DLLEXPORT const uint64_t* fm_log_timestamps(fm_log *log, uint64_t segment);
+DLLEXPORT const float* fm_log_column(fm_log *log, uint64_t segment, fm_field field);
+
+/* The segment index, first and last timestamp, and the bounds of a field */
+DLLEXPORT void fm_log_segment_range(fm_log *log, uint64_t segment, uint64_t *first, uint64_t *last);
+DLLEXPORT void fm_log_segment_bounds(fm_log *log, uint64_t segment, fm_field field, float *min, float *max);
+
+/* As fm_attach_history(), but for a log */
+DLLEXPORT void fm_attach_log(struct flowmaster_s *fm, fm_log *log);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
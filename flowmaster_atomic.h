@@ -0,0 +1,100 @@
+#ifndef FLOWMASTER_ATOMIC_H
+#define FLOWMASTER_ATOMIC_H
+
+/*
+ * Minimal atomic helpers for the handful of lock-free structures
+ * shared between the caller and the library's background threads.
+ *
+ * Only unsigned ints are supported, with loads, stores and an add,
+ * plus plain loads and stores of 64 bit values and an exchange of
+ * pointers.  That is all we need.
+ * */
+
+#include <stdint.h>
+
+#if defined _MSC_VER
+	#include <Windows.h>
+	#include <intrin.h>
+
+	/* x86/x64 loads and stores are already acquire/release, just stop the compiler reordering them */
+	static __inline unsigned int
+	fm_load_acquire(volatile unsigned int *ptr)
+	{
+		const unsigned int value = *ptr;
+		_ReadWriteBarrier();
+		return value;
+	}
+
+	static __inline void
+	fm_store_release(volatile unsigned int *ptr, unsigned int value)
+	{
+		_ReadWriteBarrier();
+		*ptr = value;
+	}
+
+	static __inline void
+	fm_store_relaxed(volatile unsigned int *ptr, unsigned int value)
+	{
+		*ptr = value;
+	}
+
+	static __inline uint64_t
+	fm_load64(volatile uint64_t *ptr)
+	{
+		return (uint64_t) InterlockedCompareExchange64((volatile LONG64*) ptr, 0, 0);
+	}
+
+	static __inline void
+	fm_store64(volatile uint64_t *ptr, uint64_t value)
+	{
+		InterlockedExchange64((volatile LONG64*) ptr, (LONG64) value);
+	}
+
+	/* The interlocked functions are full barriers */
+	#define fm_load64_acquire(ptr) fm_load64(ptr)
+	#define fm_store64_release(ptr, value) fm_store64((ptr), (value))
+
+	static __inline void*
+	fm_load_ptr_acquire(void *volatile *ptr)
+	{
+		void *const value = *ptr;
+		_ReadWriteBarrier();
+		return value;
+	}
+
+	static __inline void
+	fm_store_ptr_release(void *volatile *ptr, void *value)
+	{
+		_ReadWriteBarrier();
+		*ptr = value;
+	}
+
+	/* Swap in value, returning what was there, a full barrier */
+	#define fm_exchange_ptr(ptr, value) InterlockedExchangePointer((PVOID volatile*)(ptr), (value))
+
+	/* Add value, returning what was there before, a full barrier */
+	#define fm_fetch_add(ptr, value) ((unsigned int) InterlockedExchangeAdd((volatile LONG*)(ptr), (LONG)(value)))
+
+	#define fm_fence_acquire() _ReadWriteBarrier()
+	#define fm_fence_release() _ReadWriteBarrier()
+	#define fm_fence() MemoryBarrier()
+#elif defined __GNUC__
+	#define fm_load_acquire(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+	#define fm_store_release(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+	#define fm_store_relaxed(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELAXED)
+	#define fm_load64(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+	#define fm_store64(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELAXED)
+	#define fm_load64_acquire(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+	#define fm_store64_release(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+	#define fm_load_ptr_acquire(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+	#define fm_store_ptr_release(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+	#define fm_exchange_ptr(ptr, value) __atomic_exchange_n((ptr), (value), __ATOMIC_SEQ_CST)
+	#define fm_fetch_add(ptr, value) __atomic_fetch_add((ptr), (value), __ATOMIC_SEQ_CST)
+	#define fm_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+	#define fm_fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+	#define fm_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+	#error unsupported compiler
+#endif
+
+#endif
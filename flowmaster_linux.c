@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,6 +11,12 @@
 #include <inttypes.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include "flowmaster_private.h"
 #include "protocol.h"
@@ -110,6 +117,11 @@ fm_rc
 fm_disconnect(flowmaster *fm)
 {
 	struct flock fl;
+
+	/* The stream thread waits on heartbeats only the I/O thread can deliver */
+	fm_stream_stop(fm);
+	fm_io_stop(fm);
+
 	/* Release the lock */
 
 	fl.l_type = F_UNLCK;
@@ -145,9 +157,20 @@ fm_serial_write(flowmaster *fm, int *written)
 	}
 #endif
 
-	fm_flush_buffers(fm);
+	/* While streaming unread input is a heartbeat on its way to the stream */
+	if(!fm->stream_running){
+		fm_flush_buffers(fm);
+	}
+
+	return fm_serial_write_more(fm, written);
+}
+
+int
+fm_serial_write_more(flowmaster *fm, int *written)
+{
+	const ssize_t rc = write(fm->port, fm->write_buffer, fm->write_buffer_len);
 
-	ssize_t rc = write(fm->port, fm->write_buffer, fm->write_buffer_len);
+	fm->tx_timestamp = fm_monotonic_ns();
 
 	if(written != NULL){
 		*written = (int) rc;
@@ -218,6 +241,49 @@ fm_serial_read_byte(flowmaster *fm, unsigned char *byte)
 	return -1;
 }
 
+int
+fm_serial_wait(flowmaster *fm, unsigned int timeout_ms)
+{
+	fd_set fds;
+	struct timeval timeout;
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+	FD_ZERO(&fds);
+	FD_SET(fm->port, &fds);
+
+	return select(fm->port + 1, &fds, NULL, NULL, &timeout) > 0;
+}
+
+int
+fm_serial_wait_event(flowmaster *fm, fm_event event, int listen)
+{
+	fd_set fds;
+	uint64_t count;
+	int rc;
+
+	FD_ZERO(&fds);
+	FD_SET(event, &fds);
+	if(listen){
+		FD_SET(fm->port, &fds);
+	}
+
+	rc = select((listen && fm->port > event ? fm->port : event) + 1, &fds, NULL, NULL, NULL);
+	if(rc <= 0){
+		return 0;
+	}
+
+	if(FD_ISSET(event, &fds)){
+		/* Reset it, the count doesn't matter */
+		if(read(event, &count, sizeof(count)) != sizeof(count)){
+			count = 0;
+		}
+	}
+
+	return listen && FD_ISSET(fm->port, &fds);
+}
+
 int
 fm_serial_write_byte(flowmaster *fm, unsigned char byte)
 {
@@ -230,3 +296,286 @@ fm_flush_buffers(flowmaster *fm)
 {
 	tcflush(fm->port, TCIOFLUSH);
 }
+
+/*
+ * pthreads wants a function returning void*, bounce through this
+ * */
+struct fm_thread_start_s {
+	fm_thread_func func;
+	void *arg;
+};
+
+static void*
+fm_thread_trampoline(void *arg)
+{
+	struct fm_thread_start_s start = *(struct fm_thread_start_s*) arg;
+
+	free(arg);
+	start.func(start.arg);
+
+	return NULL;
+}
+
+int
+fm_thread_start(fm_thread *thread, fm_thread_func func, void *arg)
+{
+	struct fm_thread_start_s *start;
+
+	start = (struct fm_thread_start_s*) malloc(sizeof(struct fm_thread_start_s));
+	if(start == NULL){
+		return -1;
+	}
+
+	start->func = func;
+	start->arg = arg;
+
+	if(pthread_create(thread, NULL, fm_thread_trampoline, start) != 0){
+		free(start);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+fm_thread_join(fm_thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+void
+fm_cond_init(fm_cond *cond)
+{
+	pthread_cond_init(cond, NULL);
+}
+
+void
+fm_cond_destroy(fm_cond *cond)
+{
+	pthread_cond_destroy(cond);
+}
+
+void
+fm_cond_wait(fm_cond *cond, fm_mutex *mutex)
+{
+	pthread_cond_wait(cond, mutex);
+}
+
+void
+fm_cond_broadcast(fm_cond *cond)
+{
+	pthread_cond_broadcast(cond);
+}
+
+int
+fm_event_create(fm_event *event)
+{
+	*event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	return *event == -1 ? -1 : 0;
+}
+
+void
+fm_event_destroy(fm_event event)
+{
+	close(event);
+}
+
+void
+fm_event_signal(fm_event event)
+{
+	const uint64_t one = 1;
+
+	/* Only fails if the count would overflow, and then it's signalled anyway */
+	if(write(event, &one, sizeof(one)) != sizeof(one)){
+		return;
+	}
+}
+
+int
+fm_thread_realtime(int priority, int cpu)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int rc = 0;
+
+	if(priority > 0){
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+
+		/* Needs CAP_SYS_NICE or an rtprio limit */
+		if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0){
+			rc = -1;
+		}
+	}
+
+	if(cpu >= 0){
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0){
+			rc = -1;
+		}
+	}
+
+	return rc;
+}
+
+void
+fm_mutex_init(fm_mutex *mutex)
+{
+	pthread_mutex_init(mutex, NULL);
+}
+
+void
+fm_mutex_destroy(fm_mutex *mutex)
+{
+	pthread_mutex_destroy(mutex);
+}
+
+void
+fm_mutex_lock(fm_mutex *mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+void
+fm_mutex_unlock(fm_mutex *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+int
+fm_timer_create(fm_timer *timer)
+{
+	*timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	return *timer == -1 ? -1 : 0;
+}
+
+void
+fm_timer_destroy(fm_timer timer)
+{
+	close(timer);
+}
+
+int
+fm_timer_set(fm_timer timer, uint64_t deadline, uint64_t period)
+{
+	struct itimerspec spec;
+
+	/* An all zero it_value would disarm the timer rather than fire it */
+	if(deadline == 0){
+		deadline = 1;
+	}
+
+	spec.it_value.tv_sec = (time_t)(deadline / 1000000000ull);
+	spec.it_value.tv_nsec = (long)(deadline % 1000000000ull);
+	spec.it_interval.tv_sec = (time_t)(period / 1000000000ull);
+	spec.it_interval.tv_nsec = (long)(period % 1000000000ull);
+
+	return timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+int
+fm_timer_wait(fm_timer timer)
+{
+	uint64_t expirations;
+	ssize_t rc;
+
+	do {
+		rc = read(timer, &expirations, sizeof(expirations));
+	} while(rc == -1 && errno == EINTR);
+
+	if(rc != sizeof(expirations)){
+		return -1;
+	}
+
+	return (int) expirations;
+}
+
+void
+fm_sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(deadline / 1000000000ull);
+	ts.tv_nsec = (long)(deadline % 1000000000ull);
+
+	/* Absolute, so a signal part way through doesn't stretch the sleep */
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+	}
+}
+
+uint64_t
+fm_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000ull) + (uint64_t) ts.tv_nsec;
+}
+
+/* Read a small text file in one go, NUL terminated */
+static int
+fm_read_text(const char *path, char *buffer, size_t size)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd == -1){
+		return -1;
+	}
+
+	len = read(fd, buffer, size - 1);
+	close(fd);
+
+	if(len <= 0){
+		return -1;
+	}
+	buffer[len] = '\0';
+
+	return 0;
+}
+
+int
+fm_host_cpu_times(uint64_t *busy, uint64_t *total)
+{
+	uint64_t user, nice, system, idle, iowait, irq, softirq;
+	char buffer[256];
+
+	/* Only the first line is wanted, the totals across every CPU */
+	if(fm_read_text("/proc/stat", buffer, sizeof(buffer)) != 0){
+		return -1;
+	}
+
+	if(sscanf(buffer, "cpu %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+		&user, &nice, &system, &idle, &iowait, &irq, &softirq) != 7){
+		return -1;
+	}
+
+	*busy = user + nice + system + irq + softirq;
+	*total = *busy + idle + iowait;
+
+	return 0;
+}
+
+int
+fm_host_energy(int package, uint64_t *microjoules, uint64_t *range)
+{
+	char path[96];
+	char buffer[32];
+
+	/* RAPL through powercap, usually only readable by root */
+	snprintf(path, sizeof(path), "/sys/class/powercap/intel-rapl:%d/energy_uj", package);
+	if(fm_read_text(path, buffer, sizeof(buffer)) != 0 || sscanf(buffer, "%" SCNu64, microjoules) != 1){
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "/sys/class/powercap/intel-rapl:%d/max_energy_range_uj", package);
+	if(fm_read_text(path, buffer, sizeof(buffer)) != 0 || sscanf(buffer, "%" SCNu64, range) != 1){
+		return -1;
+	}
+
+	return 0;
+}
@@ -7,8 +7,19 @@
 #if defined _WIN32
 	#include <Windows.h>
 	typedef HANDLE serial_handle;
+	typedef HANDLE fm_thread;
+	typedef CRITICAL_SECTION fm_mutex;
+	typedef CONDITION_VARIABLE fm_cond;
+	typedef struct fm_win32_timer_s *fm_timer;
+	typedef HANDLE fm_event;
 #elif defined __unix
+	#include <pthread.h>
 	typedef int serial_handle;
+	typedef pthread_t fm_thread;
+	typedef pthread_mutex_t fm_mutex;
+	typedef pthread_cond_t fm_cond;
+	typedef int fm_timer;
+	typedef int fm_event;
 #else
 	#error unsupported platform
 #endif
@@ -19,40 +30,319 @@
 /* How many bytes we are expecting when setting the fan profile. */
 #define FM_FAN_BUFFER_SIZE 65
 
-/*
- *	Data result to return the fan status
- * */
-struct fm_data_s {
-	/* Duty cycle, a percentage between 0.0 and 1.0 */
-	float fan_duty_cycle;
-	float pump_duty_cycle;
+/* Most fields a heartbeat schema can describe, and the id range */
+#define FM_SCHEMA_MAX 32
+#define FM_SCHEMA_MAX_ID 256
+
+/* Most fm_subscribe() callbacks per handle */
+#define FM_MAX_SUBSCRIBERS 8
 
-	/* Temp, in degrees celcius */
-	float ambient_temp;
-	float coolant_temp;
+/* How many streamed samples can be queued, must be a power of two */
+#define FM_STREAM_RING_SIZE 256
 
-	/* litres per hour */
-	float flow_rate;
+/*
+ * Byte offsets of each value in the heartbeat payload.
+ *
+ * Duty cycles are 16 bit timer ticks, out of timer_top.
+ * Tach counts are 8 bit, RPM / 30.
+ * Temperatures are 16 bit words holding a 10 bit ADC count.
+ * */
+#define FM_HB_FAN_DUTY    0
+#define FM_HB_PUMP_DUTY   2
+#define FM_HB_FAN_TACH    4
+#define FM_HB_PUMP_TACH   5
+#define FM_HB_COOLANT_ADC 6
+#define FM_HB_AMBIENT_ADC 8
+#define FM_HB_FLOW        10
 
-	/* Fan RPM, as a whole integer */
-	int fan_rpm;
-	int pump_rpm;
+/*
+ * A validated heartbeat, still in wire format.
+ * Nothing is converted until somebody asks for it.
+ * */
+struct fm_frame_s {
+	uint64_t timestamp;	/* when the ETX arrived */
+	uint64_t request_time;	/* when the request went out, 0 if unsolicited */
+	unsigned char payload[FM_PAYLOAD_SIZE];
 };
+typedef struct fm_frame_s fm_frame;
 
-typedef struct fm_data_s fm_data;
+/* Decoded values that are worth remembering, see fm_lazy_decode() */
+enum fm_memo_e {
+	FM_MEMO_FAN_DUTY,
+	FM_MEMO_PUMP_DUTY,
+	FM_MEMO_COOLANT,
+	FM_MEMO_AMBIENT,
+	FM_MEMO_COUNT
+};
 
 /* Get the current pump data */
 fm_rc fm_get_data(struct flowmaster_s *fm, fm_data *data);
 
+/* Ask for a heartbeat and capture it */
+fm_rc fm_request_frame(struct flowmaster_s *fm, fm_frame *frame);
+
+/* Copy the validated heartbeat sitting in the read buffer */
+void fm_capture_frame(struct flowmaster_s *fm, fm_frame *frame);
+
+/* Streaming, on the I/O thread: take the heartbeat just read, or watch the port for one */
+void fm_stream_init(struct flowmaster_s *fm);
+void fm_stream_destroy(struct flowmaster_s *fm);
+void fm_stream_receive(struct flowmaster_s *fm);
+void fm_stream_poll(struct flowmaster_s *fm);
+
+/* Convert every value in a heartbeat, see schema.c */
+void fm_decode_frame(struct flowmaster_s *fm, const fm_frame *frame, fm_data *data);
+
+void fm_schema_defaults(struct flowmaster_s *fm);
+
+/* Convert a raw value, already sign extended with fm_field_extend() */
+double fm_field_convert(struct flowmaster_s *fm, const fm_field_desc *field, int raw);
+int fm_field_extend(const fm_field_desc *field, int raw);
+
+/* Calibrated probe tables, see thermistor.c */
+struct fm_probe_s;
+void fm_free_probes(struct flowmaster_s *fm);
+float fm_probe_convert(struct flowmaster_s *fm, int id, int raw);
+
+/* Alarm state, see alarm.c */
+struct fm_alarms_s;
+typedef struct fm_alarms_s fm_alarms;
+
+void fm_alarms_check(struct flowmaster_s *fm, const fm_sample *sample);
+void fm_alarms_destroy(fm_alarms *alarms);
+
+/* Polling governor, see governor.c.  A kick means poll fast again. */
+void fm_governor_observe(struct flowmaster_s *fm, const fm_sample *sample);
+void fm_governor_kick(struct flowmaster_s *fm);
+void fm_governor_destroy(fm_governor *governor);
+
+/* Host side control loop, see control.c */
+struct fm_control_s;
+typedef struct fm_control_s fm_control;
+
+/* Write combined fan and pump speeds, see combine.c */
+struct fm_combine_s;
+typedef struct fm_combine_s fm_combine;
+
+/* worker_lock held */
+int fm_combine_set(fm_combine *combine, float duty_cycle, int fan_or_pump);
+
+/* Send a fan or pump speed through the I/O thread, ignoring write combining */
+fm_rc fm_send_speed(struct flowmaster_s *fm, float duty_cycle, int fan_or_pump);
+
+/* Send a fan or pump speed and wait for the ACK, on the I/O thread */
+int fm_set_speed_locked(struct flowmaster_s *fm, float duty_cycle, int fan_or_pump);
+
+/* Last acknowledged value of each writable setting, see shadow.c */
+enum fm_shadow_reg_e {
+	FM_SHADOW_FAN,		/* duty in timer ticks */
+	FM_SHADOW_PUMP,		/* duty in timer ticks */
+	FM_SHADOW_MODE,		/* 1 automatic, 0 manual */
+	FM_SHADOW_ROTATE,	/* 1 rotating, 0 halted */
+	FM_SHADOW_PROFILE,	/* only a valid bit, the values live in profile[] */
+	FM_SHADOW_CURSOR,	/* LCD address the next character goes to */
+	FM_SHADOW_SCREEN,	/* only a valid bit, the LCD shows display_shown */
+	FM_SHADOW_COUNT
+};
+typedef enum fm_shadow_reg_e fm_shadow_reg;
+
+struct fm_shadow_s {
+	unsigned int valid;	/* bitmask of 1 << fm_shadow_reg */
+	int value[FM_SHADOW_COUNT];
+	uint16_t profile[FM_FAN_BUFFER_SIZE];
+	uint16_t profile_sum;	/* Fletcher-16 of profile[], checked on every load */
+};
+
+void fm_shadow_invalidate(struct flowmaster_s *fm, unsigned int registers);
+int fm_shadow_matches(struct flowmaster_s *fm, fm_shadow_reg reg, int value);
+void fm_shadow_store(struct flowmaster_s *fm, fm_shadow_reg reg, int value);
+int fm_shadow_load_profile(struct flowmaster_s *fm, uint16_t *ticks);
+void fm_shadow_store_profile(struct flowmaster_s *fm, const uint16_t *ticks);
+void fm_shadow_check(struct flowmaster_s *fm, const fm_frame *frame);
+
+/*
+ * Transactions with the controller, run one at a time on the handle's
+ * I/O thread, see io.c.  func does the whole exchange with the port and
+ * must not itself call fm_io_run().
+ * */
+typedef fm_rc (*fm_request_func)(struct flowmaster_s *fm, void *arg);
+
+struct fm_request_s {
+	struct fm_request_s *volatile next;	/* queue link, see fm_io_push() */
+	struct fm_request_s *queued;		/* the I/O thread's list for its class */
+	fm_priority priority;
+	fm_request_func func;
+	void *arg;
+	uint64_t submitted;
+	fm_rc rc;
+	volatile unsigned int done;
+	fm_cond cond;
+};
+typedef struct fm_request_s fm_request;
+
+void fm_io_init(struct flowmaster_s *fm);
+void fm_io_destroy(struct flowmaster_s *fm);
+
+/* The thread runs from connect to disconnect */
+fm_rc fm_io_start(struct flowmaster_s *fm);
+void fm_io_stop(struct flowmaster_s *fm);
+
+/* Queue func(fm, arg) and wait for it to run, returns what it returned */
+fm_rc fm_io_run(struct flowmaster_s *fm, fm_priority priority, fm_request_func func, void *arg);
+
+/* Ask for a heartbeat on the I/O thread */
+fm_rc fm_fetch_frame(struct flowmaster_s *fm, fm_frame *frame);
+
+/* Host side copy of the LCD, see display.c */
+void fm_display_init(struct flowmaster_s *fm);
+void fm_display_destroy(struct flowmaster_s *fm);
+
+/* Poll scheduling and subscribers, see scheduler.c */
+struct fm_subscription_s {
+	fm_subscriber cb;
+	void *userdata;
+};
+
+void fm_scheduler_init(struct flowmaster_s *fm);
+void fm_scheduler_destroy(struct flowmaster_s *fm);
+int fm_has_subscribers(struct flowmaster_s *fm);
+void fm_notify_subscribers(struct flowmaster_s *fm, const fm_sample *sample);
+
+/* Make a freshly received heartbeat the current status */
+void fm_publish_frame(struct flowmaster_s *fm, const fm_frame *frame);
+
 struct flowmaster_s
 {
 	serial_handle port;
+#ifdef _WIN32
+	/* The port is opened for overlapped I/O, one operation at a time, see flowmaster_win32.c */
+	HANDLE port_event;
+#endif
 	unsigned char write_buffer[FM_BUFFER_SIZE];
 	unsigned char read_buffer[FM_BUFFER_SIZE];
 	int write_buffer_len; /* number of chars in the buffer */
 	int read_buffer_len; /* number of chars in the buffer */
 	int timer_top;
-	fm_data data;
+
+	/* Set by fm_serial_write() and by fm_serial_read() on ETX */
+	uint64_t tx_timestamp;
+	uint64_t rx_timestamp;
+
+	/* Request round trips, see fm_get_latency() */
+	volatile uint64_t rtt_last;
+	volatile uint64_t rtt_min;
+	volatile uint64_t rtt_mean;
+	volatile uint64_t rtt_count;
+
+	/*
+	 * The latest heartbeat.  Only fm_publish_frame() writes it, bumping
+	 * data_seq to odd before and back to even after, see fm_snapshot().
+	 * Samples can arrive on several threads at once, publish_lock keeps
+	 * the writers, and the single writer consumers below, to one at a time.
+	 * */
+	fm_mutex publish_lock;
+	volatile unsigned int data_seq;
+	fm_frame frame;
+
+	/* Heartbeat layout, and schema_index[id] is the field's position in it or 0xFF */
+	fm_field_desc schema[FM_SCHEMA_MAX];
+	int schema_count;
+	unsigned char schema_index[FM_SCHEMA_MAX_ID];
+
+	/*
+	 * Calibrated conversion tables by field id, NULL for the default.
+	 * A replaced one is freed once probe_readers, the number of
+	 * conversions under way, has been 0.  probe_lock is for calibrators
+	 * only.
+	 * */
+	struct fm_probe_s *probe[FM_SCHEMA_MAX_ID];
+	volatile unsigned int probe_readers;
+	fm_mutex probe_lock;
+
+	/* Decoded values, (data_seq << 32) | float bits */
+	volatile uint64_t memo[FM_MEMO_COUNT];
+
+	/* Optional consumers of every sample, see fm_publish_frame() */
+	fm_filter *filter;
+	fm_alarms *alarms;
+	fm_governor *governor;
+	fm_history *history;
+	fm_rollup *rollup;
+#ifndef _WIN32
+	fm_log *log;
+#endif
+
+	/*
+	 * Only the I/O thread touches the port and the buffers above, see
+	 * io.c.  Callers push requests at io_head, the thread takes them
+	 * from io_tail.  io_callers counts those inside fm_io_run(), the
+	 * thread doesn't exit until it drops to 0.  io_wake wakes the thread
+	 * when io_sleeping says it needs it.
+	 * */
+	fm_thread io_thread;
+	volatile unsigned int io_running;
+	volatile unsigned int io_callers;
+	volatile unsigned int io_sleeping;
+	fm_request *volatile io_head;
+	fm_request *io_tail;
+	fm_request io_stub;
+	fm_event io_wake;
+	int io_wake_ready;
+	fm_mutex io_done_lock;
+	volatile uint64_t io_max_wait[FM_PRIORITY_COUNT];
+
+	/* Keeps multi-transaction bulk operations from interleaving with each other */
+	fm_mutex bulk_lock;
+	int profile_check;	/* next point of the cached profile to check, under bulk_lock */
+
+	/* Written with the port acquired as well as shadow_lock */
+	fm_mutex shadow_lock;
+	struct fm_shadow_s shadow;
+
+	/*
+	 * The frame being drawn and what the LCD was last sent, under
+	 * display_lock, which also keeps commits from interleaving.
+	 * */
+	fm_mutex display_lock;
+	char display_frame[FM_DISPLAY_ROWS][FM_DISPLAY_COLS];
+	char display_shown[FM_DISPLAY_ROWS][FM_DISPLAY_COLS];
+	int display_row;	/* where fm_print_message() writes next */
+	int display_col;
+
+	/* Scheduled polling, see scheduler.c */
+	fm_mutex refresh_lock;
+	uint64_t refresh_period;
+	uint64_t last_refresh;
+	int refreshed_since_tick;
+	fm_thread scheduler_thread;
+	fm_timer scheduler_timer;
+	volatile unsigned int scheduler_running;
+
+	fm_mutex subscriber_lock;
+	struct fm_subscription_s subscribers[FM_MAX_SUBSCRIBERS];
+
+	/* Guards the control and combine pointers, and with them the objects' lifetimes */
+	fm_mutex worker_lock;
+	fm_control *control;
+	fm_combine *combine;
+
+	/*
+	 * Heartbeat streaming, see stream.c.  stream_running is only changed
+	 * on the I/O thread, which hands heartbeats over through the inbox
+	 * to the stream thread, which queues them in the ring and publishes.
+	 * */
+	fm_thread stream_thread;
+	volatile unsigned int stream_running;
+	fm_mutex stream_lock;
+	fm_cond stream_cond;
+	volatile unsigned int inbox_head; /* written by the I/O thread */
+	volatile unsigned int inbox_tail; /* written by the stream thread */
+	unsigned int inbox_dropped;
+	fm_frame stream_inbox[FM_STREAM_RING_SIZE];
+	volatile unsigned int stream_head; /* written by the stream thread */
+	volatile unsigned int stream_tail; /* written by fm_stream_read() */
+	unsigned int stream_dropped;
+	fm_frame stream_ring[FM_STREAM_RING_SIZE];
 };
 typedef struct flowmaster_s flowmaster;
 
@@ -62,6 +352,8 @@ int fm_prev_rx_byte(flowmaster *fm, unsigned char *byte);
 
 /* Writes a block of bytes */
 int fm_serial_write(flowmaster *fm, int *written);
+/* The same without discarding unread input first, for pipelined requests */
+int fm_serial_write_more(flowmaster *fm, int *written);
 /* Writes a single byte */
 int fm_serial_write_byte(flowmaster *fm, unsigned char byte);
 
@@ -72,6 +364,11 @@ int fm_serial_write_byte(flowmaster *fm, unsigned char byte);
  * nonzero on error
  * */
 int fm_serial_read_byte(flowmaster *fm, unsigned char *byte);
+/* Wait up to timeout_ms for input, 1 if there is some */
+int fm_serial_wait(flowmaster *fm, unsigned int timeout_ms);
+
+/* Wait for event to be signalled, or if listen for input too, 1 if there is input */
+int fm_serial_wait_event(flowmaster *fm, fm_event event, int listen);
 
 /* Reads from the input buffer and discards results */
 void fm_flush_buffers(flowmaster *fm);
@@ -88,6 +385,71 @@ void fm_add_byte(flowmaster *fm, unsigned char byte);
 void fm_add_word(flowmaster *fm, uint16_t byte);
 void fm_add_csum(flowmaster *fm, int length);
 int  fm_serial_read(flowmaster *fm);
+/* The same, but hands back unasked for heartbeats too */
+int  fm_serial_read_packet(flowmaster *fm);
 int  fm_validate_packet(flowmaster *fm, int expected_packet);
+/* Send the write buffer and wait for a reply of type response */
+int  fm_do_write(flowmaster *fm, int response);
+
+/*
+ * Platform threading and time support
+ * */
+typedef void (*fm_thread_func)(void *arg);
+
+/* Returns 0 if the thread was started */
+int fm_thread_start(fm_thread *thread, fm_thread_func func, void *arg);
+void fm_thread_join(fm_thread thread);
+
+/*
+ * Give the calling thread real time priority (1-99, 0 leaves it alone)
+ * and pin it to cpu (-1 leaves it alone).  Returns 0 if both worked.
+ * */
+int fm_thread_realtime(int priority, int cpu);
+
+void fm_mutex_init(fm_mutex *mutex);
+void fm_mutex_destroy(fm_mutex *mutex);
+void fm_mutex_lock(fm_mutex *mutex);
+void fm_mutex_unlock(fm_mutex *mutex);
+
+void fm_cond_init(fm_cond *cond);
+void fm_cond_destroy(fm_cond *cond);
+/* Unlocks mutex while waiting, holds it again on return */
+void fm_cond_wait(fm_cond *cond, fm_mutex *mutex);
+void fm_cond_broadcast(fm_cond *cond);
+
+/*
+ * Wakes a thread out of fm_serial_wait_event().  A signal given while
+ * nobody is waiting is kept for the next wait.
+ * */
+int fm_event_create(fm_event *event);
+void fm_event_destroy(fm_event event);
+void fm_event_signal(fm_event event);
+
+/* Nanoseconds from a monotonic clock */
+uint64_t fm_monotonic_ns(void);
+
+/* Sleep until the monotonic clock reaches deadline */
+void fm_sleep_until(uint64_t deadline);
+
+/*
+ * Periodic timer on the monotonic clock.  fm_timer_set() arms it to
+ * first expire at deadline then every period ns (0 for once only).
+ * fm_timer_wait() blocks until it expires, returning how many periods
+ * have gone by since the last wait, or -1 on error.
+ * */
+int fm_timer_create(fm_timer *timer);
+void fm_timer_destroy(fm_timer timer);
+int fm_timer_set(fm_timer timer, uint64_t deadline, uint64_t period);
+int fm_timer_wait(fm_timer timer);
+
+/*
+ * Host load for feed-forward control.  fm_host_cpu_times() gives the time
+ * all CPUs together have spent busy and in total, fm_host_energy() a CPU
+ * package's energy counter in microjoules and the value it wraps at.
+ * Only the difference between two readings means anything, and both
+ * return -1 where the platform can't tell (or there is no such package).
+ * */
+int fm_host_cpu_times(uint64_t *busy, uint64_t *total);
+int fm_host_energy(int package, uint64_t *microjoules, uint64_t *range);
 
 #endif
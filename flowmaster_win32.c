@@ -16,8 +16,9 @@ fm_connect_private(flowmaster *fm, const char *port)
 	COMMTIMEOUTS timeouts;
 	DCB dcb = {0};
 
+	/* Overlapped so the I/O thread can wait on the port and its wake up event at once */
 	handle = CreateFileA( port, GENERIC_READ | GENERIC_WRITE,
-		0,NULL,OPEN_EXISTING,0,0);
+		0,NULL,OPEN_EXISTING,FILE_FLAG_OVERLAPPED,0);
 
 	if(handle == INVALID_HANDLE_VALUE){
 		return FM_PORT_ERROR;
@@ -62,6 +63,15 @@ fm_connect_private(flowmaster *fm, const char *port)
 
 	SetCommTimeouts(handle, &timeouts);
 
+	/* fm_serial_wait() only needs to hear about input */
+	SetCommMask(handle, EV_RXCHAR);
+
+	fm->port_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if(fm->port_event == NULL){
+		CloseHandle(handle);
+		return FM_PORT_ERROR;
+	}
+
 	fm->port = handle;
 	return FM_OK;
 }
@@ -101,7 +111,12 @@ fm_get_baudrate(flowmaster *fm, fm_baud_rate *baud)
 fm_rc
 fm_disconnect(flowmaster *fm)
 {
+	/* The stream thread waits on heartbeats only the I/O thread can deliver */
+	fm_stream_stop(fm);
+	fm_io_stop(fm);
+
 	CloseHandle(fm->port);
+	CloseHandle(fm->port_event);
 	fm->port = INVALID_HANDLE_VALUE;
 	return FM_OK;
 }
@@ -115,14 +130,37 @@ fm_isconnected(flowmaster *fm)
 int
 fm_serial_write(flowmaster *fm, int *bytes_written)
 {
+	return fm_serial_write_more(fm, bytes_written);
+}
+
+/* Wait for an overlapped operation to finish, 0 if it went through */
+static int
+fm_serial_finish(flowmaster *fm, BOOL started, OVERLAPPED *overlapped, DWORD *count)
+{
+	if(!started && GetLastError() != ERROR_IO_PENDING){
+		return -1;
+	}
+
+	return GetOverlappedResult(fm->port, overlapped, count, TRUE) ? 0 : -1;
+}
+
+/* Nothing is flushed before a write here anyway */
+int
+fm_serial_write_more(flowmaster *fm, int *bytes_written)
+{
+	OVERLAPPED overlapped = {0};
 	DWORD written;
 	BOOL rc;
 
-	rc = WriteFile(fm->port, fm->write_buffer, fm->write_buffer_len, &written, NULL);
-	if(!rc){
+	overlapped.hEvent = fm->port_event;
+
+	rc = WriteFile(fm->port, fm->write_buffer, fm->write_buffer_len, &written, &overlapped);
+	if(fm_serial_finish(fm, rc, &overlapped, &written) != 0){
 		return -1;
 	}
 
+	fm->tx_timestamp = fm_monotonic_ns();
+
 	*bytes_written = (int) written;
 
 	return 0;
@@ -131,24 +169,96 @@ fm_serial_write(flowmaster *fm, int *bytes_written)
 int
 fm_serial_read_byte(flowmaster *fm, unsigned char *byte)
 {
+	OVERLAPPED overlapped = {0};
 	DWORD read;
 	BOOL rc;
 
-	rc = ReadFile(fm->port, byte, 1, &read, NULL);
-	if(!rc){
+	overlapped.hEvent = fm->port_event;
+
+	rc = ReadFile(fm->port, byte, 1, &read, &overlapped);
+	if(fm_serial_finish(fm, rc, &overlapped, &read) != 0){
 		return -1;
 	}
 
 	return 0;
 }
 
+static int
+fm_serial_waiting(flowmaster *fm)
+{
+	COMSTAT status;
+	DWORD errors;
+
+	if(!ClearCommError(fm->port, &errors, &status)){
+		return 0;
+	}
+
+	return status.cbInQue > 0;
+}
+
+/*
+ * Wait for input, or for event if it isn't NULL, or until timeout_ms is
+ * up.  Returns 1 if there is input waiting.
+ * */
+static int
+fm_serial_wait_for(flowmaster *fm, HANDLE event, DWORD timeout_ms)
+{
+	OVERLAPPED overlapped = {0};
+	HANDLE handles[2];
+	DWORD mask;
+	DWORD count;
+
+	if(fm_serial_waiting(fm)){
+		return 1;
+	}
+
+	overlapped.hEvent = fm->port_event;
+	handles[0] = fm->port_event;
+	handles[1] = event;
+
+	if(!WaitCommEvent(fm->port, &mask, &overlapped)){
+		if(GetLastError() != ERROR_IO_PENDING){
+			return 0;
+		}
+
+		if(WaitForMultipleObjects(event != NULL ? 2 : 1, handles, FALSE, timeout_ms) != WAIT_OBJECT_0){
+			/* Setting the mask again makes the pending wait return */
+			SetCommMask(fm->port, EV_RXCHAR);
+		}
+		GetOverlappedResult(fm->port, &overlapped, &count, TRUE);
+	}
+
+	return fm_serial_waiting(fm);
+}
+
+int
+fm_serial_wait(flowmaster *fm, unsigned int timeout_ms)
+{
+	return fm_serial_wait_for(fm, NULL, timeout_ms);
+}
+
+int
+fm_serial_wait_event(flowmaster *fm, fm_event event, int listen)
+{
+	if(!listen){
+		WaitForSingleObject(event, INFINITE);
+		return 0;
+	}
+
+	return fm_serial_wait_for(fm, event, INFINITE);
+}
+
 int
 fm_serial_write_byte(flowmaster *fm, unsigned char byte)
 {
+	OVERLAPPED overlapped = {0};
 	DWORD written;
-	BOOL rc = WriteFile(fm->port,&byte,1,&written,NULL);
+	BOOL rc;
+
+	overlapped.hEvent = fm->port_event;
 
-	if(!rc){
+	rc = WriteFile(fm->port, &byte, 1, &written, &overlapped);
+	if(fm_serial_finish(fm, rc, &overlapped, &written) != 0){
 		return -1;
 	}
 
@@ -161,6 +271,272 @@ fm_flush_buffers(flowmaster *fm)
 	PurgeComm(fm->port, PURGE_RXABORT | PURGE_RXCLEAR | PURGE_TXABORT | PURGE_TXCLEAR );
 }
 
+struct fm_thread_start_s {
+	fm_thread_func func;
+	void *arg;
+};
+
+static DWORD WINAPI
+fm_thread_trampoline(LPVOID arg)
+{
+	struct fm_thread_start_s start = *(struct fm_thread_start_s*) arg;
+
+	free(arg);
+	start.func(start.arg);
+
+	return 0;
+}
+
+int
+fm_thread_start(fm_thread *thread, fm_thread_func func, void *arg)
+{
+	struct fm_thread_start_s *start;
+
+	start = (struct fm_thread_start_s*) malloc(sizeof(struct fm_thread_start_s));
+	if(start == NULL){
+		return -1;
+	}
+
+	start->func = func;
+	start->arg = arg;
+
+	*thread = CreateThread(NULL, 0, fm_thread_trampoline, start, 0, NULL);
+	if(*thread == NULL){
+		free(start);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+fm_thread_join(fm_thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+void
+fm_cond_init(fm_cond *cond)
+{
+	InitializeConditionVariable(cond);
+}
+
+void
+fm_cond_destroy(fm_cond *cond)
+{
+	/* Nothing to free */
+	(void) cond;
+}
+
+void
+fm_cond_wait(fm_cond *cond, fm_mutex *mutex)
+{
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+}
+
+void
+fm_cond_broadcast(fm_cond *cond)
+{
+	WakeAllConditionVariable(cond);
+}
+
+int
+fm_event_create(fm_event *event)
+{
+	/* Auto reset, a signal nobody has waited for yet stays set */
+	*event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	return *event == NULL ? -1 : 0;
+}
+
+void
+fm_event_destroy(fm_event event)
+{
+	CloseHandle(event);
+}
+
+void
+fm_event_signal(fm_event event)
+{
+	SetEvent(event);
+}
+
+int
+fm_thread_realtime(int priority, int cpu)
+{
+	int rc = 0;
+
+	/* No priority levels to speak of, anything asked for gets time critical */
+	if(priority > 0 && !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)){
+		rc = -1;
+	}
+
+	if(cpu >= 0 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu) == 0){
+		rc = -1;
+	}
+
+	return rc;
+}
+
+void
+fm_mutex_init(fm_mutex *mutex)
+{
+	InitializeCriticalSection(mutex);
+}
+
+void
+fm_mutex_destroy(fm_mutex *mutex)
+{
+	DeleteCriticalSection(mutex);
+}
+
+void
+fm_mutex_lock(fm_mutex *mutex)
+{
+	EnterCriticalSection(mutex);
+}
+
+void
+fm_mutex_unlock(fm_mutex *mutex)
+{
+	LeaveCriticalSection(mutex);
+}
+
+/*
+ * A waitable timer doesn't count the periods that went by while nobody
+ * was waiting, so keep the next deadline alongside it and work them out
+ * from the clock.
+ * */
+struct fm_win32_timer_s {
+	HANDLE handle;
+	uint64_t deadline;
+	uint64_t period;
+};
+
+int
+fm_timer_create(fm_timer *timer)
+{
+	*timer = (fm_timer) calloc(1, sizeof(struct fm_win32_timer_s));
+	if(*timer == NULL){
+		return -1;
+	}
+
+	(*timer)->handle = CreateWaitableTimer(NULL, FALSE, NULL);
+	if((*timer)->handle == NULL){
+		free(*timer);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+fm_timer_destroy(fm_timer timer)
+{
+	CloseHandle(timer->handle);
+	free(timer);
+}
+
+int
+fm_timer_set(fm_timer timer, uint64_t deadline, uint64_t period)
+{
+	const uint64_t now = fm_monotonic_ns();
+	LARGE_INTEGER due;
+
+	timer->deadline = deadline;
+	timer->period = period;
+
+	/* Waitable timers want a relative time in 100ns units, negative */
+	due.QuadPart = deadline > now ? -(LONGLONG)((deadline - now) / 100) : -1;
+
+	if(!SetWaitableTimer(timer->handle, &due, (LONG)(period / 1000000), NULL, NULL, FALSE)){
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+fm_timer_wait(fm_timer timer)
+{
+	uint64_t now;
+	uint64_t expired;
+
+	if(WaitForSingleObject(timer->handle, INFINITE) != WAIT_OBJECT_0){
+		return -1;
+	}
+
+	if(timer->period == 0){
+		return 1;
+	}
+
+	/* It can fire a little early, that still counts as the one deadline */
+	now = fm_monotonic_ns();
+	expired = 1;
+	if(now > timer->deadline){
+		expired += (now - timer->deadline) / timer->period;
+	}
+	timer->deadline += expired * timer->period;
+
+	return (int) expired;
+}
+
+void
+fm_sleep_until(uint64_t deadline)
+{
+	const uint64_t now = fm_monotonic_ns();
+
+	if(deadline > now){
+		Sleep((DWORD)((deadline - now + 999999) / 1000000));
+	}
+}
+
+uint64_t
+fm_monotonic_ns(void)
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if(frequency.QuadPart == 0){
+		QueryPerformanceFrequency(&frequency);
+	}
+
+	QueryPerformanceCounter(&counter);
+
+	/* Split the division up so the multiply can't overflow */
+	return ((uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ull) +
+		((uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ull / frequency.QuadPart);
+}
+
+static uint64_t
+fm_filetime64(const FILETIME *ft)
+{
+	return ((uint64_t) ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+}
+
+int
+fm_host_cpu_times(uint64_t *busy, uint64_t *total)
+{
+	FILETIME idle, kernel, user;
+
+	if(!GetSystemTimes(&idle, &kernel, &user)){
+		return -1;
+	}
+
+	/* Kernel time includes the idle time */
+	*total = fm_filetime64(&kernel) + fm_filetime64(&user);
+	*busy = *total - fm_filetime64(&idle);
+
+	return 0;
+}
+
+int
+fm_host_energy(int package, uint64_t *microjoules, uint64_t *range)
+{
+	/* No unprivileged way to get at the package energy counters */
+	return -1;
+}
+
 
 /*
 	Win32 DLL entry point function
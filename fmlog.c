@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
+
+/*
+ * Memory mapped, append-only, columnar telemetry log.
+ *
+ * File layout, all values in host byte order:
+ *
+ *   header page   struct fm_log_header_s
+ *   segment 0     index page, then one column of timestamps and one
+ *   segment 1     column per field, FM_LOG_SEGMENT_RECORDS entries each
+ *   ...
+ *
+ * Timestamps are wall clock nanoseconds since the epoch, fields are all
+ * stored as floats (RPMs fit exactly).
+ *
+ * A record is written straight into its columns and only then is the
+ * header's tail (the number of committed records) advanced with a
+ * release store.  Anything past the tail is garbage, so a writer that
+ * dies half way through a record leaves a consistent file behind and
+ * readers in other processes can map the file and read the columns in
+ * place without any locking.
+ * */
+
+#define FM_LOG_MAGIC "FMLOG\0\0\0"
+#define FM_LOG_VERSION 1
+#define FM_LOG_PAGE 4096
+#define FM_LOG_SEGMENT_RECORDS 4096
+
+/* Segments added each time the file has to grow */
+#define FM_LOG_GROW_SEGMENTS 8
+
+#define FM_LOG_SEGMENT_BYTES \
+	(FM_LOG_PAGE + (FM_LOG_SEGMENT_RECORDS * (sizeof(uint64_t) + (FM_FIELD_COUNT * sizeof(float)))))
+
+struct fm_log_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t field_count;
+	uint32_t segment_records;
+	uint32_t reserved;
+	uint64_t segment_bytes;
+	volatile uint64_t tail;
+};
+
+/* First page of every segment */
+struct fm_log_index_s {
+	uint64_t first;
+	uint64_t last;
+	float min[FM_FIELD_COUNT];
+	float max[FM_FIELD_COUNT];
+};
+
+struct fm_log_s {
+	int fd;
+	int writable;
+	unsigned char *map;
+	size_t map_size;
+	uint64_t segments; /* segments covered by the mapping */
+
+	/* Converts fm_sample timestamps to wall clock */
+	int64_t realtime_offset;
+};
+
+static struct fm_log_header_s*
+fm_log_header(fm_log *log)
+{
+	return (struct fm_log_header_s*) log->map;
+}
+
+static unsigned char*
+fm_log_segment(fm_log *log, uint64_t segment)
+{
+	return log->map + FM_LOG_PAGE + (segment * FM_LOG_SEGMENT_BYTES);
+}
+
+static int
+fm_log_map(fm_log *log, size_t size)
+{
+	const int prot = log->writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+	void *map;
+
+	if(log->map != NULL){
+		munmap(log->map, log->map_size);
+		log->map = NULL;
+	}
+
+	map = mmap(NULL, size, prot, MAP_SHARED, log->fd, 0);
+	if(map == MAP_FAILED){
+		return -1;
+	}
+
+	log->map = (unsigned char*) map;
+	log->map_size = size;
+	log->segments = (size - FM_LOG_PAGE) / FM_LOG_SEGMENT_BYTES;
+
+	return 0;
+}
+
+static int
+fm_log_valid(fm_log *log)
+{
+	const struct fm_log_header_s *header = fm_log_header(log);
+
+	return memcmp(header->magic, FM_LOG_MAGIC, sizeof(header->magic)) == 0
+		&& header->version == FM_LOG_VERSION
+		&& header->field_count == FM_FIELD_COUNT
+		&& header->segment_records == FM_LOG_SEGMENT_RECORDS
+		&& header->segment_bytes == FM_LOG_SEGMENT_BYTES;
+}
+
+fm_log*
+fm_log_create(const char *path)
+{
+	struct fm_log_header_s *header;
+	struct timespec real;
+	struct timespec mono;
+	struct stat st;
+	fm_log *log;
+
+	log = (fm_log*) calloc(1, sizeof(fm_log));
+	if(log == NULL){
+		return NULL;
+	}
+
+	log->writable = 1;
+	log->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(log->fd == -1){
+		free(log);
+		return NULL;
+	}
+
+	/* One writer per file */
+	if(flock(log->fd, LOCK_EX | LOCK_NB) != 0 || fstat(log->fd, &st) != 0){
+		close(log->fd);
+		free(log);
+		return NULL;
+	}
+
+	if(st.st_size == 0){
+		if(ftruncate(log->fd, FM_LOG_PAGE + (FM_LOG_GROW_SEGMENTS * FM_LOG_SEGMENT_BYTES)) != 0
+			|| fm_log_map(log, FM_LOG_PAGE + (FM_LOG_GROW_SEGMENTS * FM_LOG_SEGMENT_BYTES)) != 0){
+			fm_log_close(log);
+			return NULL;
+		}
+
+		header = fm_log_header(log);
+		memcpy(header->magic, FM_LOG_MAGIC, sizeof(header->magic));
+		header->version = FM_LOG_VERSION;
+		header->field_count = FM_FIELD_COUNT;
+		header->segment_records = FM_LOG_SEGMENT_RECORDS;
+		header->segment_bytes = FM_LOG_SEGMENT_BYTES;
+		fm_store64_release(&header->tail, 0);
+	}
+	else if(fm_log_map(log, (size_t) st.st_size) != 0 || !fm_log_valid(log)){
+		fm_log_close(log);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	log->realtime_offset =
+		((int64_t) real.tv_sec - (int64_t) mono.tv_sec) * 1000000000ll +
+		((int64_t) real.tv_nsec - (int64_t) mono.tv_nsec);
+
+	return log;
+}
+
+fm_log*
+fm_log_open(const char *path)
+{
+	struct stat st;
+	fm_log *log;
+
+	log = (fm_log*) calloc(1, sizeof(fm_log));
+	if(log == NULL){
+		return NULL;
+	}
+
+	log->fd = open(path, O_RDONLY);
+	if(log->fd == -1){
+		free(log);
+		return NULL;
+	}
+
+	if(fstat(log->fd, &st) != 0 || st.st_size < FM_LOG_PAGE
+		|| fm_log_map(log, (size_t) st.st_size) != 0 || !fm_log_valid(log)){
+		fm_log_close(log);
+		return NULL;
+	}
+
+	return log;
+}
+
+void
+fm_log_close(fm_log *log)
+{
+	if(log == NULL){
+		return;
+	}
+
+	if(log->map != NULL){
+		munmap(log->map, log->map_size);
+	}
+
+	close(log->fd);
+	free(log);
+}
+
+fm_rc
+fm_log_append(fm_log *log, const fm_sample *sample)
+{
+	struct fm_log_header_s *header = fm_log_header(log);
+	const uint64_t tail = header->tail;
+	const uint64_t segment = tail / FM_LOG_SEGMENT_RECORDS;
+	const unsigned int slot = (unsigned int)(tail % FM_LOG_SEGMENT_RECORDS);
+	const uint64_t timestamp = (uint64_t)((int64_t) sample->timestamp + log->realtime_offset);
+	struct fm_log_index_s *index;
+	unsigned char *base;
+	int i;
+
+	if(!log->writable){
+		return FM_FILE_ERROR;
+	}
+
+	if(segment >= log->segments){
+		const size_t size = FM_LOG_PAGE + ((log->segments + FM_LOG_GROW_SEGMENTS) * FM_LOG_SEGMENT_BYTES);
+
+		if(ftruncate(log->fd, (off_t) size) != 0 || fm_log_map(log, size) != 0){
+			return FM_FILE_ERROR;
+		}
+		header = fm_log_header(log);
+	}
+
+	base = fm_log_segment(log, segment);
+	index = (struct fm_log_index_s*) base;
+
+	((uint64_t*)(base + FM_LOG_PAGE))[slot] = timestamp;
+
+	for(i = 0; i < FM_FIELD_COUNT; i++){
+		const float value = (float) fm_data_field(&sample->data, (fm_field) i);
+		float *column = (float*)(base + FM_LOG_PAGE +
+			(FM_LOG_SEGMENT_RECORDS * (sizeof(uint64_t) + (i * sizeof(float)))));
+
+		column[slot] = value;
+
+		if(slot == 0 || value < index->min[i]){
+			index->min[i] = value;
+		}
+		if(slot == 0 || value > index->max[i]){
+			index->max[i] = value;
+		}
+	}
+
+	if(slot == 0){
+		index->first = timestamp;
+	}
+	index->last = timestamp;
+
+	/* Publish the record */
+	fm_store64_release(&header->tail, tail + 1);
+
+	return FM_OK;
+}
+
+fm_rc
+fm_log_sync(fm_log *log)
+{
+	if(msync(log->map, log->map_size, MS_SYNC) != 0){
+		return FM_FILE_ERROR;
+	}
+	return FM_OK;
+}
+
+uint64_t
+fm_log_refresh(fm_log *log)
+{
+	const uint64_t tail = fm_load64_acquire(&fm_log_header(log)->tail);
+	struct stat st;
+
+	if(tail > log->segments * FM_LOG_SEGMENT_RECORDS){
+		/* The writer grew the file since we mapped it */
+		if(fstat(log->fd, &st) != 0 || fm_log_map(log, (size_t) st.st_size) != 0){
+			return 0;
+		}
+	}
+
+	return tail;
+}
+
+unsigned int
+fm_log_segment_records(fm_log *log)
+{
+	return fm_log_header(log)->segment_records;
+}
+
+const uint64_t*
+fm_log_timestamps(fm_log *log, uint64_t segment)
+{
+	if(segment >= log->segments){
+		return NULL;
+	}
+
+	return (const uint64_t*)(fm_log_segment(log, segment) + FM_LOG_PAGE);
+}
+
+const float*
+fm_log_column(fm_log *log, uint64_t segment, fm_field field)
+{
+	if(segment >= log->segments || (int) field < 0 || field >= FM_FIELD_COUNT){
+		return NULL;
+	}
+
+	return (const float*)(fm_log_segment(log, segment) + FM_LOG_PAGE +
+		(FM_LOG_SEGMENT_RECORDS * (sizeof(uint64_t) + (field * sizeof(float)))));
+}
+
+void
+fm_log_segment_range(fm_log *log, uint64_t segment, uint64_t *first, uint64_t *last)
+{
+	const struct fm_log_index_s *index;
+
+	if(segment >= log->segments){
+		*first = 0;
+		*last = 0;
+		return;
+	}
+
+	index = (const struct fm_log_index_s*) fm_log_segment(log, segment);
+	*first = index->first;
+	*last = index->last;
+}
+
+void
+fm_log_segment_bounds(fm_log *log, uint64_t segment, fm_field field, float *min, float *max)
+{
+	const struct fm_log_index_s *index;
+
+	if(segment >= log->segments || (int) field < 0 || field >= FM_FIELD_COUNT){
+		*min = 0.0f;
+		*max = 0.0f;
+		return;
+	}
+
+	index = (const struct fm_log_index_s*) fm_log_segment(log, segment);
+	*min = index->min[field];
+	*max = index->max[field];
+}
@@ -0,0 +1,886 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "flowmaster.h"
+
+/*
+ * Offline analytics over telemetry logs written by fm_log_create(),
+ * for example by monitor or 'fmstat record'.
+ *
+ * Usage:
+ *   fmstat record <port> <logfile> [interval_ms]
+ *   fmstat [options] summary <field> <logfile>...
+ *   fmstat [options] above <field> <threshold> <logfile>...
+ *   fmstat [options] percentile <field> <percent> <bucket_seconds> <logfile>...
+ *
+ * Options:
+ *   -j <threads>     worker threads, defaults to the number of CPUs
+ *   -f <epoch secs>  ignore samples before this time
+ *   -t <epoch secs>  ignore samples after this time
+ *   -l <N>[smhd]     only the last N seconds/minutes/hours/days
+ *   -g <seconds>     'above' doesn't count gaps longer than this, default 10
+ *
+ * Fields: fan_duty pump_duty ambient coolant flow fan_rpm pump_rpm
+ *
+ * The logs are already struct-of-arrays, so the kernels below run
+ * straight over the mapped columns eight values at a time.  Work is
+ * split per segment across the worker threads.
+ * */
+
+typedef float fm_v8f __attribute__((vector_size(32)));
+typedef int32_t fm_v8i __attribute__((vector_size(32)));
+typedef double fm_v4d __attribute__((vector_size(32)));
+
+#define NS_PER_SEC 1000000000ull
+
+enum stat_command_e {
+	STAT_SUMMARY,
+	STAT_ABOVE,
+	STAT_PERCENTILE
+};
+
+/* One segment of one file */
+struct work_item_s {
+	fm_log *log;
+	uint64_t segment;
+	unsigned int count; /* complete records in the segment */
+	uint64_t next_timestamp; /* first timestamp of the following segment, 0 if none */
+};
+
+/* Per thread partial results, merged at the end */
+struct partial_s {
+	double min;
+	double max;
+	double sum;
+	uint64_t count;
+	double above_seconds;
+	double total_seconds;
+	uint64_t *bucket_counts;
+};
+
+struct job_s {
+	enum stat_command_e command;
+	fm_field field;
+	uint64_t from;
+	uint64_t to;
+	float threshold;
+	float max_gap;
+
+	/* percentile */
+	double percent;
+	uint64_t bucket_width;
+	uint64_t bucket_base;
+	uint64_t bucket_count;
+	uint64_t *bucket_offsets;
+	uint64_t *bucket_fill;
+	float *bucket_values;
+	int pass;
+
+	struct work_item_s *items;
+	size_t item_count;
+	size_t next_item;
+	unsigned int scratch_size;	/* most records in a segment of any of the logs */
+	int failed;			/* a worker couldn't get its scratch space, under lock */
+	pthread_mutex_t lock;
+
+	struct partial_s *partials;
+	int threads;
+};
+
+static const char *field_names[FM_FIELD_COUNT] = {
+	"fan_duty", "pump_duty", "ambient", "coolant", "flow", "fan_rpm", "pump_rpm"
+};
+
+static int usage(void);
+static int record(int argc, char *argv[]);
+
+/*
+ * SIMD kernels
+ * */
+
+/* min, max and sum of n values */
+static void
+kernel_summary(const float *values, size_t n, struct partial_s *out)
+{
+	size_t i = 0;
+	double sum = 0.0;
+	float min;
+	float max;
+
+	if(n == 0){
+		return;
+	}
+
+	min = max = values[0];
+
+	if(n >= 8){
+		fm_v8f vmin;
+		fm_v8f vmax;
+		fm_v4d vsum = { 0.0, 0.0, 0.0, 0.0 };
+		int lane;
+
+		memcpy(&vmin, values, sizeof(vmin));
+		vmax = vmin;
+
+		for(; i + 8 <= n; i += 8){
+			fm_v8f v;
+			float lo[4];
+			float hi[4];
+			fm_v4d dlo;
+			fm_v4d dhi;
+			fm_v8i lower;
+			fm_v8i higher;
+
+			memcpy(&v, values + i, sizeof(v));
+			lower = v < vmin;
+			higher = v > vmax;
+			vmin = (fm_v8f)(((fm_v8i) v & lower) | ((fm_v8i) vmin & ~lower));
+			vmax = (fm_v8f)(((fm_v8i) v & higher) | ((fm_v8i) vmax & ~higher));
+
+			/* Sum in double, a float sum drifts over a few thousand values */
+			memcpy(lo, values + i, sizeof(lo));
+			memcpy(hi, values + i + 4, sizeof(hi));
+			dlo = (fm_v4d){ lo[0], lo[1], lo[2], lo[3] };
+			dhi = (fm_v4d){ hi[0], hi[1], hi[2], hi[3] };
+			vsum += dlo + dhi;
+		}
+
+		for(lane = 0; lane < 8; lane++){
+			if(vmin[lane] < min){
+				min = vmin[lane];
+			}
+			if(vmax[lane] > max){
+				max = vmax[lane];
+			}
+		}
+		sum = vsum[0] + vsum[1] + vsum[2] + vsum[3];
+	}
+
+	for(; i < n; i++){
+		if(values[i] < min){
+			min = values[i];
+		}
+		if(values[i] > max){
+			max = values[i];
+		}
+		sum += values[i];
+	}
+
+	if(out->count == 0 || min < out->min){
+		out->min = min;
+	}
+	if(out->count == 0 || max > out->max){
+		out->max = max;
+	}
+	out->sum += sum;
+	out->count += n;
+}
+
+/* Seconds where value > threshold, each sample lasting until the next one (dt) */
+static void
+kernel_above(const float *values, const float *dt, size_t n, float threshold, struct partial_s *out)
+{
+	const fm_v8f vthreshold = { threshold, threshold, threshold, threshold,
+		threshold, threshold, threshold, threshold };
+	fm_v8f vabove = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	fm_v8f vtotal = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	double above = 0.0;
+	double total = 0.0;
+	size_t i = 0;
+	int lane;
+
+	for(; i + 8 <= n; i += 8){
+		fm_v8f v;
+		fm_v8f d;
+		fm_v8i mask;
+
+		memcpy(&v, values + i, sizeof(v));
+		memcpy(&d, dt + i, sizeof(d));
+
+		mask = v > vthreshold;
+		vabove += (fm_v8f)((fm_v8i) d & mask);
+		vtotal += d;
+	}
+
+	for(lane = 0; lane < 8; lane++){
+		above += vabove[lane];
+		total += vtotal[lane];
+	}
+
+	for(; i < n; i++){
+		if(values[i] > threshold){
+			above += dt[i];
+		}
+		total += dt[i];
+	}
+
+	out->above_seconds += above;
+	out->total_seconds += total;
+}
+
+/* k-th smallest of n values, reorders the array */
+static float
+select_kth(float *values, size_t n, size_t k)
+{
+	size_t lo = 0;
+	size_t hi = n - 1;
+
+	while(lo < hi){
+		const float pivot = values[lo + ((hi - lo) / 2)];
+		size_t i = lo;
+		size_t j = hi;
+
+		while(i <= j){
+			while(values[i] < pivot){
+				i++;
+			}
+			while(values[j] > pivot){
+				j--;
+			}
+			if(i <= j){
+				const float tmp = values[i];
+				values[i] = values[j];
+				values[j] = tmp;
+				i++;
+				if(j == 0){
+					break;
+				}
+				j--;
+			}
+		}
+
+		if(k <= j){
+			hi = j;
+		}
+		else if(k >= i){
+			lo = i;
+		}
+		else {
+			break;
+		}
+	}
+
+	return values[k];
+}
+
+/*
+ * Work distribution
+ * */
+
+/* Clip a segment to the job's time range, timestamps are sorted */
+static void
+clip_range(const struct job_s *job, const uint64_t *ts, unsigned int count, size_t *begin, size_t *end)
+{
+	size_t b = 0;
+	size_t e = count;
+
+	while(b < e && ts[b] < job->from){
+		b++;
+	}
+	while(e > b && ts[e - 1] > job->to){
+		e--;
+	}
+
+	*begin = b;
+	*end = e;
+}
+
+static void
+process_item(struct job_s *job, const struct work_item_s *item, struct partial_s *partial, float *scratch)
+{
+	const uint64_t *ts = fm_log_timestamps(item->log, item->segment);
+	const float *values = fm_log_column(item->log, item->segment, job->field);
+	size_t begin;
+	size_t end;
+	size_t i;
+
+	clip_range(job, ts, item->count, &begin, &end);
+	if(begin >= end){
+		return;
+	}
+
+	switch(job->command){
+		case STAT_SUMMARY:
+			kernel_summary(values + begin, end - begin, partial);
+			break;
+
+		case STAT_ABOVE:
+			for(i = begin; i < end; i++){
+				const uint64_t next = (i + 1 < item->count) ? ts[i + 1] : item->next_timestamp;
+				float dt = 0.0f;
+
+				if(next > ts[i] && next <= job->to){
+					dt = (float)((double)(next - ts[i]) / NS_PER_SEC);
+				}
+				/* The logger wasn't running, don't count the gap */
+				scratch[i - begin] = dt > job->max_gap ? 0.0f : dt;
+			}
+			kernel_above(values + begin, scratch, end - begin, job->threshold, partial);
+			break;
+
+		case STAT_PERCENTILE:
+			for(i = begin; i < end; i++){
+				const uint64_t bucket = (ts[i] - job->bucket_base) / job->bucket_width;
+
+				if(job->pass == 0){
+					partial->bucket_counts[bucket]++;
+				}
+				else {
+					const uint64_t slot = __atomic_fetch_add(&job->bucket_fill[bucket], 1, __ATOMIC_RELAXED);
+					job->bucket_values[job->bucket_offsets[bucket] + slot] = values[i];
+				}
+			}
+			break;
+	}
+}
+
+static int
+next_item(struct job_s *job, size_t *item)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&job->lock);
+	if(job->next_item < job->item_count){
+		*item = job->next_item++;
+		found = 1;
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	return found;
+}
+
+struct worker_s {
+	struct job_s *job;
+	int index;
+};
+
+static void*
+worker(void *arg)
+{
+	struct worker_s *self = (struct worker_s*) arg;
+	struct job_s *job = self->job;
+	struct partial_s *partial = &job->partials[self->index];
+	float *scratch;
+	size_t item;
+
+	/* No item holds more than a segment, see add_files() */
+	scratch = (float*) malloc(job->scratch_size * sizeof(float));
+	if(scratch == NULL){
+		pthread_mutex_lock(&job->lock);
+		job->failed = 1;
+		pthread_mutex_unlock(&job->lock);
+		return NULL;
+	}
+
+	while(next_item(job, &item)){
+		process_item(job, &job->items[item], partial, scratch);
+	}
+
+	free(scratch);
+	return NULL;
+}
+
+/* 0, or -1 if a worker couldn't run */
+static int
+run_pass(struct job_s *job)
+{
+	pthread_t *threads = (pthread_t*) calloc(job->threads, sizeof(pthread_t));
+	struct worker_s *workers = (struct worker_s*) calloc(job->threads, sizeof(struct worker_s));
+	int i;
+
+	job->next_item = 0;
+
+	for(i = 0; i < job->threads; i++){
+		workers[i].job = job;
+		workers[i].index = i;
+		pthread_create(&threads[i], NULL, worker, &workers[i]);
+	}
+
+	for(i = 0; i < job->threads; i++){
+		pthread_join(threads[i], NULL);
+	}
+
+	free(workers);
+	free(threads);
+
+	return job->failed ? -1 : 0;
+}
+
+/* Percentiles of each bucket, buckets shared out between threads */
+struct select_worker_s {
+	struct job_s *job;
+	float *results;
+	uint64_t next;
+	pthread_mutex_t *lock;
+};
+
+static void*
+select_worker(void *arg)
+{
+	struct select_worker_s *self = (struct select_worker_s*) arg;
+	struct job_s *job = self->job;
+
+	for(;;){
+		uint64_t bucket;
+		uint64_t n;
+
+		pthread_mutex_lock(self->lock);
+		bucket = self->next++;
+		pthread_mutex_unlock(self->lock);
+
+		if(bucket >= job->bucket_count){
+			break;
+		}
+
+		n = job->bucket_fill[bucket];
+		if(n == 0){
+			continue;
+		}
+
+		self->results[bucket] = select_kth(job->bucket_values + job->bucket_offsets[bucket], n,
+			(uint64_t)((job->percent / 100.0) * (double)(n - 1) + 0.5));
+	}
+
+	return NULL;
+}
+
+/* 0, or -1 if a pass couldn't run */
+static int
+run_percentile(struct job_s *job)
+{
+	int rc = -1;
+	uint64_t first = UINT64_MAX;
+	uint64_t last = 0;
+	uint64_t total = 0;
+	uint64_t b;
+	size_t i;
+	int t;
+	float *results;
+	pthread_t *threads;
+	struct select_worker_s shared;
+	pthread_mutex_t lock;
+
+	/* Bucket range from the segment indexes, no need to touch the data */
+	for(i = 0; i < job->item_count; i++){
+		uint64_t seg_first;
+		uint64_t seg_last;
+
+		fm_log_segment_range(job->items[i].log, job->items[i].segment, &seg_first, &seg_last);
+		if(seg_first < first){
+			first = seg_first < job->from ? job->from : seg_first;
+		}
+		if(seg_last > last){
+			last = seg_last > job->to ? job->to : seg_last;
+		}
+	}
+
+	if(first > last){
+		return 0;
+	}
+
+	job->bucket_base = first - (first % job->bucket_width);
+	job->bucket_count = ((last - job->bucket_base) / job->bucket_width) + 1;
+
+	for(t = 0; t < job->threads; t++){
+		job->partials[t].bucket_counts = (uint64_t*) calloc(job->bucket_count, sizeof(uint64_t));
+	}
+
+	/* Pass one counts, pass two scatters the values into per bucket arrays */
+	job->pass = 0;
+	if(run_pass(job) != 0){
+		goto done;
+	}
+
+	job->bucket_offsets = (uint64_t*) calloc(job->bucket_count, sizeof(uint64_t));
+	job->bucket_fill = (uint64_t*) calloc(job->bucket_count, sizeof(uint64_t));
+
+	for(b = 0; b < job->bucket_count; b++){
+		uint64_t count = 0;
+
+		for(t = 0; t < job->threads; t++){
+			count += job->partials[t].bucket_counts[b];
+		}
+		job->bucket_offsets[b] = total;
+		total += count;
+	}
+
+	job->bucket_values = (float*) malloc((total ? total : 1) * sizeof(float));
+
+	job->pass = 1;
+	if(run_pass(job) != 0){
+		goto done;
+	}
+
+	results = (float*) calloc(job->bucket_count, sizeof(float));
+	threads = (pthread_t*) calloc(job->threads, sizeof(pthread_t));
+	pthread_mutex_init(&lock, NULL);
+
+	shared.job = job;
+	shared.results = results;
+	shared.next = 0;
+	shared.lock = &lock;
+
+	for(t = 0; t < job->threads; t++){
+		pthread_create(&threads[t], NULL, select_worker, &shared);
+	}
+	for(t = 0; t < job->threads; t++){
+		pthread_join(threads[t], NULL);
+	}
+
+	for(b = 0; b < job->bucket_count; b++){
+		const time_t start = (time_t)((job->bucket_base + (b * job->bucket_width)) / NS_PER_SEC);
+		char when[32];
+
+		if(job->bucket_fill[b] == 0){
+			continue;
+		}
+
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&start));
+		printf("%s  p%g %s = %0.2f  (%llu samples)\n", when, job->percent,
+			field_names[job->field], results[b], (unsigned long long) job->bucket_fill[b]);
+	}
+
+	pthread_mutex_destroy(&lock);
+	free(threads);
+	free(results);
+	rc = 0;
+
+done:
+	free(job->bucket_values);
+	free(job->bucket_fill);
+	free(job->bucket_offsets);
+
+	for(t = 0; t < job->threads; t++){
+		free(job->partials[t].bucket_counts);
+	}
+
+	return rc;
+}
+
+/*
+ * Command line
+ * */
+
+static int
+parse_field(const char *name, fm_field *field)
+{
+	int i;
+
+	for(i = 0; i < FM_FIELD_COUNT; i++){
+		if(strcmp(name, field_names[i]) == 0){
+			*field = (fm_field) i;
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "Unknown field %s\n", name);
+	return -1;
+}
+
+static uint64_t
+parse_last(const char *arg)
+{
+	char unit = 's';
+	double amount = 0;
+	uint64_t scale = 1;
+
+	sscanf(arg, "%lf%c", &amount, &unit);
+
+	switch(unit){
+		case 'm':
+			scale = 60;
+			break;
+		case 'h':
+			scale = 3600;
+			break;
+		case 'd':
+			scale = 86400;
+			break;
+	}
+
+	return (uint64_t)(amount * scale * NS_PER_SEC);
+}
+
+/* Build the work list from the log files */
+static int
+add_files(struct job_s *job, int count, char *paths[], fm_log **logs)
+{
+	size_t capacity = 0;
+	int f;
+
+	for(f = 0; f < count; f++){
+		uint64_t records;
+		uint64_t segment;
+		unsigned int per_segment;
+
+		logs[f] = fm_log_open(paths[f]);
+		if(logs[f] == NULL){
+			fprintf(stderr, "Can't open log %s\n", paths[f]);
+			return -1;
+		}
+
+		records = fm_log_refresh(logs[f]);
+		per_segment = fm_log_segment_records(logs[f]);
+		if(per_segment > job->scratch_size){
+			job->scratch_size = per_segment;
+		}
+
+		for(segment = 0; segment * per_segment < records; segment++){
+			struct work_item_s *item;
+			uint64_t first;
+			uint64_t last;
+
+			/* Skip whole segments outside the range using the index */
+			fm_log_segment_range(logs[f], segment, &first, &last);
+			if(last < job->from || first > job->to){
+				continue;
+			}
+
+			if(job->item_count == capacity){
+				capacity = capacity ? capacity * 2 : 256;
+				job->items = (struct work_item_s*) realloc(job->items, capacity * sizeof(struct work_item_s));
+			}
+
+			item = &job->items[job->item_count++];
+			item->log = logs[f];
+			item->segment = segment;
+			item->count = (unsigned int)(records - (segment * per_segment) < per_segment ?
+				records - (segment * per_segment) : per_segment);
+			item->next_timestamp = ((segment + 1) * per_segment < records) ?
+				fm_log_timestamps(logs[f], segment + 1)[0] : 0;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct job_s job;
+	fm_log **logs;
+	int rc = 0;
+	int first_file;
+	int opt;
+	int files;
+	int i;
+
+	if(argc >= 2 && strcmp(argv[1], "record") == 0){
+		return record(argc - 1, argv + 1);
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.from = 0;
+	job.to = UINT64_MAX;
+	job.max_gap = 10.0f;
+	job.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+	while((opt = getopt(argc, argv, "j:f:t:l:g:")) != -1){
+		switch(opt){
+			case 'j':
+				job.threads = atoi(optarg);
+				break;
+			case 'f':
+				job.from = (uint64_t) strtoull(optarg, NULL, 10) * NS_PER_SEC;
+				break;
+			case 't':
+				job.to = (uint64_t) strtoull(optarg, NULL, 10) * NS_PER_SEC;
+				break;
+			case 'l':
+				job.from = ((uint64_t) time(NULL) * NS_PER_SEC) - parse_last(optarg);
+				break;
+			case 'g':
+				job.max_gap = (float) atof(optarg);
+				break;
+			default:
+				return usage();
+		}
+	}
+
+	if(job.threads < 1){
+		job.threads = 1;
+	}
+
+	if(argc - optind < 3){
+		return usage();
+	}
+
+	if(strcmp(argv[optind], "summary") == 0){
+		job.command = STAT_SUMMARY;
+		first_file = optind + 2;
+	}
+	else if(strcmp(argv[optind], "above") == 0 && argc - optind >= 4){
+		job.command = STAT_ABOVE;
+		job.threshold = (float) atof(argv[optind + 2]);
+		first_file = optind + 3;
+	}
+	else if(strcmp(argv[optind], "percentile") == 0 && argc - optind >= 5){
+		job.command = STAT_PERCENTILE;
+		job.percent = atof(argv[optind + 2]);
+		job.bucket_width = (uint64_t)(atof(argv[optind + 3]) * NS_PER_SEC);
+		first_file = optind + 4;
+
+		if(job.bucket_width == 0 || job.percent < 0.0 || job.percent > 100.0){
+			return usage();
+		}
+	}
+	else {
+		return usage();
+	}
+
+	if(parse_field(argv[optind + 1], &job.field) != 0){
+		return 1;
+	}
+
+	files = argc - first_file;
+	logs = (fm_log**) calloc(files, sizeof(fm_log*));
+	job.partials = (struct partial_s*) calloc(job.threads, sizeof(struct partial_s));
+	pthread_mutex_init(&job.lock, NULL);
+
+	if(add_files(&job, files, argv + first_file, logs) != 0){
+		return 1;
+	}
+
+	if(job.command == STAT_PERCENTILE){
+		rc = run_percentile(&job);
+	}
+	else if(run_pass(&job) != 0){
+		rc = -1;
+	}
+	else {
+		struct partial_s total;
+
+		memset(&total, 0, sizeof(total));
+		for(i = 0; i < job.threads; i++){
+			const struct partial_s *p = &job.partials[i];
+
+			if(p->count > 0){
+				if(total.count == 0 || p->min < total.min){
+					total.min = p->min;
+				}
+				if(total.count == 0 || p->max > total.max){
+					total.max = p->max;
+				}
+			}
+			total.sum += p->sum;
+			total.count += p->count;
+			total.above_seconds += p->above_seconds;
+			total.total_seconds += p->total_seconds;
+		}
+
+		if(job.command == STAT_SUMMARY){
+			printf("%s: min %0.2f  max %0.2f  mean %0.2f  (%llu samples)\n",
+				field_names[job.field], total.min, total.max,
+				total.count ? total.sum / (double) total.count : 0.0,
+				(unsigned long long) total.count);
+		}
+		else {
+			printf("%s > %g: %0.0f of %0.0f seconds (%0.2f%%)\n",
+				field_names[job.field], job.threshold, total.above_seconds, total.total_seconds,
+				total.total_seconds > 0.0 ? 100.0 * total.above_seconds / total.total_seconds : 0.0);
+		}
+	}
+
+	if(rc != 0){
+		fprintf(stderr, "Out of memory\n");
+	}
+
+	for(i = 0; i < files; i++){
+		fm_log_close(logs[i]);
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	free(job.partials);
+	free(job.items);
+	free(logs);
+
+	return rc != 0;
+}
+
+/* Cleared by SIGINT or SIGTERM to stop recording */
+static volatile sig_atomic_t recording = 1;
+
+static void
+stop_recording(int signum)
+{
+	(void) signum;
+	recording = 0;
+}
+
+/* Poll a controller and append every sample to a log */
+static int
+record(int argc, char *argv[])
+{
+	flowmaster *fm;
+	fm_log *log;
+	int interval_ms = 500;
+	struct timespec delay;
+	struct sigaction action;
+
+	if(argc < 3){
+		return usage();
+	}
+
+	if(argc >= 4){
+		interval_ms = atoi(argv[3]);
+		if(interval_ms < 500){
+			interval_ms = 500;
+		}
+	}
+
+	fm = fm_create();
+	if(fm_connect(fm, argv[1]) != FM_OK){
+		fprintf(stderr, "Failed to open port %s\n", argv[1]);
+		fm_destroy(fm);
+		return 1;
+	}
+
+	log = fm_log_create(argv[2]);
+	if(log == NULL){
+		fprintf(stderr, "Failed to open log %s\n", argv[2]);
+		fm_destroy(fm);
+		return 1;
+	}
+
+	/* No SA_RESTART, the signal cuts the sleep short */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stop_recording;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	fm_attach_log(fm, log);
+
+	delay.tv_sec = interval_ms / 1000;
+	delay.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+	while(recording){
+		if(fm_update_status(fm) != FM_OK){
+			fprintf(stderr, "Status update failed\n");
+		}
+		nanosleep(&delay, NULL);
+	}
+
+	fm_attach_log(fm, NULL);
+	fm_log_close(log);
+	fm_destroy(fm);
+
+	return 0;
+}
+
+static int
+usage(void)
+{
+	fprintf(stderr,
+		"usage: fmstat record <port> <logfile> [interval_ms]\n"
+		"       fmstat [-j threads] [-f from] [-t to] [-l last] [-g max_gap] summary <field> <logfile>...\n"
+		"       fmstat [options] above <field> <threshold> <logfile>...\n"
+		"       fmstat [options] percentile <field> <percent> <bucket_seconds> <logfile>...\n"
+		"fields: fan_duty pump_duty ambient coolant flow fan_rpm pump_rpm\n");
+	return 1;
+}
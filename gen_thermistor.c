@@ -0,0 +1,32 @@
+#include <stdio.h>
+
+#include "flowmaster_private.h"
+
+/*
+ * Writes thermistor_table.h, the conversion table for the default
+ * probe parameters.  Built and run by the Makefile:
+ *
+ *   gen_thermistor > thermistor_table.h
+ * */
+
+int main(void)
+{
+	float table[FM_THERMISTOR_TABLE_SIZE];
+	fm_thermistor params;
+	int i;
+
+	fm_thermistor_defaults(&params);
+	fm_thermistor_table(&params, table);
+
+	printf("/* Generated by gen_thermistor.c, do not edit */\n");
+	printf("static const float fm_thermistor_default_table[FM_THERMISTOR_TABLE_SIZE] = {\n");
+
+	for(i = 0; i < FM_THERMISTOR_TABLE_SIZE; i++){
+		printf("%s%.9gf%s", (i % 4) == 0 ? "\t" : " ", table[i],
+			i == FM_THERMISTOR_TABLE_SIZE - 1 ? "\n" : ((i % 4) == 3 ? ",\n" : ","));
+	}
+
+	printf("};\n");
+
+	return 0;
+}
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
+
+/*
+ * Adaptive polling.
+ *
+ * After each sample the governor looks at how quickly things are moving.
+ * While every smoothed rate of change is under its threshold the poll
+ * interval grows by the backoff factor each poll, up to the maximum.  As
+ * soon as anything moves, a setpoint is written or an alarm is raised,
+ * the interval drops straight back to the minimum.
+ * */
+
+#define FM_MS 1000000ull
+
+struct fm_governor_s {
+	fm_mutex lock;
+	fm_governor_config config;
+	unsigned int interval_ms;
+	uint64_t last_poll;
+
+	/* Smoothed rates of change of the fields we watch */
+	fm_filter *rates;
+};
+
+void
+fm_governor_defaults(fm_governor_config *config)
+{
+	config->min_interval_ms = 500;
+	config->max_interval_ms = 5000;
+	config->backoff = 1.5f;
+	config->temp_rate = 0.05f;
+	config->rpm_rate = 60.0f;
+}
+
+fm_rc
+fm_set_governor(flowmaster *fm, const fm_governor_config *config)
+{
+	fm_governor *governor = fm->governor;
+
+	if(config == NULL){
+		/* The publish path may still be looking at it, so keep it but switch it off */
+		if(governor != NULL){
+			fm_mutex_lock(&governor->lock);
+			governor->config.max_interval_ms = governor->config.min_interval_ms;
+			governor->interval_ms = governor->config.min_interval_ms;
+			fm_mutex_unlock(&governor->lock);
+		}
+		return FM_OK;
+	}
+
+	if(config->min_interval_ms < 500 || config->max_interval_ms < config->min_interval_ms
+		|| config->backoff < 1.0f){
+		return FM_BAD_ARGUMENT;
+	}
+
+	if(governor == NULL){
+		governor = (fm_governor*) calloc(1, sizeof(fm_governor));
+		if(governor == NULL){
+			return FM_NO_MEMORY;
+		}
+
+		governor->rates = fm_filter_create();
+		if(governor->rates == NULL){
+			free(governor);
+			return FM_NO_MEMORY;
+		}
+
+		fm_mutex_init(&governor->lock);
+	}
+
+	fm_mutex_lock(&governor->lock);
+
+	governor->config = *config;
+	governor->interval_ms = config->min_interval_ms;
+
+	/* Slopes over a couple of seconds, so RPM quantisation doesn't look like movement */
+	fm_filter_configure(governor->rates, FM_FIELD_COOLANT_TEMP, 1, 0.0, 2.0);
+	fm_filter_configure(governor->rates, FM_FIELD_AMBIENT_TEMP, 1, 0.0, 2.0);
+	fm_filter_configure(governor->rates, FM_FIELD_FAN_RPM, 3, 0.0, 2.0);
+	fm_filter_configure(governor->rates, FM_FIELD_PUMP_RPM, 3, 0.0, 2.0);
+
+	fm_mutex_unlock(&governor->lock);
+
+	fm->governor = governor;
+
+	return FM_OK;
+}
+
+void
+fm_governor_destroy(fm_governor *governor)
+{
+	if(governor == NULL){
+		return;
+	}
+
+	fm_filter_destroy(governor->rates);
+	fm_mutex_destroy(&governor->lock);
+	free(governor);
+}
+
+static double
+fm_governor_rate(fm_governor *governor, fm_field field)
+{
+	double value;
+	double slope;
+
+	fm_filter_get(governor->rates, field, &value, &slope);
+
+	return fabs(slope);
+}
+
+void
+fm_governor_observe(flowmaster *fm, const fm_sample *sample)
+{
+	fm_governor *governor = fm->governor;
+	const fm_governor_config *config = &governor->config;
+	int moving;
+
+	fm_mutex_lock(&governor->lock);
+
+	fm_filter_add(governor->rates, sample);
+
+	moving = fm_governor_rate(governor, FM_FIELD_COOLANT_TEMP) > config->temp_rate
+		|| fm_governor_rate(governor, FM_FIELD_AMBIENT_TEMP) > config->temp_rate
+		|| fm_governor_rate(governor, FM_FIELD_FAN_RPM) > config->rpm_rate
+		|| fm_governor_rate(governor, FM_FIELD_PUMP_RPM) > config->rpm_rate;
+
+	if(moving){
+		governor->interval_ms = config->min_interval_ms;
+	}
+	else {
+		const double next = governor->interval_ms * (double) config->backoff;
+
+		governor->interval_ms = next > config->max_interval_ms ?
+			config->max_interval_ms : (unsigned int) next;
+	}
+
+	governor->last_poll = sample->timestamp;
+
+	fm_mutex_unlock(&governor->lock);
+}
+
+void
+fm_governor_kick(flowmaster *fm)
+{
+	fm_governor *governor = fm->governor;
+
+	if(governor == NULL){
+		return;
+	}
+
+	fm_mutex_lock(&governor->lock);
+	governor->interval_ms = governor->config.min_interval_ms;
+	fm_mutex_unlock(&governor->lock);
+}
+
+uint64_t
+fm_poll_deadline(flowmaster *fm)
+{
+	fm_governor *governor = fm->governor;
+	uint64_t deadline;
+
+	if(governor == NULL){
+		/* The fixed 500ms from whenever the latest sample came in */
+		return fm_load64(&fm->frame.timestamp) + (500 * FM_MS);
+	}
+
+	fm_mutex_lock(&governor->lock);
+	deadline = governor->last_poll + (governor->interval_ms * FM_MS);
+	fm_mutex_unlock(&governor->lock);
+
+	return deadline;
+}
+
+unsigned int
+fm_poll_interval(flowmaster *fm)
+{
+	unsigned int interval = 500;
+
+	if(fm->governor != NULL){
+		fm_mutex_lock(&fm->governor->lock);
+		interval = fm->governor->interval_ms;
+		fm_mutex_unlock(&fm->governor->lock);
+	}
+
+	return interval;
+}
+
+fm_rc
+fm_governed_update(flowmaster *fm)
+{
+	const uint64_t deadline = fm_poll_deadline(fm);
+
+	if(deadline > fm_monotonic_ns()){
+		fm_sleep_until(deadline);
+	}
+
+	return fm_update_status(fm);
+}
@@ -0,0 +1,678 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "flowmaster_private.h"
+
+/*
+ * Compressed sample history.
+ *
+ * Samples are stored in fixed size blocks.  Each block is a bit stream
+ * that starts from scratch, so it can be decoded on its own and thrown
+ * away on its own.  The first sample of a block has its timestamp in the
+ * block header and every value written out whole, after that:
+ *
+ * timestamps, in milliseconds, as the change in interval (delta-of-delta)
+ *   '0'                  same interval as last time
+ *   '10'   + 7 bits      -63..64
+ *   '110'  + 9 bits      -255..256
+ *   '1110' + 12 bits     -2047..2048
+ *   '1111' + 32 bits     anything else
+ *
+ * floats, XOR'd with the previous value
+ *   '0'                  unchanged
+ *   '10'   + bits        fits the previous window of meaningful bits
+ *   '11'   + 5 bits leading zeros + 5 bits length - 1 + bits
+ *
+ * integers, zig-zag encoded difference from the previous value
+ *   '0'                  unchanged
+ *   '10'   + 8 bits
+ *   '110'  + 16 bits
+ *   '111'  + 32 bits
+ *
+ * Each block also keeps the min, max and sum of every field, so stats
+ * over a range only have to decode the blocks at either end.
+ * */
+
+#define FM_HISTORY_BLOCK_BYTES 4096
+
+/* Worst case for one sample, a block is closed when less than this is left */
+#define FM_HISTORY_MAX_SAMPLE_BITS (36 + (FM_FIELD_COUNT * 44))
+
+/* Gaps longer than this start a new block so the deltas stay in 32 bits */
+#define FM_HISTORY_MAX_GAP_MS 0x3FFFFFFF
+
+/* State that the encoder and decoder both track as they go */
+struct fm_coder_s {
+	uint64_t ms;
+	int64_t delta;
+	uint32_t value[FM_FIELD_COUNT];
+	int lead[FM_FIELD_COUNT];
+	int trail[FM_FIELD_COUNT];
+};
+
+struct fm_block_s {
+	struct fm_block_s *next;
+	uint64_t first_ms;
+	uint64_t last_ms;
+	unsigned long count;
+
+	double min[FM_FIELD_COUNT];
+	double max[FM_FIELD_COUNT];
+	double sum[FM_FIELD_COUNT];
+
+	/* Only meaningful while this is the newest block */
+	struct fm_coder_s encoder;
+
+	size_t bits;
+	unsigned char data[FM_HISTORY_BLOCK_BYTES];
+};
+
+struct fm_history_s {
+	fm_mutex lock;
+	struct fm_block_s *oldest;
+	struct fm_block_s *newest;
+	size_t block_count;
+	size_t max_blocks;
+	unsigned long count;
+};
+
+struct fm_reader_s {
+	const struct fm_block_s *block;
+	size_t pos;
+	unsigned long index;
+	struct fm_coder_s state;
+};
+
+static int
+fm_field_is_float(int field)
+{
+	return field < FM_FIELD_FAN_RPM;
+}
+
+static int
+fm_clz32(uint32_t value)
+{
+	int count = 0;
+
+	while(!(value & 0x80000000u)){
+		value <<= 1;
+		count++;
+	}
+	return count;
+}
+
+static int
+fm_ctz32(uint32_t value)
+{
+	int count = 0;
+
+	while(!(value & 1)){
+		value >>= 1;
+		count++;
+	}
+	return count;
+}
+
+/* Values are stored as their 32 bit pattern, float bits or two's complement */
+static void
+fm_history_pack(const fm_data *data, uint32_t *value)
+{
+	int i;
+
+	for(i = 0; i < FM_FIELD_COUNT; i++){
+		if(fm_field_is_float(i)){
+			const float f = (float) fm_data_field(data, (fm_field) i);
+			memcpy(&value[i], &f, sizeof(f));
+		}
+		else {
+			value[i] = (uint32_t)(int32_t) fm_data_field(data, (fm_field) i);
+		}
+	}
+}
+
+static double
+fm_history_value(const uint32_t *value, int field)
+{
+	float f;
+
+	if(fm_field_is_float(field)){
+		memcpy(&f, &value[field], sizeof(f));
+		return f;
+	}
+	return (int32_t) value[field];
+}
+
+static void
+fm_history_unpack(const uint32_t *value, fm_data *data)
+{
+	data->fan_duty_cycle  = (float) fm_history_value(value, FM_FIELD_FAN_DUTY_CYCLE);
+	data->pump_duty_cycle = (float) fm_history_value(value, FM_FIELD_PUMP_DUTY_CYCLE);
+	data->ambient_temp    = (float) fm_history_value(value, FM_FIELD_AMBIENT_TEMP);
+	data->coolant_temp    = (float) fm_history_value(value, FM_FIELD_COOLANT_TEMP);
+	data->flow_rate       = (float) fm_history_value(value, FM_FIELD_FLOW_RATE);
+	data->fan_rpm         = (int) fm_history_value(value, FM_FIELD_FAN_RPM);
+	data->pump_rpm        = (int) fm_history_value(value, FM_FIELD_PUMP_RPM);
+}
+
+/*
+ * Bit stream writer, most significant bit first
+ * */
+
+static void
+fm_put_bits(struct fm_block_s *block, uint32_t value, int count)
+{
+	while(count > 0){
+		const int free_bits = 8 - (int)(block->bits & 7);
+		const int take = count < free_bits ? count : free_bits;
+		const uint32_t chunk = (value >> (count - take)) & ((1u << take) - 1);
+
+		block->data[block->bits >> 3] |= (unsigned char)(chunk << (free_bits - take));
+		block->bits += take;
+		count -= take;
+	}
+}
+
+static void
+fm_put_timestamp(struct fm_block_s *block, int64_t dod)
+{
+	if(dod == 0){
+		fm_put_bits(block, 0x0, 1);
+	}
+	else if(dod >= -63 && dod <= 64){
+		fm_put_bits(block, 0x2, 2);
+		fm_put_bits(block, (uint32_t)(dod + 63), 7);
+	}
+	else if(dod >= -255 && dod <= 256){
+		fm_put_bits(block, 0x6, 3);
+		fm_put_bits(block, (uint32_t)(dod + 255), 9);
+	}
+	else if(dod >= -2047 && dod <= 2048){
+		fm_put_bits(block, 0xE, 4);
+		fm_put_bits(block, (uint32_t)(dod + 2047), 12);
+	}
+	else {
+		fm_put_bits(block, 0xF, 4);
+		fm_put_bits(block, (uint32_t)(int32_t) dod, 32);
+	}
+}
+
+static void
+fm_put_xor(struct fm_block_s *block, struct fm_coder_s *coder, int field, uint32_t value)
+{
+	const uint32_t xor = value ^ coder->value[field];
+	int lead;
+	int trail;
+	int length;
+
+	if(xor == 0){
+		fm_put_bits(block, 0x0, 1);
+		return;
+	}
+
+	lead = fm_clz32(xor);
+	trail = fm_ctz32(xor);
+
+	if(coder->lead[field] >= 0 && lead >= coder->lead[field] && trail >= coder->trail[field]){
+		/* Reuse the previous window */
+		length = 32 - coder->lead[field] - coder->trail[field];
+		fm_put_bits(block, 0x2, 2);
+		fm_put_bits(block, xor >> coder->trail[field], length);
+		return;
+	}
+
+	length = 32 - lead - trail;
+	fm_put_bits(block, 0x3, 2);
+	fm_put_bits(block, (uint32_t) lead, 5);
+	fm_put_bits(block, (uint32_t)(length - 1), 5);
+	fm_put_bits(block, xor >> trail, length);
+
+	coder->lead[field] = lead;
+	coder->trail[field] = trail;
+}
+
+static void
+fm_put_delta(struct fm_block_s *block, uint32_t value, uint32_t previous)
+{
+	const int32_t delta = (int32_t)(value - previous);
+	const uint32_t zigzag = ((uint32_t) delta << 1) ^ (uint32_t)(delta >> 31);
+
+	if(delta == 0){
+		fm_put_bits(block, 0x0, 1);
+	}
+	else if(zigzag < 0x100){
+		fm_put_bits(block, 0x2, 2);
+		fm_put_bits(block, zigzag, 8);
+	}
+	else if(zigzag < 0x10000){
+		fm_put_bits(block, 0x6, 3);
+		fm_put_bits(block, zigzag, 16);
+	}
+	else {
+		fm_put_bits(block, 0x7, 3);
+		fm_put_bits(block, zigzag, 32);
+	}
+}
+
+static void
+fm_encode_sample(struct fm_block_s *block, uint64_t ms, const uint32_t *value)
+{
+	struct fm_coder_s *coder = &block->encoder;
+	int i;
+
+	if(block->count == 0){
+		block->first_ms = ms;
+		coder->delta = 0;
+
+		for(i = 0; i < FM_FIELD_COUNT; i++){
+			fm_put_bits(block, value[i], 32);
+			coder->lead[i] = -1;
+			coder->trail[i] = 0;
+		}
+	}
+	else {
+		const int64_t delta = (int64_t)(ms - coder->ms);
+
+		fm_put_timestamp(block, delta - coder->delta);
+		coder->delta = delta;
+
+		for(i = 0; i < FM_FIELD_COUNT; i++){
+			if(fm_field_is_float(i)){
+				fm_put_xor(block, coder, i, value[i]);
+			}
+			else {
+				fm_put_delta(block, value[i], coder->value[i]);
+			}
+		}
+	}
+
+	coder->ms = ms;
+	memcpy(coder->value, value, sizeof(coder->value));
+
+	for(i = 0; i < FM_FIELD_COUNT; i++){
+		const double v = fm_history_value(value, i);
+
+		if(block->count == 0 || v < block->min[i]){
+			block->min[i] = v;
+		}
+		if(block->count == 0 || v > block->max[i]){
+			block->max[i] = v;
+		}
+		block->sum[i] += v;
+	}
+
+	block->last_ms = ms;
+	block->count++;
+}
+
+/*
+ * Bit stream reader, mirrors the writer
+ * */
+
+static uint32_t
+fm_get_bits(struct fm_reader_s *reader, int count)
+{
+	uint32_t value = 0;
+
+	while(count > 0){
+		const int avail = 8 - (int)(reader->pos & 7);
+		const int take = count < avail ? count : avail;
+		const uint32_t byte = reader->block->data[reader->pos >> 3];
+
+		value = (value << take) | ((byte >> (avail - take)) & ((1u << take) - 1));
+		reader->pos += take;
+		count -= take;
+	}
+	return value;
+}
+
+static int64_t
+fm_get_timestamp(struct fm_reader_s *reader)
+{
+	if(fm_get_bits(reader, 1) == 0){
+		return 0;
+	}
+	if(fm_get_bits(reader, 1) == 0){
+		return (int64_t) fm_get_bits(reader, 7) - 63;
+	}
+	if(fm_get_bits(reader, 1) == 0){
+		return (int64_t) fm_get_bits(reader, 9) - 255;
+	}
+	if(fm_get_bits(reader, 1) == 0){
+		return (int64_t) fm_get_bits(reader, 12) - 2047;
+	}
+	return (int32_t) fm_get_bits(reader, 32);
+}
+
+static void
+fm_get_xor(struct fm_reader_s *reader, int field)
+{
+	struct fm_coder_s *coder = &reader->state;
+	int length;
+
+	if(fm_get_bits(reader, 1) == 0){
+		return;
+	}
+
+	if(fm_get_bits(reader, 1) != 0){
+		coder->lead[field] = (int) fm_get_bits(reader, 5);
+		length = (int) fm_get_bits(reader, 5) + 1;
+		coder->trail[field] = 32 - coder->lead[field] - length;
+	}
+	else {
+		length = 32 - coder->lead[field] - coder->trail[field];
+	}
+
+	coder->value[field] ^= fm_get_bits(reader, length) << coder->trail[field];
+}
+
+static void
+fm_get_delta(struct fm_reader_s *reader, int field)
+{
+	uint32_t zigzag;
+
+	if(fm_get_bits(reader, 1) == 0){
+		return;
+	}
+
+	if(fm_get_bits(reader, 1) == 0){
+		zigzag = fm_get_bits(reader, 8);
+	}
+	else if(fm_get_bits(reader, 1) == 0){
+		zigzag = fm_get_bits(reader, 16);
+	}
+	else {
+		zigzag = fm_get_bits(reader, 32);
+	}
+
+	reader->state.value[field] += (zigzag >> 1) ^ (0u - (zigzag & 1));
+}
+
+static void
+fm_reader_init(struct fm_reader_s *reader, const struct fm_block_s *block)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->block = block;
+}
+
+/* Decode the next sample into reader->state */
+static void
+fm_reader_next(struct fm_reader_s *reader)
+{
+	struct fm_coder_s *state = &reader->state;
+	int i;
+
+	if(reader->index == 0){
+		state->ms = reader->block->first_ms;
+		state->delta = 0;
+
+		for(i = 0; i < FM_FIELD_COUNT; i++){
+			state->value[i] = fm_get_bits(reader, 32);
+		}
+	}
+	else {
+		state->delta += fm_get_timestamp(reader);
+		state->ms += state->delta;
+
+		for(i = 0; i < FM_FIELD_COUNT; i++){
+			if(fm_field_is_float(i)){
+				fm_get_xor(reader, i);
+			}
+			else {
+				fm_get_delta(reader, i);
+			}
+		}
+	}
+
+	reader->index++;
+}
+
+/*
+ * Public interface
+ * */
+
+fm_history*
+fm_history_create(size_t max_bytes)
+{
+	fm_history *history = (fm_history*) calloc(1, sizeof(fm_history));
+
+	if(history == NULL){
+		return NULL;
+	}
+
+	history->max_blocks = max_bytes / sizeof(struct fm_block_s);
+	if(history->max_blocks == 0){
+		history->max_blocks = 1;
+	}
+
+	fm_mutex_init(&history->lock);
+
+	return history;
+}
+
+void
+fm_history_destroy(fm_history *history)
+{
+	struct fm_block_s *block;
+
+	if(history == NULL){
+		return;
+	}
+
+	while((block = history->oldest) != NULL){
+		history->oldest = block->next;
+		free(block);
+	}
+
+	fm_mutex_destroy(&history->lock);
+	free(history);
+}
+
+/* Start a new block, recycling the oldest one when we are at the limit */
+static struct fm_block_s*
+fm_history_new_block(fm_history *history)
+{
+	struct fm_block_s *block;
+
+	if(history->block_count >= history->max_blocks){
+		block = history->oldest;
+		history->oldest = block->next;
+		history->count -= block->count;
+		history->block_count--;
+
+		if(history->newest == block){
+			history->newest = NULL;
+		}
+
+		memset(block, 0, sizeof(*block));
+	}
+	else {
+		block = (struct fm_block_s*) calloc(1, sizeof(struct fm_block_s));
+		if(block == NULL){
+			return NULL;
+		}
+	}
+
+	if(history->newest != NULL){
+		history->newest->next = block;
+	}
+	else {
+		history->oldest = block;
+	}
+
+	history->newest = block;
+	history->block_count++;
+
+	return block;
+}
+
+fm_rc
+fm_history_append(fm_history *history, const fm_sample *sample)
+{
+	struct fm_block_s *block;
+	uint32_t value[FM_FIELD_COUNT];
+	uint64_t ms = sample->timestamp / 1000000;
+
+	fm_history_pack(&sample->data, value);
+
+	fm_mutex_lock(&history->lock);
+
+	block = history->newest;
+
+	/* Out of order samples are squashed onto the last timestamp */
+	if(block != NULL && block->count > 0 && ms < block->last_ms){
+		ms = block->last_ms;
+	}
+
+	if(block == NULL
+		|| (block->bits + FM_HISTORY_MAX_SAMPLE_BITS) > (FM_HISTORY_BLOCK_BYTES * 8)
+		|| (block->count > 0 && (ms - block->last_ms) > FM_HISTORY_MAX_GAP_MS)){
+
+		if((block = fm_history_new_block(history)) == NULL){
+			fm_mutex_unlock(&history->lock);
+			return FM_NO_MEMORY;
+		}
+	}
+
+	fm_encode_sample(block, ms, value);
+	history->count++;
+
+	fm_mutex_unlock(&history->lock);
+
+	return FM_OK;
+}
+
+unsigned long
+fm_history_scan(fm_history *history, uint64_t from, uint64_t to, fm_history_callback cb, void *userdata)
+{
+	const struct fm_block_s *block;
+	struct fm_reader_s reader;
+	fm_sample sample;
+	unsigned long visited = 0;
+
+	fm_mutex_lock(&history->lock);
+
+	for(block = history->oldest; block != NULL; block = block->next){
+		if((block->last_ms * 1000000) < from || (block->first_ms * 1000000) > to){
+			continue;
+		}
+
+		fm_reader_init(&reader, block);
+
+		while(reader.index < block->count){
+			fm_reader_next(&reader);
+
+			sample.timestamp = reader.state.ms * 1000000;
+			sample.request_time = 0;
+			if(sample.timestamp < from){
+				continue;
+			}
+			if(sample.timestamp > to){
+				break;
+			}
+
+			fm_history_unpack(reader.state.value, &sample.data);
+			cb(&sample, userdata);
+			visited++;
+		}
+	}
+
+	fm_mutex_unlock(&history->lock);
+
+	return visited;
+}
+
+static void
+fm_stats_add(fm_stats *stats, double *sum, double min, double max, double total, unsigned long count)
+{
+	if(count == 0){
+		return;
+	}
+
+	if(stats->count == 0 || min < stats->min){
+		stats->min = min;
+	}
+	if(stats->count == 0 || max > stats->max){
+		stats->max = max;
+	}
+
+	*sum += total;
+	stats->count += count;
+}
+
+void
+fm_history_stats(fm_history *history, fm_field field, uint64_t from, uint64_t to, fm_stats *stats)
+{
+	const struct fm_block_s *block;
+	struct fm_reader_s reader;
+	double sum = 0.0;
+
+	memset(stats, 0, sizeof(*stats));
+
+	fm_mutex_lock(&history->lock);
+
+	for(block = history->oldest; block != NULL; block = block->next){
+		const uint64_t first = block->first_ms * 1000000;
+		const uint64_t last = block->last_ms * 1000000;
+
+		if(last < from || first > to){
+			continue;
+		}
+
+		if(first >= from && last <= to){
+			/* The whole block is in range, no need to decode it */
+			fm_stats_add(stats, &sum, block->min[field], block->max[field], block->sum[field], block->count);
+			continue;
+		}
+
+		fm_reader_init(&reader, block);
+
+		while(reader.index < block->count){
+			uint64_t timestamp;
+			double value;
+
+			fm_reader_next(&reader);
+
+			timestamp = reader.state.ms * 1000000;
+			if(timestamp < from){
+				continue;
+			}
+			if(timestamp > to){
+				break;
+			}
+
+			value = fm_history_value(reader.state.value, field);
+			fm_stats_add(stats, &sum, value, value, value, 1);
+		}
+	}
+
+	fm_mutex_unlock(&history->lock);
+
+	if(stats->count > 0){
+		stats->mean = sum / (double) stats->count;
+	}
+}
+
+unsigned long
+fm_history_count(fm_history *history)
+{
+	unsigned long count;
+
+	fm_mutex_lock(&history->lock);
+	count = history->count;
+	fm_mutex_unlock(&history->lock);
+
+	return count;
+}
+
+size_t
+fm_history_bytes(fm_history *history)
+{
+	size_t bytes;
+
+	fm_mutex_lock(&history->lock);
+	bytes = sizeof(fm_history) + (history->block_count * sizeof(struct fm_block_s));
+	fm_mutex_unlock(&history->lock);
+
+	return bytes;
+}
@@ -0,0 +1,306 @@
+#include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
+
+/*
+ * The I/O thread.
+ *
+ * Each connected handle has one thread that owns the port.  Callers
+ * never touch the write and read buffers themselves, they describe the
+ * transaction as a request on their own stack, push it onto the handle's
+ * queue and sleep on the request's own completion until the I/O thread
+ * has run it.
+ *
+ * The queue is an intrusive multi producer, single consumer list: a push
+ * is one atomic exchange, and the I/O thread takes requests off it
+ * without any lock, so callers never wait on each other, only on the
+ * controller.  When the thread has nothing to do it blocks on io_wake,
+ * and on the port as well while streaming, and callers only signal
+ * io_wake if it has gone to sleep.  Each caller is counted in
+ * io_callers from before it checks io_running until it has its
+ * answer, and the thread doesn't exit while any are counted, so a push
+ * can't be left behind by fm_io_stop().  The I/O thread drains the
+ * queue into one list per priority class and always runs the oldest request of the most
+ * urgent class next, so a realtime command waits behind at most the one
+ * transaction already on the wire.  Bulk transfers queue one segment at
+ * a time to let anything more urgent in between.
+ * */
+
+#define FM_LINK(ptr) ((void *volatile*) &(ptr))
+
+static void fm_io_thread(void *arg);
+static void fm_io_wake(flowmaster *fm);
+
+void
+fm_io_init(flowmaster *fm)
+{
+	fm->io_wake_ready = fm_event_create(&fm->io_wake) == 0;
+	fm_mutex_init(&fm->io_done_lock);
+	fm_mutex_init(&fm->bulk_lock);
+
+	fm->io_stub.next = NULL;
+	fm->io_head = &fm->io_stub;
+	fm->io_tail = &fm->io_stub;
+}
+
+void
+fm_io_destroy(flowmaster *fm)
+{
+	fm_mutex_destroy(&fm->bulk_lock);
+	fm_mutex_destroy(&fm->io_done_lock);
+	if(fm->io_wake_ready){
+		fm_event_destroy(fm->io_wake);
+	}
+}
+
+fm_rc
+fm_io_start(flowmaster *fm)
+{
+	if(fm->io_running){
+		return FM_OK;
+	}
+
+	if(!fm->io_wake_ready){
+		return FM_THREAD_ERROR;
+	}
+
+	fm_store_release(&fm->io_running, 1);
+
+	if(fm_thread_start(&fm->io_thread, fm_io_thread, fm) != 0){
+		fm->io_running = 0;
+		return FM_THREAD_ERROR;
+	}
+
+	return FM_OK;
+}
+
+void
+fm_io_stop(flowmaster *fm)
+{
+	if(!fm->io_running){
+		return;
+	}
+
+	fm_store_release(&fm->io_running, 0);
+	fm_io_wake(fm);
+
+	/* Anything already queued, or being queued, is run before the thread exits */
+	fm_thread_join(fm->io_thread);
+}
+
+/* Wake the thread up if it's asleep, after a push or a change of io_running */
+static void
+fm_io_wake(flowmaster *fm)
+{
+	/* Pairs with the fence in fm_io_thread(), one of us sees the other */
+	fm_fence();
+	if(fm_load_acquire(&fm->io_sleeping)){
+		fm_event_signal(fm->io_wake);
+	}
+}
+
+static void
+fm_io_push(flowmaster *fm, fm_request *request)
+{
+	fm_request *prev;
+
+	request->next = NULL;
+	prev = (fm_request*) fm_exchange_ptr(FM_LINK(fm->io_head), request);
+
+	/* Until this store the I/O thread sees the queue end at prev */
+	fm_store_ptr_release(FM_LINK(prev->next), request);
+}
+
+/*
+ * Take the oldest request off the queue, I/O thread only.
+ * NULL if the queue is empty or a push is half done.
+ * */
+static fm_request*
+fm_io_pop(flowmaster *fm)
+{
+	fm_request *tail = fm->io_tail;
+	fm_request *next = (fm_request*) fm_load_ptr_acquire(FM_LINK(tail->next));
+
+	/* The stub only keeps the list from ever being empty, skip over it */
+	if(tail == &fm->io_stub){
+		if(next == NULL){
+			return NULL;
+		}
+		fm->io_tail = next;
+		tail = next;
+		next = (fm_request*) fm_load_ptr_acquire(FM_LINK(tail->next));
+	}
+
+	if(next != NULL){
+		fm->io_tail = next;
+		return tail;
+	}
+
+	/* tail looks like the last one, unless somebody is pushing behind it */
+	if(tail != fm_load_ptr_acquire(FM_LINK(fm->io_head))){
+		return NULL;
+	}
+
+	/* Put the stub back behind it so tail can be handed out */
+	fm_io_push(fm, &fm->io_stub);
+
+	next = (fm_request*) fm_load_ptr_acquire(FM_LINK(tail->next));
+	if(next != NULL){
+		fm->io_tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+/* True if nothing has been pushed that the I/O thread hasn't taken */
+static int
+fm_io_idle(flowmaster *fm)
+{
+	fm_request *tail = fm->io_tail;
+
+	return tail == &fm->io_stub && fm_load_ptr_acquire(FM_LINK(tail->next)) == NULL
+		&& fm_load_ptr_acquire(FM_LINK(fm->io_head)) == tail;
+}
+
+/* Done with the queue, a stopping thread may be waiting for the last of us */
+static void
+fm_io_leave(flowmaster *fm)
+{
+	fm_fetch_add(&fm->io_callers, (unsigned int) -1);
+
+	if(!fm_load_acquire(&fm->io_running)){
+		fm_io_wake(fm);
+	}
+}
+
+fm_rc
+fm_io_run(flowmaster *fm, fm_priority priority, fm_request_func func, void *arg)
+{
+	fm_request request;
+
+	request.priority = priority;
+	request.func = func;
+	request.arg = arg;
+	request.rc = FM_OK;
+	request.done = 0;
+	request.submitted = fm_monotonic_ns();
+	fm_cond_init(&request.cond);
+
+	/* Counted before looking at io_running, so the thread can't miss this push on its way out */
+	fm_fetch_add(&fm->io_callers, 1);
+
+	if(!fm_load_acquire(&fm->io_running)){
+		fm_io_leave(fm);
+		fm_cond_destroy(&request.cond);
+		return FM_PORT_ERROR;
+	}
+
+	fm_io_push(fm, &request);
+	fm_io_wake(fm);
+
+	fm_mutex_lock(&fm->io_done_lock);
+	while(!request.done){
+		fm_cond_wait(&request.cond, &fm->io_done_lock);
+	}
+	fm_mutex_unlock(&fm->io_done_lock);
+
+	fm_io_leave(fm);
+	fm_cond_destroy(&request.cond);
+
+	return request.rc;
+}
+
+uint64_t
+fm_command_wait(flowmaster *fm, fm_priority priority)
+{
+	if((int) priority < 0 || priority >= FM_PRIORITY_COUNT){
+		return 0;
+	}
+
+	return fm_load64(&fm->io_max_wait[priority]);
+}
+
+static void
+fm_io_complete(flowmaster *fm, fm_request *request, fm_rc rc)
+{
+	fm_mutex_lock(&fm->io_done_lock);
+	request->rc = rc;
+	request->done = 1;
+	fm_cond_broadcast(&request->cond);
+	fm_mutex_unlock(&fm->io_done_lock);
+}
+
+static void
+fm_io_thread(void *arg)
+{
+	flowmaster *fm = (flowmaster*) arg;
+	fm_request *first[FM_PRIORITY_COUNT] = { NULL };
+	fm_request *last[FM_PRIORITY_COUNT] = { NULL };
+
+	for(;;){
+		fm_request *request;
+		uint64_t waited;
+		int i;
+
+		/* Sort everything queued so far by class, oldest first within each */
+		while((request = fm_io_pop(fm)) != NULL){
+			const int p = request->priority;
+
+			request->queued = NULL;
+			if(last[p] != NULL){
+				last[p]->queued = request;
+			}
+			else {
+				first[p] = request;
+			}
+			last[p] = request;
+		}
+
+		for(i = 0; i < FM_PRIORITY_COUNT && first[i] == NULL; i++){
+			/* Find the most urgent class with anything waiting */
+		}
+
+		if(i < FM_PRIORITY_COUNT){
+			request = first[i];
+			first[i] = request->queued;
+			if(first[i] == NULL){
+				last[i] = NULL;
+			}
+
+			waited = fm_monotonic_ns() - request->submitted;
+			if(waited > fm_load64(&fm->io_max_wait[i])){
+				fm_store64(&fm->io_max_wait[i], waited);
+			}
+
+			fm_io_complete(fm, request, request->func(fm, request->arg));
+			continue;
+		}
+
+		if(!fm_io_idle(fm)){
+			/* A push is half done, it'll be there in a moment */
+			continue;
+		}
+
+		if(!fm_load_acquire(&fm->io_running)){
+			/* Pairs with the add in fm_io_run(), anybody not counted yet will see io_running clear */
+			fm_fence();
+			if(fm_load_acquire(&fm->io_callers) == 0){
+				break;
+			}
+		}
+
+		/*
+		 * Nothing to do, or stopping with somebody still counted who wakes
+		 * us as they leave.  While streaming, heartbeats wake us too.
+		 * */
+		fm_store_release(&fm->io_sleeping, 1);
+		fm_fence();
+		if(fm_io_idle(fm) && (fm_load_acquire(&fm->io_running) || fm_load_acquire(&fm->io_callers) != 0)){
+			if(fm_serial_wait_event(fm, fm->io_wake, fm_load_acquire(&fm->stream_running))){
+				fm_store_release(&fm->io_sleeping, 0);
+				fm_stream_poll(fm);
+			}
+		}
+		fm_store_release(&fm->io_sleeping, 0);
+	}
+}
@@ -13,10 +13,19 @@
 static void print_data(flowmaster *fm);
 static void wait(int sec);
 
+/*
+ * Usage: monitor [logfile]
+ *
+ * Prints the controller status once a second.  If a log file is given
+ * every sample is also recorded to it, see fm_log_create().
+ * */
 int main(int argc, char *argv[])
 {
 	flowmaster *fm;
 	int rc;
+#ifndef _WIN32
+	fm_log *log = NULL;
+#endif
 #ifdef _WIN32
 	const char port[] = "COM3";
 #else
@@ -32,6 +41,18 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+#ifndef _WIN32
+	if(argc >= 2){
+		log = fm_log_create(argv[1]);
+		if(log == NULL){
+			fprintf(stderr,"Failed to open log %s\n", argv[1]);
+			fm_destroy(fm);
+			return 0;
+		}
+		fm_attach_log(fm, log);
+	}
+#endif
+
 	for(;;){
 		rc = fm_update_status(fm);
 		if(rc != FM_OK){
@@ -44,6 +65,9 @@ int main(int argc, char *argv[])
 
 	fm_disconnect(fm);
 	fm_destroy(fm);
+#ifndef _WIN32
+	fm_log_close(log);
+#endif
 
 	return 0;
 }
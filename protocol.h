@@ -121,4 +121,24 @@
 /* */
 #define PACKET_TYPE_GET_FAN_PROFILE 0x1B
 
+/*
+ * Describe one value in the heartbeat.
+ *
+ * Request is a single byte, the descriptor index.
+ * Reply is 11 bytes:
+ *
+ * 0     - Number of descriptors
+ * 1     - Descriptor index
+ * 2     - Field id
+ * 3     - Type (0 u8, 1 u16, 2 s16, big endian)
+ * 4     - Conversion (0 linear, 1 duty cycle, 2 thermistor)
+ * 5     - Byte offset in the heartbeat data
+ * 6,7   - Scale, s16
+ * 8     - Power of ten applied to scale and bias, s8
+ * 9,10  - Bias, s16
+ *
+ * Controllers that don't know this packet NAK it.
+ * */
+#define PACKET_TYPE_GET_SCHEMA 0x1C
+
 #endif
@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "flowmaster_private.h"
+
+/*
+ * Multi-resolution rollups.
+ *
+ * Each resolution is a ring of buckets indexed by timestamp / width.
+ * A bucket remembers which interval it holds, so when a sample lands in
+ * a slot still holding an older interval the slot is simply reset.
+ * Adding a sample is therefore O(1) however long the gap since the last
+ * one, and skipped intervals read back as empty.
+ * */
+
+#define FM_SECOND 1000000000ull
+
+struct fm_rollup_slot_s {
+	uint64_t start;
+	unsigned long count;
+	float min[FM_FIELD_COUNT];
+	float max[FM_FIELD_COUNT];
+	float last[FM_FIELD_COUNT];
+	double sum[FM_FIELD_COUNT];
+};
+
+struct fm_rollup_ring_s {
+	uint64_t width;
+	unsigned int length;
+	uint64_t newest; /* interval number of the last sample */
+	struct fm_rollup_slot_s *slots;
+};
+
+struct fm_rollup_s {
+	fm_mutex lock;
+	struct fm_rollup_ring_s ring[FM_ROLLUP_COUNT];
+};
+
+/* Bucket width and how many buckets are kept for each resolution */
+static const struct {
+	uint64_t width;
+	unsigned int length;
+} fm_rollup_layout[FM_ROLLUP_COUNT] = {
+	{ 10 * FM_SECOND,   360 },	/* 10s for an hour */
+	{ 60 * FM_SECOND,   1440 },	/* 1min for a day */
+	{ 3600 * FM_SECOND, 720 }	/* 1h for 30 days */
+};
+
+fm_rollup*
+fm_rollup_create(void)
+{
+	fm_rollup *rollup = (fm_rollup*) calloc(1, sizeof(fm_rollup));
+	int i;
+
+	if(rollup == NULL){
+		return NULL;
+	}
+
+	fm_mutex_init(&rollup->lock);
+
+	for(i = 0; i < FM_ROLLUP_COUNT; i++){
+		struct fm_rollup_ring_s *ring = &rollup->ring[i];
+
+		ring->width = fm_rollup_layout[i].width;
+		ring->length = fm_rollup_layout[i].length;
+		ring->slots = (struct fm_rollup_slot_s*) calloc(ring->length, sizeof(struct fm_rollup_slot_s));
+
+		if(ring->slots == NULL){
+			fm_rollup_destroy(rollup);
+			return NULL;
+		}
+	}
+
+	return rollup;
+}
+
+void
+fm_rollup_destroy(fm_rollup *rollup)
+{
+	int i;
+
+	if(rollup == NULL){
+		return;
+	}
+
+	for(i = 0; i < FM_ROLLUP_COUNT; i++){
+		free(rollup->ring[i].slots);
+	}
+
+	fm_mutex_destroy(&rollup->lock);
+	free(rollup);
+}
+
+static void
+fm_rollup_ring_add(struct fm_rollup_ring_s *ring, const fm_sample *sample)
+{
+	const uint64_t interval = sample->timestamp / ring->width;
+	struct fm_rollup_slot_s *slot = &ring->slots[interval % ring->length];
+	const uint64_t start = interval * ring->width;
+	int i;
+
+	if(slot->count != 0 && slot->start > start){
+		/* Too late, the slot has already moved on to a newer interval */
+		return;
+	}
+
+	if(slot->start != start || slot->count == 0){
+		memset(slot, 0, sizeof(*slot));
+		slot->start = start;
+	}
+
+	for(i = 0; i < FM_FIELD_COUNT; i++){
+		const float value = (float) fm_data_field(&sample->data, (fm_field) i);
+
+		if(slot->count == 0 || value < slot->min[i]){
+			slot->min[i] = value;
+		}
+		if(slot->count == 0 || value > slot->max[i]){
+			slot->max[i] = value;
+		}
+		slot->sum[i] += value;
+		slot->last[i] = value;
+	}
+
+	slot->count++;
+
+	if(interval > ring->newest){
+		ring->newest = interval;
+	}
+}
+
+void
+fm_rollup_add(fm_rollup *rollup, const fm_sample *sample)
+{
+	int i;
+
+	fm_mutex_lock(&rollup->lock);
+
+	for(i = 0; i < FM_ROLLUP_COUNT; i++){
+		fm_rollup_ring_add(&rollup->ring[i], sample);
+	}
+
+	fm_mutex_unlock(&rollup->lock);
+}
+
+int
+fm_rollup_query(fm_rollup *rollup, fm_resolution resolution, fm_field field,
+		uint64_t from, uint64_t to, fm_bucket *buckets, int max_buckets)
+{
+	const struct fm_rollup_ring_s *ring;
+	uint64_t interval;
+	uint64_t last;
+	int found = 0;
+
+	if((int) resolution < 0 || resolution >= FM_ROLLUP_COUNT || (int) field < 0 || field >= FM_FIELD_COUNT){
+		return 0;
+	}
+
+	ring = &rollup->ring[resolution];
+
+	fm_mutex_lock(&rollup->lock);
+
+	/* Nothing older than the ring length can still be held */
+	interval = from / ring->width;
+	if(ring->newest >= ring->length && interval <= ring->newest - ring->length){
+		interval = ring->newest - ring->length + 1;
+	}
+
+	last = to / ring->width;
+	if(last > ring->newest){
+		last = ring->newest;
+	}
+
+	for(; interval <= last && found < max_buckets; interval++){
+		const struct fm_rollup_slot_s *slot = &ring->slots[interval % ring->length];
+		fm_bucket *bucket;
+
+		if(slot->count == 0 || slot->start != interval * ring->width){
+			continue;
+		}
+
+		bucket = &buckets[found++];
+		bucket->start = slot->start;
+		bucket->count = slot->count;
+		bucket->min = slot->min[field];
+		bucket->max = slot->max[field];
+		bucket->sum = slot->sum[field];
+		bucket->last = slot->last[field];
+	}
+
+	fm_mutex_unlock(&rollup->lock);
+
+	return found;
+}
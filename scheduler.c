@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
+
+/*
+ * Library owned status polling.
+ *
+ * The scheduler thread blocks on a periodic timer armed with absolute
+ * deadlines, so the period doesn't drift with however long each poll
+ * takes, and makes one status request per period.  Every sample is
+ * handed to each subscriber from the publish path.
+ *
+ * fm_refresh() lets anybody ask for fresh data.  Whoever gets
+ * refresh_lock first claims the poll by recording last_refresh, anybody
+ * queued up behind them finds the data already fresh and returns without
+ * touching the port, so a burst of refreshes costs a single transaction.
+ * The poll itself, and the subscribers it calls, run after the lock has
+ * been dropped, so a subscriber may call fm_refresh() too.
+ * */
+
+#define FM_MS 1000000ull
+
+static void fm_scheduler_thread(void *arg);
+
+void
+fm_scheduler_init(flowmaster *fm)
+{
+	fm_mutex_init(&fm->refresh_lock);
+	fm_mutex_init(&fm->subscriber_lock);
+	fm->refresh_period = 500 * FM_MS;
+}
+
+void
+fm_scheduler_destroy(flowmaster *fm)
+{
+	fm_mutex_destroy(&fm->subscriber_lock);
+	fm_mutex_destroy(&fm->refresh_lock);
+}
+
+/* Poll unless somebody already has recently */
+static fm_rc
+fm_refresh_claim(flowmaster *fm, int tick)
+{
+	const uint64_t now = fm_monotonic_ns();
+	uint64_t previous;
+	fm_rc rc;
+
+	fm_mutex_lock(&fm->refresh_lock);
+
+	if(tick){
+		/* A caller refreshed since the last tick, that counts as this period's poll */
+		if(fm->refreshed_since_tick){
+			fm->refreshed_since_tick = 0;
+			fm_mutex_unlock(&fm->refresh_lock);
+			return FM_OK;
+		}
+	}
+	else if(fm->last_refresh != 0 && now - fm->last_refresh < fm->refresh_period){
+		/* Still fresh, maybe because whoever held the lock before us just polled */
+		fm_mutex_unlock(&fm->refresh_lock);
+		return FM_OK;
+	}
+
+	previous = fm->last_refresh;
+	fm->last_refresh = now;
+	fm->refreshed_since_tick = !tick;
+
+	fm_mutex_unlock(&fm->refresh_lock);
+
+	rc = fm_update_status(fm);
+	if(rc != FM_OK){
+		/* Give the next caller a go, unless somebody has claimed a poll since */
+		fm_mutex_lock(&fm->refresh_lock);
+		if(fm->last_refresh == now){
+			fm->last_refresh = previous;
+			fm->refreshed_since_tick = 0;
+		}
+		fm_mutex_unlock(&fm->refresh_lock);
+	}
+
+	return rc;
+}
+
+fm_rc
+fm_refresh(flowmaster *fm)
+{
+	return fm_refresh_claim(fm, 0);
+}
+
+fm_rc
+fm_scheduler_start(flowmaster *fm, unsigned int period_ms)
+{
+	if(fm->scheduler_running){
+		return FM_BUSY;
+	}
+
+	/* The controller can't be asked more often than this */
+	if(period_ms < 500){
+		return FM_BAD_ARGUMENT;
+	}
+
+	if(fm_timer_create(&fm->scheduler_timer) != 0){
+		return FM_THREAD_ERROR;
+	}
+
+	fm_mutex_lock(&fm->refresh_lock);
+	fm->refresh_period = period_ms * FM_MS;
+	fm_mutex_unlock(&fm->refresh_lock);
+
+	fm_store_release(&fm->scheduler_running, 1);
+
+	if(fm_timer_set(fm->scheduler_timer, fm_monotonic_ns(), period_ms * FM_MS) != 0
+		|| fm_thread_start(&fm->scheduler_thread, fm_scheduler_thread, fm) != 0){
+		fm->scheduler_running = 0;
+		fm_timer_destroy(fm->scheduler_timer);
+		return FM_THREAD_ERROR;
+	}
+
+	return FM_OK;
+}
+
+fm_rc
+fm_scheduler_stop(flowmaster *fm)
+{
+	if(!fm->scheduler_running){
+		return FM_OK;
+	}
+
+	/* Fire the timer now rather than waiting out the period */
+	fm_store_release(&fm->scheduler_running, 0);
+	fm_timer_set(fm->scheduler_timer, fm_monotonic_ns(), 0);
+
+	fm_thread_join(fm->scheduler_thread);
+	fm_timer_destroy(fm->scheduler_timer);
+
+	return FM_OK;
+}
+
+static void
+fm_scheduler_thread(void *arg)
+{
+	flowmaster *fm = (flowmaster*) arg;
+
+	while(fm_timer_wait(fm->scheduler_timer) > 0 && fm_load_acquire(&fm->scheduler_running)){
+		/* Missed periods are simply skipped */
+		fm_refresh_claim(fm, 1);
+	}
+}
+
+int
+fm_subscribe(flowmaster *fm, fm_subscriber cb, void *userdata)
+{
+	int id = -1;
+	int i;
+
+	fm_mutex_lock(&fm->subscriber_lock);
+
+	for(i = 0; i < FM_MAX_SUBSCRIBERS; i++){
+		if(fm->subscribers[i].cb == NULL){
+			fm->subscribers[i].cb = cb;
+			fm->subscribers[i].userdata = userdata;
+			id = i;
+			break;
+		}
+	}
+
+	fm_mutex_unlock(&fm->subscriber_lock);
+
+	return id;
+}
+
+void
+fm_unsubscribe(flowmaster *fm, int id)
+{
+	if(id < 0 || id >= FM_MAX_SUBSCRIBERS){
+		return;
+	}
+
+	fm_mutex_lock(&fm->subscriber_lock);
+	fm->subscribers[id].cb = NULL;
+	fm->subscribers[id].userdata = NULL;
+	fm_mutex_unlock(&fm->subscriber_lock);
+}
+
+int
+fm_has_subscribers(flowmaster *fm)
+{
+	int i;
+
+	for(i = 0; i < FM_MAX_SUBSCRIBERS; i++){
+		if(fm->subscribers[i].cb != NULL){
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+fm_notify_subscribers(flowmaster *fm, const fm_sample *sample)
+{
+	struct fm_subscription_s subscribers[FM_MAX_SUBSCRIBERS];
+	int i;
+
+	/* Call them outside the lock so they may unsubscribe themselves */
+	fm_mutex_lock(&fm->subscriber_lock);
+	memcpy(subscribers, fm->subscribers, sizeof(subscribers));
+	fm_mutex_unlock(&fm->subscriber_lock);
+
+	for(i = 0; i < FM_MAX_SUBSCRIBERS; i++){
+		if(subscribers[i].cb != NULL){
+			subscribers[i].cb(fm, sample, subscribers[i].userdata);
+		}
+	}
+}
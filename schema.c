@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "protocol.h"
+#include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
+
+/*
+ * Heartbeat schema.
+ *
+ * Each value in the heartbeat is described by a field descriptor giving
+ * its id, wire type, byte offset and how to convert it.  Controllers that
+ * understand PACKET_TYPE_GET_SCHEMA describe their own heartbeat at
+ * connect time, anything older gets fm_default_schema, which matches
+ * what the controller has always sent.
+ *
+ * Decoding walks the table, the only per field decision being which of
+ * three conversions to apply.
+ * */
+
+#define PACKET_DATA 2
+
+static fm_rc fm_query_schema_locked(flowmaster *fm, void *arg);
+
+static const fm_field_desc fm_default_schema[] = {
+	{ FM_FIELD_FAN_DUTY_CYCLE,  FM_TYPE_U16, FM_CONV_DUTY,       FM_HB_FAN_DUTY,    1.0f,  0.0f, "fan_duty" },
+	{ FM_FIELD_PUMP_DUTY_CYCLE, FM_TYPE_U16, FM_CONV_DUTY,       FM_HB_PUMP_DUTY,   1.0f,  0.0f, "pump_duty" },
+	{ FM_FIELD_AMBIENT_TEMP,    FM_TYPE_U16, FM_CONV_THERMISTOR, FM_HB_AMBIENT_ADC, 1.0f,  0.0f, "ambient" },
+	{ FM_FIELD_COOLANT_TEMP,    FM_TYPE_U16, FM_CONV_THERMISTOR, FM_HB_COOLANT_ADC, 1.0f,  0.0f, "coolant" },
+	{ FM_FIELD_FAN_RPM,         FM_TYPE_U8,  FM_CONV_LINEAR,     FM_HB_FAN_TACH,    30.0f, 0.0f, "fan_rpm" },
+	{ FM_FIELD_PUMP_RPM,        FM_TYPE_U8,  FM_CONV_LINEAR,     FM_HB_PUMP_TACH,   30.0f, 0.0f, "pump_rpm" }
+	/* No flow sensor yet, FM_FIELD_FLOW_RATE reads as 0 */
+};
+
+/* Where each standard field lives in fm_data */
+static const struct {
+	size_t offset;
+	int is_int;
+} fm_data_layout[FM_FIELD_COUNT] = {
+	{ offsetof(fm_data, fan_duty_cycle),  0 },
+	{ offsetof(fm_data, pump_duty_cycle), 0 },
+	{ offsetof(fm_data, ambient_temp),    0 },
+	{ offsetof(fm_data, coolant_temp),    0 },
+	{ offsetof(fm_data, flow_rate),       0 },
+	{ offsetof(fm_data, fan_rpm),         1 },
+	{ offsetof(fm_data, pump_rpm),        1 }
+};
+
+/* Index a new schema, values memoised under the old one no longer apply */
+static void
+fm_schema_index(flowmaster *fm)
+{
+	int i;
+
+	memset(fm->schema_index, 0xFF, sizeof(fm->schema_index));
+
+	for(i = 0; i < fm->schema_count; i++){
+		fm->schema_index[fm->schema[i].id] = (unsigned char) i;
+	}
+
+	/* Odd sequence numbers never match, so the getters convert afresh */
+	for(i = 0; i < FM_MEMO_COUNT; i++){
+		fm_store64(&fm->memo[i], (uint64_t) 1 << 32);
+	}
+}
+
+void
+fm_schema_defaults(flowmaster *fm)
+{
+	fm->schema_count = sizeof(fm_default_schema) / sizeof(fm_default_schema[0]);
+	memcpy(fm->schema, fm_default_schema, sizeof(fm_default_schema));
+	fm_schema_index(fm);
+}
+
+/* Standard fields keep their usual names, anything new is named by id */
+static void
+fm_schema_name(fm_field_desc *field)
+{
+	unsigned int i;
+
+	for(i = 0; i < sizeof(fm_default_schema) / sizeof(fm_default_schema[0]); i++){
+		if(fm_default_schema[i].id == field->id){
+			strcpy(field->name, fm_default_schema[i].name);
+			return;
+		}
+	}
+
+	if(field->id == FM_FIELD_FLOW_RATE){
+		strcpy(field->name, "flow");
+		return;
+	}
+
+	sprintf(field->name, "field%d", (int) field->id);
+}
+
+/* Ask for descriptor index, fills in field and returns the descriptor count, or -1 */
+static int
+fm_schema_request(flowmaster *fm, int index, fm_field_desc *field)
+{
+	const unsigned char *data = &fm->read_buffer[PACKET_DATA];
+	double exponent;
+	int written;
+
+	fm_start_write_buffer(fm, PACKET_TYPE_GET_SCHEMA, 1);
+	fm_add_byte(fm, (unsigned char) index);
+	fm_end_write_buffer(fm);
+	fm_flush_buffers(fm);
+
+	if(fm_serial_write(fm, &written) != 0 || fm_serial_read(fm) != 0 || fm->read_buffer_len == 0){
+		return -1;
+	}
+
+	/* Anything else, most likely a NAK, means the controller doesn't do schemas */
+	if(fm->read_buffer[0] != PACKET_TYPE_GET_SCHEMA || fm->read_buffer[1] != 11
+		|| fm_validate_packet(fm, PACKET_TYPE_GET_SCHEMA) != 0){
+		return -1;
+	}
+
+	if(data[1] != index || data[3] > FM_TYPE_S16 || data[4] > FM_CONV_THERMISTOR
+		|| data[5] + (data[3] == FM_TYPE_U8 ? 1 : 2) > FM_BUFFER_SIZE - PACKET_DATA){
+		return -1;
+	}
+
+	exponent = pow(10.0, (double)(signed char) data[8]);
+
+	memset(field, 0, sizeof(*field));
+	field->id = data[2];
+	field->type = data[3];
+	field->conversion = data[4];
+	field->offset = data[5];
+	field->scale = (float)((int16_t)((data[6] << 8) | data[7]) * exponent);
+	field->bias = (float)((int16_t)((data[9] << 8) | data[10]) * exponent);
+	fm_schema_name(field);
+
+	return data[0];
+}
+
+fm_rc
+fm_query_schema(flowmaster *fm)
+{
+	return fm_io_run(fm, FM_PRIORITY_NORMAL, fm_query_schema_locked, NULL);
+}
+
+static fm_rc
+fm_query_schema_locked(flowmaster *fm, void *arg)
+{
+	fm_field_desc fields[FM_SCHEMA_MAX];
+	int count;
+	int i;
+
+	count = fm_schema_request(fm, 0, &fields[0]);
+	if(count <= 0 || count > FM_SCHEMA_MAX){
+		fm_schema_defaults(fm);
+		return FM_OK;
+	}
+
+	for(i = 1; i < count; i++){
+		if(fm_schema_request(fm, i, &fields[i]) != count){
+			/* Half a schema is no use, stick with what we know */
+			fm_schema_defaults(fm);
+			return FM_READ_ERROR;
+		}
+	}
+
+	memcpy(fm->schema, fields, count * sizeof(fm_field_desc));
+	fm->schema_count = count;
+	fm_schema_index(fm);
+
+	return FM_OK;
+}
+
+const fm_field_desc*
+fm_schema(flowmaster *fm, int *count)
+{
+	*count = fm->schema_count;
+	return fm->schema;
+}
+
+const fm_field_desc*
+fm_find_field(flowmaster *fm, int id)
+{
+	if(id < 0 || id >= FM_SCHEMA_MAX_ID || fm->schema_index[id] == 0xFF){
+		return NULL;
+	}
+
+	return &fm->schema[fm->schema_index[id]];
+}
+
+/* Sign extend an S16, the rest are already right */
+int
+fm_field_extend(const fm_field_desc *field, int raw)
+{
+	if(field->type == FM_TYPE_S16 && raw >= 0x8000){
+		return raw - 0x10000;
+	}
+	return raw;
+}
+
+int
+fm_field_raw(const fm_field_desc *field, const unsigned char *payload)
+{
+	const unsigned char *p = payload + field->offset;
+
+	if(field->type == FM_TYPE_U8){
+		return p[0];
+	}
+
+	return fm_field_extend(field, (p[0] << 8) | p[1]);
+}
+
+double
+fm_field_convert(flowmaster *fm, const fm_field_desc *field, int raw)
+{
+	switch(field->conversion){
+		case FM_CONV_DUTY:
+			return (double) raw / (double) fm->timer_top;
+		case FM_CONV_THERMISTOR:
+			return fm_probe_convert(fm, field->id, raw);
+		default:
+			return ((double) raw * field->scale) + field->bias;
+	}
+}
+
+double
+fm_field_value(flowmaster *fm, const fm_field_desc *field, const unsigned char *payload)
+{
+	return fm_field_convert(fm, field, fm_field_raw(field, payload));
+}
+
+void
+fm_decode_frame(flowmaster *fm, const fm_frame *frame, fm_data *data)
+{
+	int i;
+
+	memset(data, 0, sizeof(*data));
+
+	for(i = 0; i < fm->schema_count; i++){
+		const fm_field_desc *field = &fm->schema[i];
+		unsigned char *member;
+		double value;
+
+		if(field->id >= FM_FIELD_COUNT){
+			/* Not one of ours, only reachable through fm_get_field() */
+			continue;
+		}
+
+		value = fm_field_value(fm, field, frame->payload);
+		member = (unsigned char*) data + fm_data_layout[field->id].offset;
+
+		if(fm_data_layout[field->id].is_int){
+			*(int*) member = (int) floor(value + 0.5);
+		}
+		else {
+			*(float*) member = (float) value;
+		}
+	}
+}
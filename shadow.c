@@ -0,0 +1,133 @@
+#include <string.h>
+
+#include "flowmaster_private.h"
+
+/*
+ * Shadow registers.
+ *
+ * The last value the controller acknowledged for each writable setting,
+ * so writes that wouldn't change anything never go out.  A register is
+ * only trusted from the ACK until something makes its value uncertain:
+ * a failed write, a reconnect, the bootloader, or a heartbeat showing a
+ * duty cycle other than the one we set, which is how a controller that
+ * has reset itself or gone back to regulating on its own gives itself
+ * away.
+ *
+ * Writers update the shadow with the port acquired, shadow_lock only
+ * guards against the publish path checking it at the same time.
+ * */
+
+void
+fm_shadow_invalidate(flowmaster *fm, unsigned int registers)
+{
+	fm_mutex_lock(&fm->shadow_lock);
+	fm->shadow.valid &= ~registers;
+	fm_mutex_unlock(&fm->shadow_lock);
+}
+
+void
+fm_forget_state(flowmaster *fm)
+{
+	fm_shadow_invalidate(fm, ~0u);
+}
+
+int
+fm_shadow_matches(flowmaster *fm, fm_shadow_reg reg, int value)
+{
+	int matches;
+
+	fm_mutex_lock(&fm->shadow_lock);
+	matches = (fm->shadow.valid & (1u << reg)) && fm->shadow.value[reg] == value;
+	fm_mutex_unlock(&fm->shadow_lock);
+
+	return matches;
+}
+
+void
+fm_shadow_store(flowmaster *fm, fm_shadow_reg reg, int value)
+{
+	fm_mutex_lock(&fm->shadow_lock);
+	fm->shadow.value[reg] = value;
+	fm->shadow.valid |= 1u << reg;
+	fm_mutex_unlock(&fm->shadow_lock);
+}
+
+static uint16_t
+fm_profile_sum(const uint16_t *ticks)
+{
+	unsigned int a = 0;
+	unsigned int b = 0;
+	int i;
+
+	for(i = 0; i < FM_FAN_BUFFER_SIZE; i++){
+		a = (a + (ticks[i] >> 8)) % 255;
+		b = (b + a) % 255;
+		a = (a + (ticks[i] & 0xFF)) % 255;
+		b = (b + a) % 255;
+	}
+
+	return (uint16_t)((b << 8) | a);
+}
+
+/* Copy out the last acknowledged profile, 0 if there isn't one */
+int
+fm_shadow_load_profile(flowmaster *fm, uint16_t *ticks)
+{
+	struct fm_shadow_s *shadow = &fm->shadow;
+	int valid;
+
+	fm_mutex_lock(&fm->shadow_lock);
+
+	valid = (shadow->valid & (1u << FM_SHADOW_PROFILE)) != 0;
+
+	/* Something has scribbled over the copy, don't go trusting it */
+	if(valid && fm_profile_sum(shadow->profile) != shadow->profile_sum){
+		shadow->valid &= ~(1u << FM_SHADOW_PROFILE);
+		valid = 0;
+	}
+
+	if(valid){
+		memcpy(ticks, shadow->profile, sizeof(shadow->profile));
+	}
+
+	fm_mutex_unlock(&fm->shadow_lock);
+
+	return valid;
+}
+
+void
+fm_shadow_store_profile(flowmaster *fm, const uint16_t *ticks)
+{
+	fm_mutex_lock(&fm->shadow_lock);
+	memcpy(fm->shadow.profile, ticks, sizeof(fm->shadow.profile));
+	fm->shadow.profile_sum = fm_profile_sum(ticks);
+	fm->shadow.valid |= 1u << FM_SHADOW_PROFILE;
+	fm_mutex_unlock(&fm->shadow_lock);
+}
+
+/* Compare a fresh heartbeat's duty cycles against what we think we set */
+void
+fm_shadow_check(flowmaster *fm, const fm_frame *frame)
+{
+	const fm_field_desc *fan = fm_find_field(fm, FM_FIELD_FAN_DUTY_CYCLE);
+	const fm_field_desc *pump = fm_find_field(fm, FM_FIELD_PUMP_DUTY_CYCLE);
+	struct fm_shadow_s *shadow = &fm->shadow;
+	int stale = 0;
+
+	fm_mutex_lock(&fm->shadow_lock);
+
+	if((shadow->valid & (1u << FM_SHADOW_FAN)) && fan != NULL){
+		stale |= fm_field_raw(fan, frame->payload) != shadow->value[FM_SHADOW_FAN];
+	}
+
+	if((shadow->valid & (1u << FM_SHADOW_PUMP)) && pump != NULL){
+		stale |= fm_field_raw(pump, frame->payload) != shadow->value[FM_SHADOW_PUMP];
+	}
+
+	/* Somebody else has been at it, or the controller restarted in automatic mode */
+	if(stale){
+		shadow->valid &= ~((1u << FM_SHADOW_FAN) | (1u << FM_SHADOW_PUMP) | (1u << FM_SHADOW_MODE));
+	}
+
+	fm_mutex_unlock(&fm->shadow_lock);
+}
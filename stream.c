@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
+
+/*
+ * Heartbeat streaming.
+ *
+ * Only the I/O thread reads the port.  While streaming it listens for
+ * heartbeats whenever it has nothing to send and fm_serial_read() picks
+ * out any that arrive in the middle of a reply, so commands keep working.
+ * Each heartbeat is handed over through stream_inbox to the stream
+ * thread, which queues it in stream_ring and publishes it, so callbacks
+ * never run on the I/O thread and may send commands of their own.
+ *
+ * Both queues have a single producer and a single consumer and need
+ * nothing more than a release store of each index after the slot has
+ * been written or read.
+ * */
+
+#define FM_STREAM_RING_MASK (FM_STREAM_RING_SIZE - 1)
+
+/* How long the port has to be quiet before the heartbeats are taken to have stopped */
+#define FM_STREAM_QUIET_MS 20
+
+/* How long to keep passing on heartbeats after asking the controller to stop */
+#define FM_STREAM_DRAIN_NS 100000000ULL
+
+static void fm_stream_thread(void *arg);
+static void fm_stream_push(flowmaster *fm, const fm_frame *frame);
+static fm_rc fm_stream_start_locked(flowmaster *fm, void *arg);
+static fm_rc fm_stream_stop_locked(flowmaster *fm, void *arg);
+
+void
+fm_stream_init(flowmaster *fm)
+{
+	fm_mutex_init(&fm->stream_lock);
+	fm_cond_init(&fm->stream_cond);
+}
+
+void
+fm_stream_destroy(flowmaster *fm)
+{
+	fm_cond_destroy(&fm->stream_cond);
+	fm_mutex_destroy(&fm->stream_lock);
+}
+
+fm_rc
+fm_stream_start(flowmaster *fm)
+{
+	fm_rc rc;
+
+	if(fm->stream_running){
+		return FM_BUSY;
+	}
+
+	fm->inbox_head = 0;
+	fm->inbox_tail = 0;
+	fm->inbox_dropped = 0;
+	fm->stream_head = 0;
+	fm->stream_tail = 0;
+	fm->stream_dropped = 0;
+
+	if((rc = fm_io_run(fm, FM_PRIORITY_NORMAL, fm_stream_start_locked, NULL)) != FM_OK){
+		return rc;
+	}
+
+	if(fm_thread_start(&fm->stream_thread, fm_stream_thread, fm) != 0){
+		if(fm_io_run(fm, FM_PRIORITY_NORMAL, fm_stream_stop_locked, NULL) != FM_OK){
+			fm_store_release(&fm->stream_running, 0);
+		}
+		return FM_THREAD_ERROR;
+	}
+
+	return FM_OK;
+}
+
+fm_rc
+fm_stream_stop(flowmaster *fm)
+{
+	fm_rc rc;
+
+	if(!fm->stream_running){
+		return FM_OK;
+	}
+
+	rc = fm_io_run(fm, FM_PRIORITY_NORMAL, fm_stream_stop_locked, NULL);
+	if(rc != FM_OK){
+		/* No I/O thread left to listen, so nothing more can arrive */
+		fm_store_release(&fm->stream_running, 0);
+	}
+
+	/* The stream thread drains the inbox and exits */
+	fm_mutex_lock(&fm->stream_lock);
+	fm_cond_broadcast(&fm->stream_cond);
+	fm_mutex_unlock(&fm->stream_lock);
+
+	fm_thread_join(fm->stream_thread);
+
+	return rc;
+}
+
+int
+fm_stream_read(flowmaster *fm, fm_sample *samples, int max_samples)
+{
+	const unsigned int tail = fm->stream_tail;
+	const unsigned int head = fm_load_acquire(&fm->stream_head);
+	unsigned int count = head - tail;
+	unsigned int i;
+
+	if(max_samples <= 0){
+		return 0;
+	}
+
+	if(count > (unsigned int) max_samples){
+		count = (unsigned int) max_samples;
+	}
+
+	/* Heartbeats are queued raw, only decode the ones somebody reads */
+	for(i = 0; i < count; i++){
+		const fm_frame *frame = &fm->stream_ring[(tail + i) & FM_STREAM_RING_MASK];
+
+		samples[i].timestamp = frame->timestamp;
+		samples[i].request_time = frame->request_time;
+		fm_decode_frame(fm, frame, &samples[i].data);
+	}
+
+	fm_store_release(&fm->stream_tail, tail + count);
+
+	return (int) count;
+}
+
+unsigned int
+fm_stream_dropped(flowmaster *fm)
+{
+	return fm_load_acquire(&fm->stream_dropped) + fm_load_acquire(&fm->inbox_dropped);
+}
+
+void
+fm_stream_receive(flowmaster *fm)
+{
+	const unsigned int head = fm->inbox_head;
+	const unsigned int tail = fm_load_acquire(&fm->inbox_tail);
+	fm_frame *frame;
+
+	/* Skip anything that isn't a whole heartbeat */
+	if(fm->read_buffer_len < 3 || fm->read_buffer_len != fm->read_buffer[1] + 3){
+		return;
+	}
+
+	if(fm_validate_packet(fm, PACKET_TYPE_HEARTBEAT) != 0){
+		return;
+	}
+
+	if(head - tail == FM_STREAM_RING_SIZE){
+		/* The stream thread has fallen behind, keep the old samples */
+		fm_store_release(&fm->inbox_dropped, fm->inbox_dropped + 1);
+		return;
+	}
+
+	frame = &fm->stream_inbox[head & FM_STREAM_RING_MASK];
+	fm_capture_frame(fm, frame);
+	frame->timestamp = fm->rx_timestamp;
+	frame->request_time = 0;
+	fm_store_release(&fm->inbox_head, head + 1);
+
+	fm_mutex_lock(&fm->stream_lock);
+	fm_cond_broadcast(&fm->stream_cond);
+	fm_mutex_unlock(&fm->stream_lock);
+}
+
+/* Read whatever has arrived on the port, I/O thread only */
+void
+fm_stream_poll(flowmaster *fm)
+{
+	if(fm_serial_read_packet(fm) != 0){
+		return;
+	}
+
+	if(fm->read_buffer_len > 0 && fm->read_buffer[0] == PACKET_TYPE_HEARTBEAT){
+		fm_stream_receive(fm);
+	}
+}
+
+static void
+fm_stream_thread(void *arg)
+{
+	flowmaster *fm = (flowmaster*) arg;
+	fm_frame frame;
+
+	for(;;){
+		const unsigned int tail = fm->inbox_tail;
+
+		if(tail == fm_load_acquire(&fm->inbox_head)){
+			fm_mutex_lock(&fm->stream_lock);
+			while(tail == fm_load_acquire(&fm->inbox_head) && fm_load_acquire(&fm->stream_running)){
+				fm_cond_wait(&fm->stream_cond, &fm->stream_lock);
+			}
+			fm_mutex_unlock(&fm->stream_lock);
+
+			/* Stopped, and everything received before that has been passed on */
+			if(tail == fm_load_acquire(&fm->inbox_head)){
+				break;
+			}
+		}
+
+		frame = fm->stream_inbox[tail & FM_STREAM_RING_MASK];
+		fm_store_release(&fm->inbox_tail, tail + 1);
+
+		fm_stream_push(fm, &frame);
+		fm_publish_frame(fm, &frame);
+	}
+}
+
+static void
+fm_stream_push(flowmaster *fm, const fm_frame *frame)
+{
+	const unsigned int head = fm->stream_head;
+	const unsigned int tail = fm_load_acquire(&fm->stream_tail);
+
+	if(head - tail == FM_STREAM_RING_SIZE){
+		/* Nobody is draining the queue, keep the old samples and drop this one */
+		fm_store_release(&fm->stream_dropped, fm->stream_dropped + 1);
+		return;
+	}
+
+	fm->stream_ring[head & FM_STREAM_RING_MASK] = *frame;
+	fm_store_release(&fm->stream_head, head + 1);
+}
+
+static fm_rc
+fm_stream_send_locked(flowmaster *fm, int packet_type)
+{
+	int written;
+
+	/* No ACK to wait for, heartbeats may already be on their way */
+	fm_start_write_buffer(fm, packet_type, 0);
+	fm_end_write_buffer(fm);
+
+	if(fm_serial_write(fm, &written) != 0){
+		return FM_WRITE_ERROR;
+	}
+
+	return FM_OK;
+}
+
+static fm_rc
+fm_stream_start_locked(flowmaster *fm, void *arg)
+{
+	fm_rc rc;
+
+	(void) arg;
+
+	/* Anything unread now is stale, afterwards it may be a heartbeat */
+	fm_flush_buffers(fm);
+
+	if((rc = fm_stream_send_locked(fm, PACKET_TYPE_START_HEARTBEAT)) != FM_OK){
+		return rc;
+	}
+
+	fm_store_release(&fm->stream_running, 1);
+
+	return FM_OK;
+}
+
+static fm_rc
+fm_stream_stop_locked(flowmaster *fm, void *arg)
+{
+	const uint64_t deadline = fm_monotonic_ns() + FM_STREAM_DRAIN_NS;
+	fm_rc rc;
+
+	(void) arg;
+
+	rc = fm_stream_send_locked(fm, PACKET_TYPE_STOP_HEARTBEAT);
+
+	/* Pass on whatever was already in flight so it isn't taken for a reply later */
+	while(fm_monotonic_ns() < deadline && fm_serial_wait(fm, FM_STREAM_QUIET_MS)){
+		fm_stream_poll(fm);
+	}
+
+	fm_store_release(&fm->stream_running, 0);
+
+	fm_mutex_lock(&fm->stream_lock);
+	fm_cond_broadcast(&fm->stream_cond);
+	fm_mutex_unlock(&fm->stream_lock);
+
+	return rc;
+}
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "flowmaster_private.h"
+#include "flowmaster_atomic.h"
+
+/*
+ * Thermistor conversion.
+ *
+ * The ADC is 10 bits, so every possible reading is converted up front
+ * into a 1024 entry table and a conversion is a single load.  The table
+ * for the default probe parameters is generated at build time by
+ * gen_thermistor.c, calibrated probes get their own table at runtime.
+ * */
+
+#ifndef FM_THERMISTOR_GENERATOR
+#include "thermistor_table.h"
+#endif
+
+void
+fm_thermistor_defaults(fm_thermistor *params)
+{
+	/* Steinhart-Hart coefficients for the stock 10k probes */
+	params->a = 0.001129148;
+	params->b = 0.000234125;
+	params->c = 0.0000000876741;
+	params->series_resistor = 10000.0;
+	params->gain = 1.0;
+	params->offset = 0.0;
+}
+
+static double
+fm_thermistor_eval(const fm_thermistor *params, int adc_val)
+{
+	double resistance;
+	double ln_r;
+	double kelvin;
+
+	/* An open circuit reads 0, treat it as 1 rather than divide by zero */
+	if(adc_val < 1){
+		adc_val = 1;
+	}
+
+	resistance = ((1024.0 * params->series_resistor) / adc_val) - params->series_resistor;
+	ln_r = log(resistance);
+	kelvin = 1.0 / (params->a + (params->b * ln_r) + (params->c * ln_r * ln_r * ln_r));
+
+	return ((kelvin - 273.15) * params->gain) + params->offset;
+}
+
+void
+fm_thermistor_table(const fm_thermistor *params, float *table)
+{
+	int i;
+
+	for(i = 0; i < FM_THERMISTOR_TABLE_SIZE; i++){
+		table[i] = (float) fm_thermistor_eval(params, i);
+	}
+}
+
+#ifndef FM_THERMISTOR_GENERATOR
+
+#define FM_PROBE_SLOT(ptr) ((void *volatile*) &(ptr))
+
+/*
+ * A calibrated table.  Conversions read them on any thread without
+ * locking, counted in probe_readers for the one load, so a new table
+ * is filled in before it's published and the one it replaces is only
+ * freed once the count has been seen at 0.
+ * */
+struct fm_probe_s {
+	float table[FM_THERMISTOR_TABLE_SIZE];
+};
+
+/* How long a calibrator waits between looks at probe_readers */
+#define FM_PROBE_WAIT_NS 100000ULL
+
+static const float*
+fm_probe_enter(flowmaster *fm, int id)
+{
+	const struct fm_probe_s *probe = NULL;
+
+	fm_fetch_add(&fm->probe_readers, 1);
+	if(id >= 0 && id < FM_SCHEMA_MAX_ID){
+		probe = (const struct fm_probe_s*) fm_load_ptr_acquire(FM_PROBE_SLOT(fm->probe[id]));
+	}
+
+	return probe != NULL ? probe->table : fm_thermistor_default_table;
+}
+
+static void
+fm_probe_leave(flowmaster *fm)
+{
+	fm_fetch_add(&fm->probe_readers, (unsigned int) -1);
+}
+
+float
+fm_probe_convert(flowmaster *fm, int id, int raw)
+{
+	float celcius;
+
+	celcius = fm_probe_enter(fm, id)[raw & (FM_THERMISTOR_TABLE_SIZE - 1)];
+	fm_probe_leave(fm);
+
+	return celcius;
+}
+
+void
+fm_probe_table(flowmaster *fm, int id, float *table)
+{
+	memcpy(table, fm_probe_enter(fm, id), sizeof(float) * FM_THERMISTOR_TABLE_SIZE);
+	fm_probe_leave(fm);
+}
+
+fm_rc
+fm_calibrate_probe(flowmaster *fm, int id, const fm_thermistor *params)
+{
+	struct fm_probe_s *probe = NULL;
+	struct fm_probe_s *old;
+	int i;
+
+	if(id < 0 || id >= FM_SCHEMA_MAX_ID){
+		return FM_BAD_ARGUMENT;
+	}
+
+	if(params != NULL){
+		probe = (struct fm_probe_s*) malloc(sizeof(struct fm_probe_s));
+		if(probe == NULL){
+			return FM_NO_MEMORY;
+		}
+		fm_thermistor_table(params, probe->table);
+	}
+
+	/*
+	 * The exchange is a full barrier, readers see the table filled in,
+	 * and any counted after it has the new one.  Readers are only
+	 * counted for a single lookup, so the wait is short.
+	 * */
+	fm_mutex_lock(&fm->probe_lock);
+	old = (struct fm_probe_s*) fm_exchange_ptr(FM_PROBE_SLOT(fm->probe[id]), probe);
+	if(old != NULL){
+		while(fm_load_acquire(&fm->probe_readers) != 0){
+			fm_sleep_until(fm_monotonic_ns() + FM_PROBE_WAIT_NS);
+		}
+		free(old);
+	}
+	fm_mutex_unlock(&fm->probe_lock);
+
+	/* Odd sequence numbers never match, so the getters convert afresh */
+	for(i = 0; i < FM_MEMO_COUNT; i++){
+		fm_store64(&fm->memo[i], (uint64_t) 1 << 32);
+	}
+
+	return FM_OK;
+}
+
+void
+fm_free_probes(flowmaster *fm)
+{
+	int i;
+
+	for(i = 0; i < FM_SCHEMA_MAX_ID; i++){
+		free(fm->probe[i]);
+		fm->probe[i] = NULL;
+	}
+}
+
+void
+fm_convert_temps(const float *table, const uint16_t *adc, float *celcius, size_t count)
+{
+	size_t i = 0;
+
+	if(table == NULL){
+		table = fm_thermistor_default_table;
+	}
+
+	/* Independent loads with no branches, which the compiler is free to turn into gathers */
+	for(; i + 4 <= count; i += 4){
+		celcius[i]     = table[adc[i]     & (FM_THERMISTOR_TABLE_SIZE - 1)];
+		celcius[i + 1] = table[adc[i + 1] & (FM_THERMISTOR_TABLE_SIZE - 1)];
+		celcius[i + 2] = table[adc[i + 2] & (FM_THERMISTOR_TABLE_SIZE - 1)];
+		celcius[i + 3] = table[adc[i + 3] & (FM_THERMISTOR_TABLE_SIZE - 1)];
+	}
+
+	for(; i < count; i++){
+		celcius[i] = table[adc[i] & (FM_THERMISTOR_TABLE_SIZE - 1)];
+	}
+}
+
+#endif
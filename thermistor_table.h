@@ -0,0 +1,259 @@
+/* Generated by gen_thermistor.c, do not edit */
+static const float fm_thermistor_default_table[FM_THERMISTOR_TABLE_SIZE] = {
+	-83.6412354f, -83.6412354f, -75.8623276f, -71.0783463f,
+	-67.5709686f, -64.7820282f, -62.456852f, -60.4570427f,
+	-58.6987267f, -57.1271019f, -55.7043228f, -54.4031219f,
+	-53.203186f, -52.0889626f, -51.0482674f, -50.0713768f,
+	-49.1503983f, -48.2788429f, -47.4513016f, -46.6632118f,
+	-45.9107056f, -45.1904564f, -44.4995956f, -43.8356209f,
+	-43.1963463f, -42.5798416f, -41.9843979f, -41.4084969f,
+	-40.8507767f, -40.3100166f, -39.7851181f, -39.2750893f,
+	-38.7790222f, -38.2960968f, -37.8255615f, -37.3667336f,
+	-36.9189796f, -36.4817162f, -36.054409f, -35.6365662f,
+	-35.227726f, -34.8274651f, -34.4353867f, -34.0511246f,
+	-33.6743279f, -33.3046837f, -32.9418831f, -32.5856514f,
+	-32.2357216f, -31.89184f, -31.5537758f, -31.2213097f,
+	-30.8942318f, -30.5723438f, -30.2554626f, -29.943409f,
+	-29.6360168f, -29.3331299f, -29.0345955f, -28.7402706f,
+	-28.4500217f, -28.1637173f, -27.8812332f, -27.6024551f,
+	-27.3272686f, -27.0555649f, -26.7872467f, -26.5222111f,
+	-26.2603664f, -26.0016232f, -25.7458973f, -25.4931011f,
+	-25.2431602f, -24.9959965f, -24.7515392f, -24.509716f,
+	-24.2704601f, -24.0337067f, -23.7993946f, -23.567461f,
+	-23.3378506f, -23.110508f, -22.885376f, -22.6624069f,
+	-22.4415474f, -22.2227497f, -22.00597f, -21.7911587f,
+	-21.5782738f, -21.3672752f, -21.1581192f, -20.9507675f,
+	-20.745182f, -20.5413246f, -20.339159f, -20.1386528f,
+	-19.9397697f, -19.7424774f, -19.5467453f, -19.352541f,
+	-19.1598358f, -18.9686012f, -18.7788067f, -18.5904255f,
+	-18.4034309f, -18.2177982f, -18.0335007f, -17.8505154f,
+	-17.6688156f, -17.4883823f, -17.3091888f, -17.1312141f,
+	-16.9544373f, -16.7788391f, -16.6043949f, -16.4310894f,
+	-16.2588997f, -16.0878086f, -15.9177971f, -15.748848f,
+	-15.5809431f, -15.4140644f, -15.2481976f, -15.0833235f,
+	-14.9194279f, -14.7564955f, -14.5945101f, -14.4334564f,
+	-14.2733212f, -14.11409f, -13.9557486f, -13.7982826f,
+	-13.6416798f, -13.4859276f, -13.3310118f, -13.1769209f,
+	-13.0236425f, -12.8711653f, -12.7194767f, -12.5685654f,
+	-12.4184208f, -12.2690306f, -12.1203861f, -11.9724751f,
+	-11.8252888f, -11.6788149f, -11.5330458f, -11.38797f,
+	-11.2435789f, -11.0998631f, -10.9568138f, -10.8144207f,
+	-10.6726761f, -10.5315714f, -10.3910971f, -10.2512455f,
+	-10.112009f, -9.97337914f, -9.83534718f, -9.69790649f,
+	-9.56104946f, -9.42476749f, -9.28905487f, -9.15390301f,
+	-9.01930618f, -8.88525581f, -8.75174618f, -8.61876965f,
+	-8.4863205f, -8.35439205f, -8.22297859f, -8.09207249f,
+	-7.96166801f, -7.83175945f, -7.7023406f, -7.57340527f,
+	-7.44494867f, -7.31696415f, -7.18944645f, -7.06239033f,
+	-6.93579006f, -6.80964041f, -6.68393612f, -6.55867195f,
+	-6.43384266f, -6.30944347f, -6.18546963f, -6.06191587f,
+	-5.93877792f, -5.81605053f, -5.69372988f, -5.57181025f,
+	-5.45028782f, -5.32915783f, -5.20841646f, -5.08805895f,
+	-4.968081f, -4.84847879f, -4.72924805f, -4.61038446f,
+	-4.49188423f, -4.37374353f, -4.25595808f, -4.13852406f,
+	-4.02143812f, -3.90469646f, -3.78829503f, -3.67223048f,
+	-3.556499f, -3.44109702f, -3.32602143f, -3.21126819f,
+	-3.09683442f, -2.98271656f, -2.8689115f, -2.75541544f,
+	-2.64222574f, -2.52933884f, -2.41675162f, -2.304461f,
+	-2.19246411f, -2.08075786f, -1.96933901f, -1.85820484f,
+	-1.74735224f, -1.63677859f, -1.52648079f, -1.41645622f,
+	-1.30670202f, -1.19721532f, -1.08799362f, -0.979034126f,
+	-0.870334148f, -0.761891186f, -0.653702557f, -0.545765758f,
+	-0.438078254f, -0.330637515f, -0.223441094f, -0.116486549f,
+	-0.00977145042f, 0.0967065766f, 0.202949896f, 0.308960855f,
+	0.414741725f, 0.520294785f, 0.625622392f, 0.730726659f,
+	0.835609853f, 0.940274119f, 1.04472172f, 1.14895463f,
+	1.25297511f, 1.35678518f, 1.46038699f, 1.56378245f,
+	1.66697371f, 1.76996279f, 1.87275147f, 1.97534204f,
+	2.07773614f, 2.17993593f, 2.28194308f, 2.38375974f,
+	2.4853878f, 2.58682871f, 2.68808484f, 2.78915739f,
+	2.89004874f, 2.99076033f, 3.09129405f, 3.19165158f,
+	3.29183483f, 3.39184523f, 3.49168468f, 3.59135461f,
+	3.69085717f, 3.79019356f, 3.88936543f, 3.98837471f,
+	4.08722258f, 4.18591118f, 4.28444195f, 4.38281584f,
+	4.48103523f, 4.57910109f, 4.67701483f, 4.77477884f,
+	4.87239361f, 4.96986103f, 5.06718254f, 5.16436005f,
+	5.26139402f, 5.35828686f, 5.4550395f, 5.55165339f,
+	5.64812994f, 5.7444706f, 5.84067631f, 5.93674946f,
+	6.03269053f, 6.12850094f, 6.22418213f, 6.31973553f,
+	6.41516256f, 6.51046419f, 6.60564184f, 6.70069695f,
+	6.79563046f, 6.8904438f, 6.98513842f, 7.07971525f,
+	7.17417574f, 7.26852083f, 7.36275196f, 7.45687056f,
+	7.55087757f, 7.64477348f, 7.73856068f, 7.8322401f,
+	7.92581177f, 8.01927853f, 8.11264038f, 8.20589828f,
+	8.29905415f, 8.39210892f, 8.48506355f, 8.57791901f,
+	8.67067623f, 8.76333714f, 8.85590267f, 8.94837284f,
+	9.04074955f, 9.13303375f, 9.2252264f, 9.31732941f,
+	9.40934181f, 9.50126648f, 9.59310436f, 9.68485451f,
+	9.77652073f, 9.86810207f, 9.95960045f, 10.0510159f,
+	10.1423502f, 10.2336054f, 10.3247795f, 10.4158764f,
+	10.506896f, 10.5978384f, 10.6887064f, 10.7794991f,
+	10.8702183f, 10.960865f, 11.0514402f, 11.1419449f,
+	11.232379f, 11.3227444f, 11.4130421f, 11.503273f,
+	11.5934372f, 11.6835365f, 11.773571f, 11.8635426f,
+	11.9534512f, 12.0432987f, 12.1330853f, 12.2228107f,
+	12.3124781f, 12.4020872f, 12.4916391f, 12.5811348f,
+	12.6705742f, 12.7599592f, 12.8492899f, 12.9385681f,
+	13.0277939f, 13.1169682f, 13.2060919f, 13.295166f,
+	13.3841906f, 13.4731684f, 13.5620975f, 13.6509809f,
+	13.7398186f, 13.8286114f, 13.9173603f, 14.0060654f,
+	14.0947285f, 14.1833506f, 14.2719307f, 14.3604717f,
+	14.4489727f, 14.5374355f, 14.6258612f, 14.7142496f,
+	14.8026018f, 14.8909187f, 14.9792004f, 15.0674486f,
+	15.1556644f, 15.2438469f, 15.3319988f, 15.4201193f,
+	15.5082102f, 15.5962715f, 15.6843042f, 15.7723093f,
+	15.8602877f, 15.9482393f, 16.0361652f, 16.1240673f,
+	16.2119446f, 16.299799f, 16.3876305f, 16.475441f,
+	16.5632286f, 16.6509972f, 16.7387466f, 16.8264751f,
+	16.9141865f, 17.0018806f, 17.0895576f, 17.1772194f,
+	17.2648659f, 17.3524971f, 17.4401131f, 17.5277176f,
+	17.6153107f, 17.7028904f, 17.7904587f, 17.8780174f,
+	17.9655666f, 18.0531063f, 18.1406384f, 18.2281628f,
+	18.3156796f, 18.4031906f, 18.4906979f, 18.5781975f,
+	18.6656952f, 18.7531891f, 18.8406811f, 18.9281693f,
+	19.0156574f, 19.1031456f, 19.1906338f, 19.2781219f,
+	19.365612f, 19.453104f, 19.5405998f, 19.6280994f,
+	19.715601f, 19.8031101f, 19.8906231f, 19.9781437f,
+	20.0656719f, 20.1532059f, 20.2407494f, 20.3283024f,
+	20.4158649f, 20.503437f, 20.5910225f, 20.6786175f,
+	20.7662258f, 20.8538475f, 20.9414825f, 21.0291328f,
+	21.1167984f, 21.2044811f, 21.2921791f, 21.3798943f,
+	21.4676285f, 21.5553799f, 21.6431522f, 21.7309437f,
+	21.8187561f, 21.9065895f, 21.9944458f, 22.082325f,
+	22.1702271f, 22.2581539f, 22.3461056f, 22.434082f,
+	22.5220852f, 22.610117f, 22.6981735f, 22.7862606f,
+	22.8743763f, 22.9625206f, 23.0506973f, 23.1389027f,
+	23.2271423f, 23.3154125f, 23.403717f, 23.492054f,
+	23.5804272f, 23.6688347f, 23.7572803f, 23.8457603f,
+	23.9342785f, 24.0228348f, 24.1114292f, 24.2000637f,
+	24.2887383f, 24.3774548f, 24.4662113f, 24.5550098f,
+	24.6438541f, 24.7327404f, 24.8216705f, 24.9106464f,
+	24.9996681f, 25.0887375f, 25.1778526f, 25.2670155f,
+	25.3562298f, 25.4454918f, 25.5348034f, 25.6241665f,
+	25.7135811f, 25.8030491f, 25.8925705f, 25.9821453f,
+	26.0717735f, 26.1614571f, 26.2511978f, 26.3409958f,
+	26.430851f, 26.5207634f, 26.6107368f, 26.7007675f,
+	26.7908611f, 26.8810139f, 26.9712315f, 27.0615101f,
+	27.1518517f, 27.2422581f, 27.3327312f, 27.4232693f,
+	27.5138741f, 27.6045456f, 27.6952858f, 27.7860947f,
+	27.8769722f, 27.9679222f, 28.0589428f, 28.1500359f,
+	28.2412014f, 28.3324413f, 28.4237556f, 28.5151443f,
+	28.6066093f, 28.6981506f, 28.789772f, 28.8814697f,
+	28.9732475f, 29.0651054f, 29.1570435f, 29.2490635f,
+	29.3411674f, 29.4333534f, 29.5256252f, 29.617981f,
+	29.7104225f, 29.8029518f, 29.8955669f, 29.9882717f,
+	30.0810661f, 30.1739502f, 30.2669258f, 30.359993f,
+	30.4531536f, 30.5464077f, 30.6397552f, 30.7332001f,
+	30.8267403f, 30.9203777f, 31.0141125f, 31.1079464f,
+	31.2018814f, 31.2959156f, 31.3900528f, 31.484293f,
+	31.5786343f, 31.6730824f, 31.7676353f, 31.8622932f,
+	31.9570599f, 32.0519333f, 32.1469193f, 32.242012f,
+	32.3372154f, 32.4325333f, 32.5279617f, 32.6235085f,
+	32.7191658f, 32.8149414f, 32.9108315f, 33.0068398f,
+	33.1029701f, 33.1992149f, 33.2955856f, 33.3920746f,
+	33.4886894f, 33.5854263f, 33.6822891f, 33.7792778f,
+	33.8763962f, 33.9736366f, 34.0710106f, 34.1685143f,
+	34.2661476f, 34.3639145f, 34.4618149f, 34.5598526f,
+	34.65802f, 34.7563286f, 34.8547745f, 34.9533577f,
+	35.0520821f, 35.1509476f, 35.2499542f, 35.3491058f,
+	35.4484024f, 35.5478439f, 35.6474304f, 35.7471695f,
+	35.8470535f, 35.9470901f, 36.0472794f, 36.1476212f,
+	36.2481155f, 36.3487663f, 36.4495735f, 36.5505371f,
+	36.6516609f, 36.7529449f, 36.8543892f, 36.9559975f,
+	37.0577698f, 37.1597061f, 37.2618103f, 37.3640823f,
+	37.466526f, 37.5691376f, 37.6719208f, 37.7748756f,
+	37.8780098f, 37.9813156f, 38.0848007f, 38.1884651f,
+	38.2923088f, 38.3963318f, 38.5005417f, 38.6049347f,
+	38.7095108f, 38.8142776f, 38.9192314f, 39.0243759f,
+	39.1297112f, 39.2352409f, 39.3409615f, 39.4468842f,
+	39.5530014f, 39.659317f, 39.765831f, 39.872551f,
+	39.9794731f, 40.0866013f, 40.1939392f, 40.3014793f,
+	40.4092331f, 40.5172005f, 40.6253815f, 40.7337723f,
+	40.8423843f, 40.9512138f, 41.0602646f, 41.1695366f,
+	41.2790298f, 41.388752f, 41.4986992f, 41.6088753f,
+	41.7192841f, 41.8299217f, 41.9407959f, 42.0519066f,
+	42.1632538f, 42.2748413f, 42.386673f, 42.498745f,
+	42.6110649f, 42.723629f, 42.8364449f, 42.9495125f,
+	43.0628319f, 43.1764069f, 43.2902412f, 43.404335f,
+	43.5186882f, 43.6333046f, 43.748188f, 43.8633385f,
+	43.9787598f, 44.0944519f, 44.2104187f, 44.3266602f,
+	44.4431801f, 44.5599823f, 44.6770706f, 44.7944412f,
+	44.9120979f, 45.0300446f, 45.1482849f, 45.266819f,
+	45.3856506f, 45.5047836f, 45.624218f, 45.7439537f,
+	45.8639984f, 45.9843521f, 46.1050148f, 46.2259941f,
+	46.34729f, 46.4689064f, 46.5908432f, 46.7131081f,
+	46.8356972f, 46.9586182f, 47.081871f, 47.2054596f,
+	47.3293877f, 47.4536552f, 47.5782661f, 47.703228f,
+	47.828537f, 47.9542007f, 48.0802193f, 48.2065964f,
+	48.3333359f, 48.4604378f, 48.5879097f, 48.7157555f,
+	48.8439713f, 48.9725685f, 49.1015434f, 49.2309036f,
+	49.3606491f, 49.4907875f, 49.6213226f, 49.7522507f,
+	49.8835831f, 50.015316f, 50.1474609f, 50.2800179f,
+	50.4129868f, 50.5463753f, 50.6801872f, 50.8144264f,
+	50.9490967f, 51.084198f, 51.219738f, 51.3557205f,
+	51.4921494f, 51.6290245f, 51.7663574f, 51.9041481f,
+	52.0423965f, 52.181118f, 52.3203049f, 52.4599686f,
+	52.6001129f, 52.7407379f, 52.8818512f, 53.0234604f,
+	53.1655655f, 53.3081703f, 53.4512863f, 53.5949097f,
+	53.7390518f, 53.8837128f, 54.028904f, 54.1746216f,
+	54.3208771f, 54.4676743f, 54.6150169f, 54.7629128f,
+	54.9113655f, 55.0603828f, 55.2099648f, 55.3601227f,
+	55.5108604f, 55.6621819f, 55.8140945f, 55.9666023f,
+	56.1197128f, 56.2734337f, 56.4277687f, 56.5827255f,
+	56.738308f, 56.8945236f, 57.0513802f, 57.2088852f,
+	57.3670425f, 57.5258598f, 57.6853409f, 57.8455009f,
+	58.0063362f, 58.1678619f, 58.3300858f, 58.4930077f,
+	58.6566429f, 58.8209953f, 58.9860725f, 59.1518822f,
+	59.3184319f, 59.485733f, 59.6537895f, 59.8226128f,
+	59.9922066f, 60.1625862f, 60.3337555f, 60.5057259f,
+	60.6785049f, 60.8521004f, 61.0265236f, 61.2017822f,
+	61.3778877f, 61.5548477f, 61.7326736f, 61.9113731f,
+	62.0909615f, 62.2714462f, 62.4528351f, 62.6351395f,
+	62.8183746f, 63.0025482f, 63.1876717f, 63.3737564f,
+	63.5608139f, 63.7488556f, 63.9378929f, 64.1279449f,
+	64.3190155f, 64.511116f, 64.7042694f, 64.8984756f,
+	65.0937576f, 65.2901306f, 65.4876022f, 65.6861877f,
+	65.8859024f, 66.0867615f, 66.2887802f, 66.4919662f,
+	66.6963501f, 66.9019318f, 67.1087341f, 67.3167801f,
+	67.5260773f, 67.7366409f, 67.948494f, 68.1616516f,
+	68.3761292f, 68.5919571f, 68.8091354f, 69.0276947f,
+	69.2476578f, 69.4690399f, 69.6918564f, 69.9161301f,
+	70.1418839f, 70.3691483f, 70.5979309f, 70.8282547f,
+	71.0601501f, 71.2936401f, 71.5287476f, 71.7654953f,
+	72.0039062f, 72.2440109f, 72.4858246f, 72.729393f,
+	72.9747238f, 73.2218628f, 73.4708176f, 73.7216415f,
+	73.9743423f, 74.2289658f, 74.4855347f, 74.7440796f,
+	75.0046387f, 75.2672501f, 75.5319366f, 75.7987442f,
+	76.0676956f, 76.3388443f, 76.6122131f, 76.8878555f,
+	77.1657944f, 77.4460831f, 77.7287598f, 78.0138702f,
+	78.3014526f, 78.5915604f, 78.8842316f, 79.1795197f,
+	79.4774704f, 79.7781372f, 80.0815659f, 80.3878174f,
+	80.6969452f, 81.0090027f, 81.3240509f, 81.6421432f,
+	81.9633484f, 82.2877197f, 82.6153336f, 82.9462585f,
+	83.2805481f, 83.6182938f, 83.959549f, 84.3044052f,
+	84.6529312f, 85.0052109f, 85.3613205f, 85.7213593f,
+	86.0854111f, 86.4535675f, 86.8259125f, 87.2025604f,
+	87.5836029f, 87.9691544f, 88.3593063f, 88.7541885f,
+	89.1539078f, 89.5585861f, 89.9683533f, 90.3833389f,
+	90.8036728f, 91.2294998f, 91.6609573f, 92.0982056f,
+	92.5413971f, 92.9906921f, 93.4462738f, 93.9083023f,
+	94.3769684f, 94.8524704f, 95.3349991f, 95.8247681f,
+	96.3219986f, 96.8269119f, 97.3397446f, 97.8607559f,
+	98.3902054f, 98.92836f, 99.475502f, 100.031944f,
+	100.597992f, 101.173981f, 101.760262f, 102.357185f,
+	102.965157f, 103.584572f, 104.215858f, 104.859467f,
+	105.515877f, 106.185593f, 106.869156f, 107.567123f,
+	108.280098f, 109.00872f, 109.753677f, 110.515671f,
+	111.295494f, 112.093956f, 112.911934f, 113.750381f,
+	114.610298f, 115.492767f, 116.398956f, 117.330116f,
+	118.287613f, 119.272896f, 120.28756f, 121.333321f,
+	122.412056f, 123.525818f, 124.676819f, 125.867531f,
+	127.100624f, 128.379074f, 129.706161f, 131.08551f,
+	132.521164f, 134.01767f, 135.580063f, 137.214066f,
+	138.926163f, 140.723679f, 142.615036f, 144.609894f,
+	146.719452f, 148.956772f, 151.337173f, 153.878876f,
+	156.603622f, 159.537735f, 162.71344f, 166.170746f,
+	169.960098f, 174.146317f, 178.814377f, 184.078674f,
+	190.097977f, 197.101028f, 205.43364f, 215.652191f,
+	228.731766f, 246.607452f, 273.97525f, 327.827515f
+};